@@ -44,6 +44,8 @@
 #define X_EXT    0x04    // External compression codec via magic num (gz, xz, bz2)
 #define X_ORDER  0x03    // Mask to obtain order
 
+#define MAX_LANES 32
+
 #include "config.h"
 
 #ifdef HAVE_LIBBZ2
@@ -77,17 +79,22 @@
 unsigned int arith_compress_bound(unsigned int size, int order) {
     int N = (order>>8) & 0xff;
     if (!N) N=4;
+    int NL = (order>>21) & 0x3f;
+    if (!NL) NL=4;
     return (order == 0
         ? 1.05*size + 257*3 + 4
         : 1.05*size + 257*257*3 + 4 + 257*3+4) + 5 +
         ((order & X_PACK) ? 1 : 0) +
         ((order & X_RLE) ? 1 + 257*3+4: 0) +
-        ((order & X_STRIPE) ? 7 + 5*N: 0);
+        ((order & X_STRIPE) ? 7 + 5*N: 0) +
+        ((order & ARITH_ORDER_LANES) ? 3 + NL*(5 + 257*3+4 + 5) : 0);
 }
 
 #ifndef MODEL_256 // see fqzcomp_qual_fuzz.c
 #define NSYM 256
+#define SIMPLE_MODEL_BLOCKS
 #include "c_simple_model.h"
+#undef SIMPLE_MODEL_BLOCKS
 #endif
 
 // Compresses in_size bytes from 'in' to *out_size bytes in 'out'.
@@ -187,8 +194,10 @@ unsigned char *arith_compress_O1(unsigned char *in, unsigned int in_size,
         m++;
     }
     *out = m;
-    for (i = 0; i < 256; i++)
-        SIMPLE_MODEL(256,_init)(&byte_model[i], m);
+
+    // Contexts are initialised on first use, as small blocks often
+    // touch only a few of them.
+    uint8_t model_init[256] = {0};
 
     RangeCoder rc;
     RC_SetOutput(&rc, (char *)out+1);
@@ -196,6 +205,10 @@ unsigned char *arith_compress_O1(unsigned char *in, unsigned int in_size,
 
     uint8_t last = 0;
     for (i = 0; i < in_size; i++) {
+        if (!model_init[last]) {
+            SIMPLE_MODEL(256,_init)(&byte_model[last], m);
+            model_init[last] = 1;
+        }
         SIMPLE_MODEL(256, _encodeSymbol)(&byte_model[last], &rc, in[i]);
         last = in[i];
     }
@@ -229,14 +242,17 @@ unsigned char *arith_uncompress_O1(unsigned char *in, unsigned int in_size,
     }
 
     unsigned int m = in[0] ? in[0] : 256, i;
-    for (i = 0; i < 256; i++)
-        SIMPLE_MODEL(256,_init)(&byte_model[i], m);
+    uint8_t model_init[256] = {0};
 
     RC_SetInput(&rc, (char *)in+1, (char *)in+in_size);
     RC_StartDecode(&rc);
 
     unsigned char last = 0;
     for (i = 0; i < out_sz; i++) {
+        if (!model_init[last]) {
+            SIMPLE_MODEL(256,_init)(&byte_model[last], m);
+            model_init[last] = 1;
+        }
         out[i] = SIMPLE_MODEL(256, _decodeSymbol)(&byte_model[last], &rc);
         last = out[i];
     }
@@ -247,6 +263,179 @@ unsigned char *arith_uncompress_O1(unsigned char *in, unsigned int in_size,
     return out;
 }
 
+//-----------------------------------------------------------------------------
+// Multi-lane order-0 and order-1 coding.
+//
+// The input is split into K contiguous lanes, each encoded as a normal
+// order-0 or order-1 stream above with its own models and range coder.
+// Lanes are independent, so they can be encoded and decoded on separate
+// threads.
+//
+// The lanes are stored under X_EXT, so the order byte keeps its CRAM
+// meaning, and identified by a magic number no external codec may use.
+// Format: magic (2 bytes), K (1 byte), the compressed size of the first
+// K-1 lanes (var_u32 each; the last lane takes the remainder), then the
+// K lane streams.
+static const unsigned char lanes_magic[2] = {0, 'L'};
+#define LANES_MAGIC_LEN 2
+
+static inline int arith_is_lanes(unsigned char *in, unsigned int in_size) {
+    return in_size >= LANES_MAGIC_LEN &&
+        memcmp(in, lanes_magic, LANES_MAGIC_LEN) == 0;
+}
+
+static inline unsigned int lane_len(unsigned int size, int K, int k) {
+    return size / K + ((size % K) > k);
+}
+
+typedef struct {
+    unsigned char *in;
+    unsigned char *out;
+    unsigned int in_off[MAX_LANES], in_len[MAX_LANES];
+    unsigned int out_off[MAX_LANES], out_len[MAX_LANES];
+    int order;
+    int err[MAX_LANES];
+} arith_lanes;
+
+static void arith_lane_encode(void *arg, int k) {
+    arith_lanes *l = (arith_lanes *)arg;
+    unsigned int olen = l->out_len[k];
+    if (!(l->order
+          ? arith_compress_O1(l->in + l->in_off[k], l->in_len[k],
+                              l->out + l->out_off[k], &olen)
+          : arith_compress_O0(l->in + l->in_off[k], l->in_len[k],
+                              l->out + l->out_off[k], &olen)))
+        l->err[k] = 1;
+    l->out_len[k] = olen;
+}
+
+static void arith_lane_decode(void *arg, int k) {
+    arith_lanes *l = (arith_lanes *)arg;
+    if (!(l->order
+          ? arith_uncompress_O1(l->in + l->in_off[k], l->in_len[k],
+                                l->out + l->out_off[k], l->out_len[k])
+          : arith_uncompress_O0(l->in + l->in_off[k], l->in_len[k],
+                                l->out + l->out_off[k], l->out_len[k])))
+        l->err[k] = 1;
+}
+
+static
+unsigned char *arith_compress_lanes(unsigned char *in, unsigned int in_size,
+                                    unsigned char *out, unsigned int *out_size,
+                                    int order, int K, int nthreads) {
+    arith_lanes l = {in, out, {0}, {0}, {0}, {0}, order, {0}};
+    unsigned int used = 0;
+    int k;
+
+    if (K < 1 || K > MAX_LANES || in_size < K)
+        return NULL;
+
+    // Write the lanes after the largest possible meta-data, and move them
+    // down once we know the sizes.
+    unsigned int meta = LANES_MAGIC_LEN + 1 + 5*(K-1);
+    if (*out_size < meta)
+        return NULL;
+
+    for (k = 0; k < K; k++) {
+        l.in_len[k] = lane_len(in_size, K, k);
+        l.in_off[k] = k ? l.in_off[k-1] + l.in_len[k-1] : 0;
+    }
+
+    if (nthreads > 1) {
+        // Each lane needs its own worst case sized slot
+        uint64_t slot = arith_compress_bound(l.in_len[0], order);
+        if (!(l.out = malloc(slot * K)))
+            return NULL;
+        for (k = 0; k < K; k++) {
+            l.out_off[k] = k * slot;
+            l.out_len[k] = slot;
+        }
+        int err = htscodecs_run_jobs(nthreads, K, arith_lane_encode, &l) < 0;
+        for (k = 0; k < K; k++) {
+            err |= l.err[k];
+            if (!err && meta + used + l.out_len[k] > *out_size)
+                err = 1;
+            if (!err)
+                memcpy(out + meta + used, l.out + l.out_off[k], l.out_len[k]);
+            used += l.out_len[k];
+        }
+        free(l.out);
+        if (err)
+            return NULL;
+    } else {
+        for (k = 0; k < K; k++) {
+            l.out_off[k] = meta + used;
+            l.out_len[k] = *out_size - meta - used;
+            arith_lane_encode(&l, k);
+            if (l.err[k])
+                return NULL;
+            used += l.out_len[k];
+        }
+    }
+
+    unsigned char *cp = out;
+    memcpy(cp, lanes_magic, LANES_MAGIC_LEN);
+    cp += LANES_MAGIC_LEN;
+    *cp++ = K;
+    for (k = 0; k < K-1; k++)
+        cp += var_put_u32(cp, out+meta, l.out_len[k]);
+    memmove(cp, out+meta, used);
+    *out_size = cp - out + used;
+
+    return out;
+}
+
+static
+unsigned char *arith_uncompress_lanes(unsigned char *in, unsigned int in_size,
+                                      unsigned char *out, unsigned int out_sz,
+                                      int order, int nthreads) {
+    unsigned char *in_end = in + in_size;
+    arith_lanes l = {in, out, {0}, {0}, {0}, {0}, order, {0}};
+    unsigned int off, K, k, n;
+    uint64_t ctot = 0;
+
+    if (!arith_is_lanes(in, in_size) || in_size < LANES_MAGIC_LEN + 1)
+        return NULL;
+    off = LANES_MAGIC_LEN;
+    K = in[off++];
+    if (K < 1 || K > MAX_LANES || out_sz < K)
+        return NULL;
+
+    for (k = 0; k < K-1; k++) {
+        n = var_get_u32(in+off, in_end, &l.in_len[k]);
+        if (!n || l.in_len[k] < 1)
+            return NULL;
+        off += n;
+        ctot += l.in_len[k];
+        if (off + ctot >= in_size)
+            return NULL;
+    }
+    if (off + ctot >= in_size)
+        return NULL;
+    l.in_len[K-1] = in_size - off - ctot;
+
+    for (k = 0; k < K; k++) {
+        l.in_off[k]  = k ? l.in_off[k-1] + l.in_len[k-1] : off;
+        l.out_len[k] = lane_len(out_sz, K, k);
+        l.out_off[k] = k ? l.out_off[k-1] + l.out_len[k-1] : 0;
+    }
+
+    int err = 0;
+    if (nthreads > 1) {
+        err = htscodecs_run_jobs(nthreads, K, arith_lane_decode, &l) < 0;
+    } else {
+        for (k = 0; k < K; k++) {
+            arith_lane_decode(&l, k);
+            if (l.err[k])
+                break;
+        }
+    }
+    for (k = 0; k < K; k++)
+        err |= l.err[k];
+
+    return err ? NULL : out;
+}
+
 //-----------------------------------------------------------------------------
 
 // Disable O2 for now
@@ -397,6 +586,136 @@ unsigned char *arith_uncompress_O2(unsigned char *in, unsigned int in_size,
 }
 
 #endif // Disable O2
+
+//-----------------------------------------------------------------------------
+// External codecs for X_EXT.
+//
+// The external codec's output is stored as-is, so the decoder picks the
+// codec by matching the magic number at the start of the stream.  Entry
+// 0 is unused and entry 1 is the built-in bzip2, when compiled in.
+#ifdef HAVE_LIBBZ2
+static int bz2_compress(void *data, unsigned char *in, unsigned int in_size,
+                        unsigned char *out, unsigned int *out_size) {
+    return BZ_OK == BZ2_bzBuffToBuffCompress((char *)out, out_size,
+                                             (char *)in, in_size, 9, 0, 30)
+        ? 0 : -1;
+}
+
+static int bz2_uncompress(void *data, unsigned char *in, unsigned int in_size,
+                          unsigned char *out, unsigned int *out_size) {
+    return BZ_OK == BZ2_bzBuffToBuffDecompress((char *)out, out_size,
+                                               (char *)in, in_size, 0, 0)
+        ? 0 : -1;
+}
+#endif
+
+static arith_ext_codec ext_codecs[ARITH_EXT_MAX] = {
+    {0},
+#ifdef HAVE_LIBBZ2
+    {"bzip2", "BZh", 3, NULL, bz2_compress, bz2_uncompress},
+#endif
+};
+static int n_ext_codecs = 2;
+
+int arith_register_ext(const arith_ext_codec *codec) {
+    int i;
+
+    if (!codec || !codec->compress || !codec->uncompress ||
+        codec->magic_len < 1 || codec->magic_len > sizeof(codec->magic))
+        return -1;
+
+    if (n_ext_codecs >= ARITH_EXT_MAX)
+        return -1;
+
+    if (memcmp(lanes_magic, codec->magic,
+               MIN(LANES_MAGIC_LEN, codec->magic_len)) == 0)
+        return -1;
+
+    for (i = 1; i < n_ext_codecs; i++) {
+        arith_ext_codec *c = &ext_codecs[i];
+        if (c->compress &&
+            memcmp(c->magic, codec->magic,
+                   MIN(c->magic_len, codec->magic_len)) == 0)
+            return -1; // ambiguous when decoding
+    }
+
+    ext_codecs[n_ext_codecs] = *codec;
+    return n_ext_codecs++;
+}
+
+// Compresses with external codec id, or with id 0 all available codecs
+// (bzip2 and any registered ones) keeping the smallest.
+// Returns 0 on success, -1 if no codec succeeded and -2 if there is no
+// such codec.
+static int arith_compress_ext(unsigned char *in, unsigned int in_size,
+                              unsigned char *out, unsigned int *out_size,
+                              int id) {
+    int i, first, last;
+    unsigned int best = 0;
+    unsigned char *tmp = NULL;
+
+    if (id) {
+        if (id >= n_ext_codecs)
+            return -2;
+        first = last = id;
+    } else {
+        first = 1;
+        last  = n_ext_codecs-1;
+    }
+    for (i = first; i <= last; i++)
+        if (ext_codecs[i].compress)
+            break;
+    if (i > last)
+        return -2;
+
+    for (i = first; i <= last; i++) {
+        arith_ext_codec *c = &ext_codecs[i];
+        if (!c->compress)
+            continue;
+
+        // The first success is written in place, later ones only
+        // replace it if smaller.
+        unsigned char *dst = out;
+        unsigned int len = *out_size;
+        if (best) {
+            if (!tmp && !(tmp = malloc(*out_size)))
+                break;
+            dst = tmp;
+        }
+
+        if (c->compress(c->data, in, in_size, dst, &len) < 0 ||
+            len < c->magic_len || memcmp(dst, c->magic, c->magic_len) != 0)
+            continue;
+
+        if (!best || len < best) {
+            if (dst != out)
+                memcpy(out, dst, len);
+            best = len;
+        }
+    }
+
+    free(tmp);
+    if (!best)
+        return -1;
+
+    *out_size = best;
+    return 0;
+}
+
+// Returns 0 on success, with *out_size set to the uncompressed size.
+static int arith_uncompress_ext(unsigned char *in, unsigned int in_size,
+                                unsigned char *out, unsigned int *out_size) {
+    int i;
+    for (i = 1; i < n_ext_codecs; i++) {
+        arith_ext_codec *c = &ext_codecs[i];
+        if (c->uncompress && in_size >= c->magic_len &&
+            memcmp(in, c->magic, c->magic_len) == 0)
+            return c->uncompress(c->data, in, in_size, out, out_size);
+    }
+
+    return -1;
+}
+
 /*-----------------------------------------------------------------------------
  */
 
@@ -675,13 +994,15 @@ unsigned char *arith_uncompress_O1_RLE(unsigned char *in, unsigned int in_size,
  *
  * Smallest is method, <in_size> <input>, so worst case 2 bytes longer.
  */
-unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
-                                 unsigned char *out, unsigned int *out_size,
-                                 int order) {
+static
+unsigned char *arith_compress_to_int(unsigned char *in,  unsigned int in_size,
+                                     unsigned char *out, unsigned int *out_size,
+                                     int order, int nthreads) {
     unsigned int c_meta_len;
     uint8_t *rle = NULL, *packed = NULL;
 
-    if (in_size > INT_MAX) {
+    if (in_size > INT_MAX ||
+        ((order & ARITH_ORDER_LANES) && ((order>>21)&0x3f) > MAX_LANES)) {
         *out_size = 0;
         return NULL;
     }
@@ -704,7 +1025,7 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
     }
 
     if (order & X_STRIPE) {
-        int N = (order>>8);
+        int N = (order>>8) & 0xff;
         if (N == 0) N = 4; // default for compatibility with old tests
 
         if (N > 255)
@@ -819,18 +1140,25 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
         return out;
     }
 
-    int do_pack = order & X_PACK;
-    int do_rle  = order & X_RLE;
-    int no_size = order & X_NOSZ;
-    int do_ext  = order & X_EXT;
+    int do_pack  = order & X_PACK;
+    int do_rle   = order & X_RLE;
+    int no_size  = order & X_NOSZ;
+    int do_ext   = order & X_EXT;
+    int ext_id   = (order>>16) & 0xf;
+    int do_lanes = order & ARITH_ORDER_LANES;
+    int nlanes   = ((order>>21) & 0x3f) ? (order>>21) & 0x3f : 4;
+
+    // Lanes only apply to the plain order-0 and order-1 codecs
+    if (do_rle || do_ext)
+        do_lanes = 0;
 
-    out[0] = order;
+    out[0] = order | (do_lanes ? X_EXT : 0);
     c_meta_len = 1;
 
     if (!no_size)
         c_meta_len += var_put_u32(&out[1], out_end, in_size);
 
-    order &= 0x3;
+    order &= X_ORDER;
 
     // Format is compressed meta-data, compressed data.
     // Meta-data can be empty, pack, rle lengths, or pack + rle lengths.
@@ -868,22 +1196,25 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
 
     *out_size -= c_meta_len;
     if (order && in_size < 8) {
-        out[0] &= ~3;
-        order  &= ~3;
+        out[0] &= ~X_ORDER;
+        order  &= ~X_ORDER;
+    }
+    if (do_lanes && in_size < nlanes) {
+        out[0] &= ~X_EXT;
+        do_lanes = 0;
     }
 
     if (do_ext) {
         // Use an external compression library instead.
-        // For now, bzip2
-#ifdef HAVE_LIBBZ2
-        if (BZ_OK != BZ2_bzBuffToBuffCompress((char *)out+c_meta_len, out_size,
-                                              (char *)in, in_size, 9, 0, 30))
-            *out_size = in_size; // Didn't fit with bz2; force X_CAT below instead
-#else
-        fprintf(stderr, "Htscodecs has been compiled without libbz2 support\n");
-        free(out);
-        return NULL;
-#endif
+        int r = arith_compress_ext(in, in_size, out+c_meta_len, out_size,
+                                   ext_id);
+        if (r == -2) {
+            fprintf(stderr, "Htscodecs has no external codec %d\n", ext_id);
+            free(out);
+            return NULL;
+        }
+        if (r < 0)
+            *out_size = in_size; // Didn't fit; force X_CAT below instead
 
 //      // lzma doesn't help generally, at least not for the name tokeniser
 //      size_t lzma_size = 0;
@@ -902,7 +1233,11 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
             //if (order == 2)
             //  arith_compress_O2(in, in_size, out+c_meta_len, out_size);
             //else
-            if (order == 1)
+            if (do_lanes) {
+                if (!arith_compress_lanes(in, in_size, out+c_meta_len,
+                                          out_size, order, nlanes, nthreads))
+                    *out_size = in_size; // Didn't fit; force X_CAT below
+            } else if (order == 1)
                 arith_compress_O1(in, in_size, out+c_meta_len, out_size);
             else
                 arith_compress_O0(in, in_size, out+c_meta_len, out_size);
@@ -910,7 +1245,7 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
     }
 
     if (*out_size >= in_size) {
-        out[0] &= ~(3|X_EXT); // no entropy encoding, but keep e.g. PACK
+        out[0] &= ~(X_ORDER|X_EXT); // no entropy encoding, but keep e.g. PACK
         out[0] |= X_CAT | no_size;
         memcpy(out+c_meta_len, in, in_size);
         *out_size = in_size;
@@ -924,13 +1259,27 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
     return out;
 }
 
+unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
+                                 unsigned char *out, unsigned int *out_size,
+                                 int order) {
+    return arith_compress_to_int(in, in_size, out, out_size, order, 1);
+}
+
+unsigned char *arith_compress_to_mt(unsigned char *in,  unsigned int in_size,
+                                    unsigned char *out, unsigned int *out_size,
+                                    int order, int nthreads) {
+    return arith_compress_to_int(in, in_size, out, out_size, order, nthreads);
+}
+
 unsigned char *arith_compress(unsigned char *in, unsigned int in_size,
                               unsigned int *out_size, int order) {
     return arith_compress_to(in, in_size, NULL, out_size, order);
 }
 
-unsigned char *arith_uncompress_to(unsigned char *in,  unsigned int in_size,
-                                   unsigned char *out, unsigned int *out_size) {
+static
+unsigned char *arith_uncompress_to_int(unsigned char *in,  unsigned int in_size,
+                                       unsigned char *out,
+                                       unsigned int *out_size, int nthreads) {
     unsigned char *in_end = in + in_size;
     unsigned char *out_free = NULL;
     unsigned char *tmp_free = NULL;
@@ -1021,7 +1370,7 @@ unsigned char *arith_uncompress_to(unsigned char *in,  unsigned int in_size,
     int do_cat  = order & X_CAT;
     int no_size = order & X_NOSZ;
     int do_ext  = order & X_EXT;
-    order &= 3;
+    order &= X_ORDER;
 
     int sz = 0;
     unsigned int osz;
@@ -1121,15 +1470,13 @@ unsigned char *arith_uncompress_to(unsigned char *in,  unsigned int in_size,
             if (tmp1_size > *out_size)
                 goto err;
             memcpy(tmp1, in, tmp1_size);
+        } else if (do_ext && arith_is_lanes(in, in_size)) {
+            if (!arith_uncompress_lanes(in, in_size, tmp1, tmp1_size,
+                                        order, nthreads))
+                goto err;
         } else if (do_ext) {
-#ifdef HAVE_LIBBZ2
-            if (BZ_OK != BZ2_bzBuffToBuffDecompress((char *)tmp1, &tmp1_size,
-                                                    (char *)in, in_size, 0, 0))
+            if (arith_uncompress_ext(in, in_size, tmp1, &tmp1_size) < 0)
                 goto err;
-#else
-            fprintf(stderr, "Htscodecs has been compiled without libbz2 support\n");
-            goto err;
-#endif
           } else {
             // in -> tmp1
             if (do_rle) {
@@ -1176,7 +1523,38 @@ unsigned char *arith_uncompress_to(unsigned char *in,  unsigned int in_size,
     return NULL;
 }
 
+unsigned char *arith_uncompress_to(unsigned char *in,  unsigned int in_size,
+                                   unsigned char *out, unsigned int *out_size) {
+    return arith_uncompress_to_int(in, in_size, out, out_size, 1);
+}
+
+unsigned char *arith_uncompress_to_mt(unsigned char *in,  unsigned int in_size,
+                                      unsigned char *out,
+                                      unsigned int *out_size, int nthreads) {
+    return arith_uncompress_to_int(in, in_size, out, out_size, nthreads);
+}
+
 unsigned char *arith_uncompress(unsigned char *in, unsigned int in_size,
                                 unsigned int *out_size) {
     return arith_uncompress_to(in, in_size, NULL, out_size);
 }
+
+uint64_t arith_compress_bound_64(uint64_t size, int order, uint32_t seg_size) {
+    return htscodecs_seg_bound(size, seg_size, order, arith_compress_bound);
+}
+
+unsigned char *arith_compress_to_64(unsigned char *in, uint64_t in_size,
+                                    unsigned char *out, uint64_t *out_size,
+                                    int order, uint32_t seg_size,
+                                    int nthreads) {
+    return htscodecs_seg_compress(in, in_size, out, out_size, order,
+                                  seg_size, nthreads,
+                                  arith_compress_bound, arith_compress_to);
+}
+
+unsigned char *arith_uncompress_to_64(unsigned char *in, uint64_t in_size,
+                                      unsigned char *out, uint64_t *out_size,
+                                      int nthreads) {
+    return htscodecs_seg_uncompress(in, in_size, out, out_size, nthreads,
+                                    arith_uncompress_to);
+}
@@ -34,6 +34,8 @@
 #ifndef ARITH_DYNAMIC_H
 #define ARITH_DYNAMIC_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -53,6 +55,98 @@ unsigned char *arith_uncompress_to(unsigned char *in, unsigned int in_size,
 
 unsigned int arith_compress_bound(unsigned int size, int order);
 
+/*
+ * Splits plain order-0 and order-1 data into N contiguous lanes, each
+ * with its own models and range coder.  N is held in bits 21 to 26 of
+ * order (see ARITH_ORDER_LANES_N; default 4, at most 32).  This applies
+ * to plain order-0 and order-1 coding, not RLE or ARITH_ORDER_EXT.
+ *
+ * The lanes are stored as a built-in external codec stream, so the
+ * order byte keeps its CRAM 3.1 meaning, but the data is not part of
+ * CRAM 3.1.
+ */
+#define ARITH_ORDER_LANES (1<<20)
+#define ARITH_ORDER_LANES_N(n) (ARITH_ORDER_LANES | ((n)<<21))
+
+/*
+ * As arith_compress_to and arith_uncompress_to, but coding the lanes of
+ * ARITH_ORDER_LANES data on up to nthreads threads.  Other data is
+ * handled as by the single threaded functions, and the output is
+ * identical.
+ */
+unsigned char *arith_compress_to_mt(unsigned char *in,  unsigned int in_size,
+                                    unsigned char *out, unsigned int *out_size,
+                                    int order, int nthreads);
+
+unsigned char *arith_uncompress_to_mt(unsigned char *in, unsigned int in_size,
+                                      unsigned char *out,
+                                      unsigned int *out_size, int nthreads);
+
+/*
+ * Order bit replacing the arithmetic coder with an external block
+ * compressor.  Bits 16-19 of order (see ARITH_ORDER_EXT_ID) select the
+ * codec: 0 tries bzip2 and every registered codec and keeps the smallest,
+ * 1 is the built-in bzip2 and higher values are the ids returned by
+ * arith_register_ext.
+ */
+#define ARITH_ORDER_EXT 0x04
+#define ARITH_ORDER_EXT_ID(id) (ARITH_ORDER_EXT | ((id)<<16))
+#define ARITH_EXT_MAX 16
+
+/*
+ * An external codec.  The compressed stream is stored verbatim, so it
+ * must start with the magic number, which the decoder uses to identify
+ * the codec.  No two codecs may have magic numbers where one is a
+ * prefix of the other.
+ *
+ * compress is given *out_size bytes of space and uncompress exactly the
+ * original size; both set *out_size to the size used and return 0 on
+ * success, or -1 on failure (including lack of space).  They are called
+ * concurrently when used from multiple threads.
+ */
+typedef struct {
+    const char *name;
+    unsigned char magic[8];
+    int magic_len;
+    void *data; // Passed to compress and uncompress
+    int (*compress)(void *data, unsigned char *in, unsigned int in_size,
+                    unsigned char *out, unsigned int *out_size);
+    int (*uncompress)(void *data, unsigned char *in, unsigned int in_size,
+                      unsigned char *out, unsigned int *out_size);
+} arith_ext_codec;
+
+/*
+ * Registers an external codec (the struct is copied).  This is not
+ * thread safe, so register codecs before starting any compression.
+ *
+ * Returns the codec id for ARITH_ORDER_EXT_ID on success, or -1 if the
+ * codec is invalid, its magic clashes with an existing codec or with
+ * ARITH_ORDER_LANES data, or the table (ARITH_EXT_MAX entries) is full.
+ */
+int arith_register_ext(const arith_ext_codec *codec);
+
+/*
+ * 64-bit size variants for inputs beyond the 4GB (or INT_MAX) limit of
+ * the functions above.  The input is split into independently coded
+ * segments of seg_size bytes (0 for the default of 256MB, at most 1GB),
+ * which are encoded and decoded using up to nthreads threads.  This is a
+ * separate container format; it is not readable by arith_uncompress.
+ *
+ * With out == NULL the output is allocated, otherwise *out_size holds the
+ * size of out on input.  *out_size is set to the used size on success.
+ * Returns out on success, NULL on failure.
+ */
+uint64_t arith_compress_bound_64(uint64_t size, int order, uint32_t seg_size);
+
+unsigned char *arith_compress_to_64(unsigned char *in, uint64_t in_size,
+                                    unsigned char *out, uint64_t *out_size,
+                                    int order, uint32_t seg_size,
+                                    int nthreads);
+
+unsigned char *arith_uncompress_to_64(unsigned char *in, uint64_t in_size,
+                                      unsigned char *out, uint64_t *out_size,
+                                      int nthreads);
+
 #ifdef __cplusplus
 }
 #endif
@@ -32,6 +32,7 @@
  */
 
 #include <stdint.h>
+#include <string.h>
 #include "c_range_coder.h"
 
 /*
@@ -52,6 +53,16 @@
  * There is no escape symbol, so the model is tailored to relatively
  * stationary samples (although we do have occasional normalisation to
  * avoid frequency counters getting too high).
+ *
+ * Decoding a symbol is a linear scan of this list, which is slow for large
+ * flat alphabets.  If SIMPLE_MODEL_BLOCKS is also defined when including
+ * this file, the decoder also splits the list into blocks of SM_BLK_SIZE
+ * entries.  The first block is scanned as before, but for the rest we keep
+ * the total frequency of each block so the search can skip over whole
+ * blocks.  The list itself is maintained exactly as before, so the
+ * encoded stream is identical.  (The encoder is unchanged: the symbol
+ * search there is well predicted, and indexing symbol positions cost more
+ * on skewed data than it saved on flat data.)
  *--------------------------------------------------------------------------
  */
 
@@ -64,6 +75,8 @@
 #define PASTE3(a,b,c) a##b##c
 #define SIMPLE_MODEL(a,b) PASTE3(SIMPLE_MODEL,a,b)
 #define STEP 16
+#define SM_BLK_SHIFT 4
+#define SM_BLK_SIZE (1<<SM_BLK_SHIFT)
 typedef struct {
     uint16_t Freq;
     uint16_t Symbol;
@@ -79,8 +92,26 @@ typedef struct {
 
     // Array of Symbols approximately sorted by Freq. 
     SymFreqs sentinel, F[NSYM+1], terminal;
+
+#ifdef SIMPLE_MODEL_BLOCKS
+    // Frequency of all symbols after the first block, and per block
+    // (BlkFreq[0] is unused).  Maintained by the decoder only.
+    uint32_t TailFreq;
+    uint16_t BlkFreq[(NSYM+SM_BLK_SIZE-1)/SM_BLK_SIZE];
+#endif
 } SIMPLE_MODEL(NSYM,_);
 
+#ifdef SIMPLE_MODEL_BLOCKS
+static inline void SIMPLE_MODEL(NSYM,_blocks)(SIMPLE_MODEL(NSYM,_) *m) {
+    int i;
+    memset(m->BlkFreq, 0, sizeof(m->BlkFreq));
+    m->TailFreq = 0;
+    for (i = SM_BLK_SIZE; i < NSYM; i++)
+        m->BlkFreq[i>>SM_BLK_SHIFT] += m->F[i].Freq;
+    for (i = 1; i < (NSYM+SM_BLK_SIZE-1)/SM_BLK_SIZE; i++)
+        m->TailFreq += m->BlkFreq[i];
+}
+#endif
 
 static inline void SIMPLE_MODEL(NSYM,_init)(SIMPLE_MODEL(NSYM,_) *m, int max_sym) {
     int i;
@@ -100,6 +131,10 @@ static inline void SIMPLE_MODEL(NSYM,_init)(SIMPLE_MODEL(NSYM,_) *m, int max_sym
     m->terminal.Symbol = 0;
     m->terminal.Freq   = MAX_FREQ;
     m->F[NSYM].Freq    = 0; // terminates normalize() loop. See below.
+
+#ifdef SIMPLE_MODEL_BLOCKS
+    SIMPLE_MODEL(NSYM,_blocks)(m);
+#endif
 }
 
 
@@ -112,6 +147,10 @@ static inline void SIMPLE_MODEL(NSYM,_normalize)(SIMPLE_MODEL(NSYM,_) *m) {
         s->Freq -= s->Freq>>1;
         m->TotFreq += s->Freq;
     }
+
+#ifdef SIMPLE_MODEL_BLOCKS
+    SIMPLE_MODEL(NSYM,_blocks)(m);
+#endif
 }
 
 static inline void SIMPLE_MODEL(NSYM,_encodeSymbol)(SIMPLE_MODEL(NSYM,_) *m,
@@ -137,6 +176,63 @@ static inline void SIMPLE_MODEL(NSYM,_encodeSymbol)(SIMPLE_MODEL(NSYM,_) *m,
     }
 }
 
+#ifdef SIMPLE_MODEL_BLOCKS
+static inline uint16_t SIMPLE_MODEL(NSYM,_decodeSymbol)(SIMPLE_MODEL(NSYM,_) *m, RangeCoder *rc) {
+    SymFreqs* s = m->F;
+    uint32_t freq = RC_GetFreq(rc, m->TotFreq);
+    uint32_t AccFreq = m->TotFreq - m->TailFreq;
+    int p, b;
+
+    if (freq >= m->TotFreq)
+        return 0; // error
+
+    if (freq < AccFreq) {
+        // Within the first block
+        for (AccFreq = 0; (AccFreq += s->Freq) <= freq; s++)
+            ;
+        p = s - m->F;
+    } else {
+        for (b = 1; AccFreq + m->BlkFreq[b] <= freq; b++)
+            AccFreq += m->BlkFreq[b];
+        m->BlkFreq[b] += STEP;
+        m->TailFreq += STEP;
+
+        for (s = &m->F[b<<SM_BLK_SHIFT]; (AccFreq += s->Freq) <= freq; s++)
+            ;
+        p = s - m->F;
+    }
+
+    AccFreq -= s->Freq;
+
+    RC_Decode(rc, AccFreq, s->Freq, m->TotFreq);
+    s->Freq    += STEP;
+    m->TotFreq += STEP;
+
+    if (m->TotFreq > MAX_FREQ)
+        SIMPLE_MODEL(NSYM,_normalize)(m);
+
+    /* Keep approx sorted */
+    if (s[0].Freq > s[-1].Freq) {
+        if (p >= SM_BLK_SIZE && (p & (SM_BLK_SIZE-1)) == 0) {
+            // Moving between blocks
+            uint16_t d = s[0].Freq - s[-1].Freq;
+            if (p > SM_BLK_SIZE)
+                m->BlkFreq[(p>>SM_BLK_SHIFT)-1] += d;
+            else
+                m->TailFreq -= d;
+            m->BlkFreq[p>>SM_BLK_SHIFT] -= d;
+        }
+        SymFreqs t = s[0];
+        s[0] = s[-1];
+        s[-1] = t;
+        return t.Symbol;
+    }
+
+    return s->Symbol;
+}
+
+#else // SIMPLE_MODEL_BLOCKS
+
 static inline uint16_t SIMPLE_MODEL(NSYM,_decodeSymbol)(SIMPLE_MODEL(NSYM,_) *m, RangeCoder *rc) {
     SymFreqs* s = m->F;
     uint32_t freq = RC_GetFreq(rc, m->TotFreq);
@@ -169,3 +265,4 @@ static inline uint16_t SIMPLE_MODEL(NSYM,_decodeSymbol)(SIMPLE_MODEL(NSYM,_) *m,
 
     return s->Symbol;
 }
+#endif // SIMPLE_MODEL_BLOCKS
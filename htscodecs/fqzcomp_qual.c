@@ -85,6 +85,19 @@
 #define NSYM 2
 #include "c_simple_model.h"
 
+// Quality models are sized to the alphabet; see fqzcomp_qual_models.h.
+#undef NSYM
+#define NSYM 8
+#include "c_simple_model.h"
+
+#undef NSYM
+#define NSYM 16
+#include "c_simple_model.h"
+
+#undef NSYM
+#define NSYM 64
+#include "c_simple_model.h"
+
 #undef NSYM
 #define NSYM QMAX
 //#include "c_escape_model.h"
@@ -310,22 +323,36 @@ static void dump_params(fqz_gparams *gp) {
 }
 
 typedef struct {
-    SIMPLE_MODEL(QMAX,_) *qual;
+    void                 *qual;  // SIMPLE_MODEL(qual_nsym,_)[CTX_SIZE]
+    int                   qual_nsym;
+    int                   qual_max_sym;
+    uint8_t              *qual_init; // qual[i] initialised; see FQZ_QUAL
     SIMPLE_MODEL(256,_)   len[4];
     SIMPLE_MODEL(2,_)     revcomp;
     SIMPLE_MODEL(256,_)   sel;
     SIMPLE_MODEL(2,_)     dup;
 } fqz_model;
 
-static int fqz_create_models(fqz_model *m, fqz_gparams *gp) {
-    int i;
+static int fqz_qual8_create(fqz_model *m, int max_sym);
+static int fqz_qual16_create(fqz_model *m, int max_sym);
+static int fqz_qual64_create(fqz_model *m, int max_sym);
+static int fqz_qual256_create(fqz_model *m, int max_sym);
 
-    if (!(m->qual = htscodecs_tls_alloc(sizeof(*m->qual) * CTX_SIZE)))
+static int fqz_create_models(fqz_model *m, fqz_gparams *gp) {
+    int i, r;
+
+    // The smallest model that holds symbols 0 to max_sym.
+    if (gp->max_sym < 8)
+        r = fqz_qual8_create(m, gp->max_sym+1);
+    else if (gp->max_sym < 16)
+        r = fqz_qual16_create(m, gp->max_sym+1);
+    else if (gp->max_sym < 64)
+        r = fqz_qual64_create(m, gp->max_sym+1);
+    else
+        r = fqz_qual256_create(m, gp->max_sym+1);
+    if (r < 0)
         return -1;
 
-    for (i = 0; i < CTX_SIZE; i++)
-        SIMPLE_MODEL(QMAX,_init)(&m->qual[i], gp->max_sym+1);
-
     for (i = 0; i < 4; i++)
         SIMPLE_MODEL(256,_init)(&m->len[i],256);
 
@@ -385,15 +412,75 @@ static inline unsigned int fqz_update_ctx(fqz_param *pm, fqz_state *state, int q
     return last & (CTX_SIZE-1);
 }
 
+#undef NSYM
+#define NSYM 8
+#include "fqzcomp_qual_models.h"
+
+#undef NSYM
+#define NSYM 16
+#include "fqzcomp_qual_models.h"
+
+#undef NSYM
+#define NSYM 64
+#include "fqzcomp_qual_models.h"
+
+#undef NSYM
+#define NSYM QMAX
+#include "fqzcomp_qual_models.h"
+
+// Codes the rest of the record with the quality models.
+// See FQZ_QUAL(NSYM,_encode) and FQZ_QUAL(NSYM,_decode).
+static inline size_t fqz_encode_quals(fqz_model *m, fqz_param *pm,
+                                      fqz_state *state, RangeCoder *rc,
+                                      unsigned char *in, size_t i,
+                                      size_t in_size, unsigned int *last) {
+    switch (m->qual_nsym) {
+    case 8:
+        return fqz_qual8_encode(m, pm, state, rc, in, i, in_size, last);
+    case 16:
+        return fqz_qual16_encode(m, pm, state, rc, in, i, in_size, last);
+    case 64:
+        return fqz_qual64_encode(m, pm, state, rc, in, i, in_size, last);
+    default:
+        return fqz_qual256_encode(m, pm, state, rc, in, i, in_size, last);
+    }
+}
+
+static inline ssize_t fqz_decode_quals(fqz_model *m, fqz_param *pm,
+                                       fqz_state *state, RangeCoder *rc,
+                                       unsigned char *out, ssize_t i,
+                                       ssize_t len, unsigned int *last) {
+    switch (m->qual_nsym) {
+    case 8:
+        return fqz_qual8_decode(m, pm, state, rc, out, i, len, last);
+    case 16:
+        return fqz_qual16_decode(m, pm, state, rc, out, i, len, last);
+    case 64:
+        return fqz_qual64_decode(m, pm, state, rc, out, i, len, last);
+    default:
+        return fqz_qual256_decode(m, pm, state, rc, out, i, len, last);
+    }
+}
+
+// How the per-record selectors were derived from the quality stats, so
+// a session can compute them for later slices without the analysis.
+typedef struct {
+    int qa;               // 0, or 2 or 4 selectors from the average quality
+    uint8_t qa_bin[2560]; // Average quality * 10 to one of 4 selectors
+    int r2;               // Selector doubled, plus 1 for READ2
+    uint32_t qhist[256];  // Quality histogram, filled by fqz_pick_parameters
+} fqz_slice_stats;
+
 // Build quality stats for qhist and set nsym, do_dedup and do_sel params.
 // One_param is -1 to gather stats on all data, or >= 0 to gather data
-// on one specific selector parameter.  Used only in TEST_MAIN via
-// fqz_manual_parameters at the moment.
-void fqz_qual_stats(fqz_slice *s,
-                    unsigned char *in, size_t in_size,
-                    fqz_param *pm,
-                    uint32_t qhist[256],
-                    int one_param) {
+// on one specific selector parameter.  If st is non-NULL the selector
+// choices are recorded in it.
+static void fqz_qual_stats_sel(fqz_slice *s,
+                               unsigned char *in, size_t in_size,
+                               fqz_param *pm,
+                               uint32_t qhist[256],
+                               int one_param,
+                               fqz_slice_stats *st) {
 #define NP 32
     uint32_t qhistb[NP][256] = {{0}};  // both
     uint32_t qhist1[NP][256] = {{0}};  // READ1 only
@@ -429,6 +516,9 @@ void fqz_qual_stats(fqz_slice *s,
     if (!avg_qual)
         return;
 
+    if (st)
+        st->qa = st->r2 = 0;
+
     rec = i = j = 0;
     while (i < in_size) {
         if (one_param >= 0 && (s->flags[rec] >> 16) != one_param) {
@@ -590,12 +680,22 @@ void fqz_qual_stats(fqz_slice *s,
             }
             pm->do_sel = 1;
             max_sel = 3;
+            if (st) {
+                st->qa = 4;
+                for (i = 0; i < 2560; i++)
+                    st->qa_bin[i] = avg[i];
+            }
         } else if ((pm->do_qa == -1 || pm->do_qa >= 2) && e2 + s->num_records/8 < e1*qm) {
             //fprintf(stderr, "do q2\n");
             for (i = 0; i < s->num_records; i++)
                 s->flags[i] |= (avg[MIN(2559, avg_qual[i])]>>1) <<16;
             pm->do_sel = 1;
             max_sel = 1;
+            if (st) {
+                st->qa = 2;
+                for (i = 0; i < 2560; i++)
+                    st->qa_bin[i] = avg[i];
+            }
         }
 
         if (pm->do_qa == -1) {
@@ -648,6 +748,8 @@ void fqz_qual_stats(fqz_slice *s,
         // For now we just say need 5% saving here.
         double qm = pm->do_r2 > 0 ? 1 : 0.95;
         if (e2 + (8+s->num_records/8) < e1*qm) {
+            if (st)
+                st->r2 = 1;
             for (rec = 0; rec < s->num_records; rec++) {
                 if (one_param >= 0 && (s->flags[rec] >> 16) != one_param)
                     continue;
@@ -671,6 +773,15 @@ void fqz_qual_stats(fqz_slice *s,
     free(avg_qual);
 }
 
+// Used only in TEST_MAIN via fqz_manual_parameters at the moment.
+void fqz_qual_stats(fqz_slice *s,
+                    unsigned char *in, size_t in_size,
+                    fqz_param *pm,
+                    uint32_t qhist[256],
+                    int one_param) {
+    fqz_qual_stats_sel(s, in, in_size, pm, qhist, one_param, NULL);
+}
+
 static inline
 int fqz_store_parameters1(fqz_param *pm, unsigned char *comp) {
     int comp_idx = 0, i, j;
@@ -730,22 +841,93 @@ int fqz_store_parameters(fqz_gparams *gp, unsigned char *comp) {
     return comp_idx;
 }
 
+// Builds the context tables and parameter flags from the qbits, pbits
+// and dbits fields (and their shifts) of pm.
+static void fqz_param_tables(fqz_param *pm) {
+    //approx sqrt(delta), must be sequential
+    int dsqr[] = {
+        0, 1, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3,
+        4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5,
+        5, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+        6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(dsqr)/sizeof(*dsqr); i++)
+        if (dsqr[i] > (1<<pm->dbits)-1)
+            dsqr[i] = (1<<pm->dbits)-1;
+
+    // Produce ptab from pshift.
+    if (pm->qbits) {
+        for (i = 0; i < 256; i++) {
+            pm->qtab[i] = i; // 1:1
+
+            // Alternative mappings:
+            //qtab[i] = i > 30 ? MIN(max_sym,i)-15 : i/2;  // eg for 9827 BAM
+        }
+
+    }
+    pm->qmask = (1<<pm->qbits)-1;
+
+    if (pm->pbits) {
+        for (i = 0; i < 1024; i++)
+            pm->ptab[i] = MIN((1<<pm->pbits)-1, i>>pm->pshift);
+
+        // Alternatively via analysis of quality distributions we
+        // may select a bunch of positions that are special and
+        // have a non-uniform ptab[].
+        // Manual experimentation on a NovaSeq run saved 2.8% here.
+    } else {
+        memset(pm->ptab, 0, sizeof(pm->ptab)); // as the decoder
+    }
+
+    if (pm->dbits) {
+        for (i = 0; i < 256; i++)
+            pm->dtab[i] = dsqr[MIN(sizeof(dsqr)/sizeof(*dsqr)-1, i>>pm->dshift)];
+    } else {
+        memset(pm->dtab, 0, sizeof(pm->dtab));
+    }
+
+    pm->use_ptab = (pm->pbits > 0);
+    pm->use_dtab = (pm->dbits > 0);
+
+    pm->pflags =
+        (pm->use_qtab   ?PFLAG_HAVE_QTAB :0)|
+        (pm->use_dtab   ?PFLAG_HAVE_DTAB :0)|
+        (pm->use_ptab   ?PFLAG_HAVE_PTAB :0)|
+        (pm->do_sel     ?PFLAG_DO_SEL    :0)|
+        (pm->fixed_len  ?PFLAG_DO_LEN    :0)|
+        (pm->do_dedup   ?PFLAG_DO_DEDUP  :0)|
+        (pm->store_qmap ?PFLAG_HAVE_QMAP :0);
+}
+
+// Validity check input lengths and buffer size
+static void fqz_fix_lengths(fqz_slice *s, size_t in_size) {
+    size_t tlen = 0, i;
+    for (i = 0; i < s->num_records; i++) {
+        if (tlen + s->len[i] > in_size)
+            // Oversized buffer
+            s->len[i] = in_size - tlen;
+        tlen += s->len[i];
+    }
+    if (s->num_records > 0 && tlen < in_size)
+        // Undersized buffer
+        s->len[s->num_records-1] += in_size - tlen;
+}
+
 // Choose a set of parameters based on quality statistics and
 // some predefined options (selected via "strat").
+//
+// If st is non-NULL, the statistics needed to reuse these parameters
+// on another slice are stored there.
 static inline
 int fqz_pick_parameters(fqz_gparams *gp,
                         int vers,
                         int strat,
                         fqz_slice *s,
                         unsigned char *in,
-                        size_t in_size) {
-    //approx sqrt(delta), must be sequential
-    int dsqr[] = {
-        0, 1, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3,
-        4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5,
-        5, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
-        6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7
-    };
+                        size_t in_size,
+                        fqz_slice_stats *st) {
     uint32_t qhist[256] = {0};
 
     if (strat >= nstrats) strat = nstrats-1;
@@ -782,20 +964,13 @@ int fqz_pick_parameters(fqz_gparams *gp,
     pm->do_r2 = strat_opts[strat][10];
     pm->do_qa = strat_opts[strat][11];
 
-    // Validity check input lengths and buffer size
-    size_t tlen = 0, i;
-    for (i = 0; i < s->num_records; i++) {
-        if (tlen + s->len[i] > in_size)
-            // Oversized buffer
-            s->len[i] = in_size - tlen;
-        tlen += s->len[i];
-    }
-    if (s->num_records > 0 && tlen < in_size)
-        // Undersized buffer
-        s->len[s->num_records-1] += in_size - tlen;
+    size_t i;
+    fqz_fix_lengths(s, in_size);
 
     // Quality metrics, for all recs
-    fqz_qual_stats(s, in, in_size, pm, qhist, -1);
+    fqz_qual_stats_sel(s, in, in_size, pm, qhist, -1, st);
+    if (st)
+        memcpy(st->qhist, qhist, sizeof(qhist));
 
     pm->store_qmap = (pm->nsym <= 8 && pm->nsym*2 < pm->max_sym);
 
@@ -842,10 +1017,6 @@ int fqz_pick_parameters(fqz_gparams *gp,
 //          pm->qloc, pm->sloc, pm->ploc, pm->dloc,
 //          pm->do_r2, pm->do_qa);
 
-    for (i = 0; i < sizeof(dsqr)/sizeof(*dsqr); i++)
-        if (dsqr[i] > (1<<pm->dbits)-1)
-            dsqr[i] = (1<<pm->dbits)-1;
-
     if (pm->store_qmap) {
         int j;
         for (i = j = 0; i < 256; i++)
@@ -862,44 +1033,7 @@ int fqz_pick_parameters(fqz_gparams *gp,
     if (gp->max_sym < pm->max_sym)
         gp->max_sym = pm->max_sym;
 
-    // Produce ptab from pshift.
-    if (pm->qbits) {
-        for (i = 0; i < 256; i++) {
-            pm->qtab[i] = i; // 1:1
-
-            // Alternative mappings:
-            //qtab[i] = i > 30 ? MIN(max_sym,i)-15 : i/2;  // eg for 9827 BAM
-        }
-
-    }
-    pm->qmask = (1<<pm->qbits)-1;
-
-    if (pm->pbits) {
-        for (i = 0; i < 1024; i++)
-            pm->ptab[i] = MIN((1<<pm->pbits)-1, i>>pm->pshift);
-
-        // Alternatively via analysis of quality distributions we
-        // may select a bunch of positions that are special and
-        // have a non-uniform ptab[].
-        // Manual experimentation on a NovaSeq run saved 2.8% here.
-    }
-
-    if (pm->dbits) {
-        for (i = 0; i < 256; i++)
-            pm->dtab[i] = dsqr[MIN(sizeof(dsqr)/sizeof(*dsqr)-1, i>>pm->dshift)];
-    }
-
-    pm->use_ptab = (pm->pbits > 0);
-    pm->use_dtab = (pm->dbits > 0);
-
-    pm->pflags =
-        (pm->use_qtab   ?PFLAG_HAVE_QTAB :0)|
-        (pm->use_dtab   ?PFLAG_HAVE_DTAB :0)|
-        (pm->use_ptab   ?PFLAG_HAVE_PTAB :0)|
-        (pm->do_sel     ?PFLAG_DO_SEL    :0)|
-        (pm->fixed_len  ?PFLAG_DO_LEN    :0)|
-        (pm->do_dedup   ?PFLAG_DO_DEDUP  :0)|
-        (pm->store_qmap ?PFLAG_HAVE_QMAP :0);
+    fqz_param_tables(pm);
 
     gp->max_sel = 0;
     if (pm->do_sel) {
@@ -1000,6 +1134,75 @@ static int compress_new_read(fqz_slice *s,
     return 0; // not dup
 }
 
+// Encodes the records of s, held in in[0..in_size), with a fresh set of
+// models.  This is the whole slice, or one group of records with
+// GFLAG_MULTI_BLOCK.  Returns 0 on success, -1 on failure.
+static int fqz_encode_recs(fqz_gparams *gp, fqz_slice *s,
+                           unsigned char *in, size_t in_size,
+                           unsigned char *out, size_t *out_size) {
+    fqz_model model;
+    RangeCoder rc;
+    unsigned int last = 0;
+    size_t i;
+
+    if (fqz_create_models(&model, gp) < 0)
+        return -1;
+
+    RC_SetOutput(&rc, (char *)out);
+    RC_StartEncode(&rc);
+
+    fqz_state state = {0};
+    fqz_param *pm = &gp->p[0];
+    state.p = 0;
+    state.first_len = 1;
+    state.last_len = 0;
+    state.rec = 0;
+
+    for (i = 0; i < in_size; i++) {
+        if (state.p == 0) {
+            if (compress_new_read(s, &state, gp, pm, &model, &rc,
+                                  in, &i, /*&rec,*/ &last))
+                continue;
+        }
+
+        i = fqz_encode_quals(&model, pm, &state, &rc, in, i, in_size, &last);
+    }
+
+    RC_FinishEncode(&rc);
+    *out_size = RC_OutSize(&rc);
+
+    fqz_destroy_models(&model);
+    return 0;
+}
+
+// The groups of records for GFLAG_MULTI_BLOCK, each encoded or decoded
+// by its own job.
+typedef struct {
+    fqz_gparams *gp;
+    fqz_slice *s;
+    unsigned char *in, *out;
+    int *rec;            // First record of each block, plus the end
+    size_t *in_off;      // Offset of each block in in[], plus the end
+    size_t *out_off;     // Offset of each block in out[], plus the end
+    size_t *out_size;    // Encoded size of each block
+    int *lengths, nlengths; // Decoder record lengths, as fqz_decompress
+    int err;
+} fqz_blocks;
+
+static void fqz_encode_block(void *arg, int n) {
+    fqz_blocks *b = (fqz_blocks *)arg;
+    fqz_slice s = {
+        b->rec[n+1] - b->rec[n],
+        b->s->len + b->rec[n],
+        b->s->flags + b->rec[n]
+    };
+
+    if (fqz_encode_recs(b->gp, &s, b->in + b->in_off[n],
+                        b->in_off[n+1] - b->in_off[n],
+                        b->out + b->out_off[n], &b->out_size[n]) < 0)
+        b->err = 1;
+}
+
 static
 unsigned char *compress_block_fqz2f(int vers,
                                     int strat,
@@ -1007,30 +1210,73 @@ unsigned char *compress_block_fqz2f(int vers,
                                     unsigned char *in,
                                     size_t in_size,
                                     size_t *out_size,
-                                    fqz_gparams *gp) {
+                                    fqz_gparams *gp,
+                                    int nblocks,
+                                    int nthreads) {
     fqz_gparams local_gp;
     int free_params = 0;
 
-    unsigned int last = 0;
     size_t i, j;
     ssize_t rec = 0;
 
     int comp_idx = 0;
-    RangeCoder rc;
+    fqz_blocks b = {0};
+    unsigned char *comp = NULL, *out = NULL;
 
-    unsigned char *comp = (unsigned char *)malloc(in_size*1.1+100000);
-    unsigned char *compe = comp + (size_t)(in_size*1.1+100000);
-    if (!comp)
-        return NULL;
+    if (nblocks > s->num_records)
+        nblocks = s->num_records;
+    if (nblocks < 1)
+        nblocks = 1;
 
     // Pick and store params
     if (!gp) {
         gp = &local_gp;
-        if (fqz_pick_parameters(gp, vers, strat, s, in, in_size) < 0)
+        if (fqz_pick_parameters(gp, vers, strat, s, in, in_size, NULL) < 0)
             return NULL;
         free_params = 1;
     }
 
+    // Partition the records into nblocks groups of similar size.  Each
+    // is encoded independently, so also needs its own output space.
+    if (nblocks > 1) {
+        gp->gflags |= GFLAG_MULTI_BLOCK;
+        fqz_fix_lengths(s, in_size);
+        b.rec      = malloc((nblocks+1) * sizeof(*b.rec));
+        b.in_off   = malloc((nblocks+1) * sizeof(*b.in_off));
+        b.out_off  = malloc((nblocks+1) * sizeof(*b.out_off));
+        b.out_size = malloc(nblocks * sizeof(*b.out_size));
+        if (!b.rec || !b.in_off || !b.out_off || !b.out_size)
+            goto err;
+
+        b.rec[0] = b.in_off[0] = b.out_off[0] = 0;
+        size_t o = 0;
+        for (i = rec = 0; i < nblocks; i++) {
+            size_t end = (in_size * (i+1)) / nblocks;
+            // At least one record each, leaving one for each later block
+            do
+                o += s->len[rec++];
+            while (o < end && rec < s->num_records - (nblocks-1-i));
+            if (i == nblocks-1) {
+                rec = s->num_records;
+                o = in_size;
+            }
+            b.rec[i+1] = rec;
+            b.in_off[i+1] = o;
+            b.out_off[i+1] = b.out_off[i]
+                + (size_t)((o - b.in_off[i])*1.1) + 100000;
+        }
+        if (!(out = malloc(b.out_off[nblocks])))
+            goto err;
+    } else {
+        gp->gflags &= ~GFLAG_MULTI_BLOCK;
+    }
+
+    size_t comp_alloc = (size_t)(in_size*1.1) + 100000 + 15*(size_t)nblocks;
+    comp = (unsigned char *)malloc(comp_alloc);
+    unsigned char *compe = comp + comp_alloc;
+    if (!comp)
+        goto err;
+
     //dump_params(gp);
     comp_idx = var_put_u32(comp, compe, in_size);
     comp_idx += fqz_store_parameters(gp, comp+comp_idx);
@@ -1048,14 +1294,6 @@ unsigned char *compress_block_fqz2f(int vers,
             pm->dtab[i] <<= pm->dloc;
     }
 
-    // Create models and initialise range coder
-    fqz_model model;
-    if (fqz_create_models(&model, gp) < 0)
-        return NULL;
-
-    RC_SetOutput(&rc, (char *)comp+comp_idx);
-    RC_StartEncode(&rc);
-
     // For CRAM3.1, reverse upfront if needed
     pm = &gp->p[0];
     if (gp->gflags & GFLAG_DO_REV) {
@@ -1082,79 +1320,42 @@ unsigned char *compress_block_fqz2f(int vers,
         rec = 0;
     }
 
-    fqz_state state = {0};
-    pm = &gp->p[0];
-    state.p = 0;
-    state.first_len = 1;
-    state.last_len = 0;
-    state.rec = rec;
-
-    for (i = 0; i < in_size; i++) {
-        if (state.p == 0) {
-            if (compress_new_read(s, &state, gp, pm, &model, &rc,
-                                  in, &i, /*&rec,*/ &last))
-                continue;
-        }
-
-#if 0
-        //                        fqz_qual_stats imp.
-        // q40 6.876  6.852       5.96
-        // q4  6.566              5.07
-        // _Q  1.383              1.11
-        unsigned char q = in[i];
-        unsigned char qm = pm->qmap[q];
-
-        SIMPLE_MODEL(QMAX,_encodeSymbol)(&model.qual[last], &rc, qm);
-        last = fqz_update_ctx(pm, &state, qm);
-#else
-        //     gcc    clang            gcc+fqz_qual_stats imp.
-        // q40 5.033  5.026     -27%   4.137 -38%
-        // q4  5.595            -15%   4.011 -36%
-        // _Q  1.225            -11%   0.956
-        int j = -1;
-
-        while (state.p >= 4 && i+j+4 < in_size) {
-            int l1 = last, l2, l3, l4;
-            // Model has symbols sorted by frequency, so most common are at
-            // start.  So while model is approx 1Kb, the first cache line is
-            // a big win.
-            mm_prefetch(&model.qual[l1]);
-            unsigned char qm1 = pm->qmap[in[i + ++j]];
-            last = fqz_update_ctx(pm, &state, qm1); l2 = last;
-
-            mm_prefetch(&model.qual[l2]);
-            unsigned char qm2 = pm->qmap[in[i + ++j]];
-            last = fqz_update_ctx(pm, &state, qm2); l3 = last;
-
-            mm_prefetch(&model.qual[l3]);
-            unsigned char qm3 = pm->qmap[in[i + ++j]];
-            last = fqz_update_ctx(pm, &state, qm3); l4 = last;
-
-            mm_prefetch(&model.qual[l4]);
-            unsigned char qm4 = pm->qmap[in[i + ++j]];
-            last = fqz_update_ctx(pm, &state, qm4);
-
-            SIMPLE_MODEL(QMAX,_encodeSymbol)(&model.qual[l1], &rc, qm1);
-            SIMPLE_MODEL(QMAX,_encodeSymbol)(&model.qual[l2], &rc, qm2);
-            SIMPLE_MODEL(QMAX,_encodeSymbol)(&model.qual[l3], &rc, qm3);
-            SIMPLE_MODEL(QMAX,_encodeSymbol)(&model.qual[l4], &rc, qm4);
-        }
-
-        while (state.p > 0) {
-            int l2 = last;
-            mm_prefetch(&model.qual[last]);
-            unsigned char qm = pm->qmap[in[i + ++j]];
-            last = fqz_update_ctx(pm, &state, qm);
-            SIMPLE_MODEL(QMAX,_encodeSymbol)(&model.qual[l2], &rc, qm);
+    size_t rc_size = 0;
+    if (nblocks > 1) {
+        // Record count and sizes of each block, then their contents
+        b.gp = gp;
+        b.s = s;
+        b.in = in;
+        b.out = out;
+        if (htscodecs_run_jobs(nthreads, nblocks, fqz_encode_block, &b) < 0)
+            b.err = 1;
+
+        if (!b.err) {
+            comp_idx += var_put_u32(comp+comp_idx, compe, nblocks);
+            for (i = 0; i < nblocks; i++) {
+                comp_idx += var_put_u32(comp+comp_idx, compe,
+                                        b.rec[i+1] - b.rec[i]);
+                comp_idx += var_put_u32(comp+comp_idx, compe,
+                                        b.in_off[i+1] - b.in_off[i]);
+                comp_idx += var_put_u32(comp+comp_idx, compe,
+                                        b.out_size[i]);
+            }
+            for (i = 0; i < nblocks; i++) {
+                if (b.out_size[i] > compe - (comp+comp_idx+rc_size)) {
+                    b.err = 1;
+                    break;
+                }
+                memcpy(comp+comp_idx+rc_size, out + b.out_off[i],
+                       b.out_size[i]);
+                rc_size += b.out_size[i];
+            }
         }
-        i += j;
-#endif
+    } else if (fqz_encode_recs(gp, s, in, in_size,
+                               comp+comp_idx, &rc_size) < 0) {
+        b.err = 1;
     }
 
-    RC_FinishEncode(&rc);
-
     // For CRAM3.1, undo our earlier reversal step
-    rec = state.rec;
     if (gp->gflags & GFLAG_DO_REV) {
         i = rec = j = 0;
         while (i < in_size) {
@@ -1183,14 +1384,33 @@ unsigned char *compress_block_fqz2f(int vers,
     for (rec = 0; rec < s->num_records; rec++)
         s->flags[rec] &= 0xffff;
 
-    *out_size = comp_idx + RC_OutSize(&rc);
+    if (b.err)
+        goto err;
+
+    *out_size = comp_idx + rc_size;
     //fprintf(stderr, "%d -> %d\n", (int)in_size, (int)*out_size);
 
-    fqz_destroy_models(&model);
     if (free_params)
         fqz_free_parameters(gp);
+    free(out);
+    free(b.rec);
+    free(b.in_off);
+    free(b.out_off);
+    free(b.out_size);
 
     return comp;
+
+ err:
+    if (free_params)
+        fqz_free_parameters(gp);
+    free(comp);
+    free(out);
+    free(b.rec);
+    free(b.in_off);
+    free(b.out_off);
+    free(b.out_size);
+
+    return NULL;
 }
 
 // Read fqz paramaters.
@@ -1414,63 +1634,30 @@ static int decompress_new_read(fqz_slice *s,
 }
 
 
-static
-unsigned char *uncompress_block_fqz2f(fqz_slice *s,
-                                      unsigned char *in,
-                                      size_t in_size,
-                                      size_t *out_size,
-                                      int *lengths,
-                                      int nlengths) {
-    fqz_gparams gp;
+// Decodes records from in[0..in_size) until out[0..out_size) is full,
+// with a fresh set of models.  This is the whole slice, or one group of
+// records with GFLAG_MULTI_BLOCK.  Returns the number of records
+// decoded, or -1 on failure.
+static int fqz_decode_recs(fqz_gparams *gp,
+                           unsigned char *in, size_t in_size,
+                           unsigned char *uncomp, size_t len,
+                           int *lengths, int nlengths) {
     fqz_param *pm;
     char *rev_a = NULL;
     int *len_a = NULL;
-    memset(&gp, 0, sizeof(gp));
-
-    uint32_t len;
-    ssize_t i, rec = 0, in_idx;
-    in_idx = var_get_u32(in, in+in_size, &len);
-    *out_size = len;
-
-#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
-    if (len > 100000)
-        return NULL;
-#endif
-
-    unsigned char *uncomp = NULL;
+    ssize_t i, rec = 0;
     RangeCoder rc;
     unsigned int last = 0;
-
-    // Decode parameter blocks
-    if ((i = fqz_read_parameters(&gp, in+in_idx, in_size-in_idx)) < 0)
-        return NULL;
-    //dump_params(&gp);
-    in_idx += i;
-
-    // Optimisations to remove shifts from main loop
-    for (i = 0; i < gp.nparam; i++) {
-        int j;
-        pm = &gp.p[i];
-        for (j = 0; j < 1024; j++)
-            pm->ptab[j] <<= pm->ploc;
-        for (j = 0; j < 256; j++)
-            pm->dtab[j] <<= pm->dloc;
-    }
+    size_t out_size = len;
 
     // Initialise models and entropy coder
     fqz_model model;
-    if (fqz_create_models(&model, &gp) < 0)
-        return NULL;
+    if (fqz_create_models(&model, gp) < 0)
+        return -1;
 
-    RC_SetInput(&rc, (char *)in+in_idx, (char *)in+in_size);
+    RC_SetInput(&rc, (char *)in, (char *)in+in_size);
     RC_StartDecode(&rc);
 
-
-    // Allocate buffers
-    uncomp = (unsigned char *)malloc(*out_size);
-    if (!uncomp)
-        goto err;
-
     int nrec = 1000;
     rev_a = malloc(nrec);
     len_a = malloc(nrec * sizeof(int));
@@ -1491,7 +1678,7 @@ unsigned char *uncompress_block_fqz2f(fqz_slice *s,
 
     int rev = 0;
     int x = 0;
-    pm = &gp.p[x];
+    pm = &gp->p[x];
     for (i = 0; i < len; ) {
         if (state.rec >= nrec) {
             nrec *= 2;
@@ -1502,8 +1689,8 @@ unsigned char *uncompress_block_fqz2f(fqz_slice *s,
         }
 
         if (state.p == 0) {
-            int r = decompress_new_read(s, &state, &gp, pm, &model, &rc,
-                                        in, &i, uncomp, out_size,
+            int r = decompress_new_read(NULL, &state, gp, pm, &model, &rc,
+                                        in, &i, uncomp, &out_size,
                                         &rev, rev_a, len_a,
                                         lengths, nlengths);
             if (r < 0)
@@ -1514,13 +1701,7 @@ unsigned char *uncompress_block_fqz2f(fqz_slice *s,
         }
 
         // Decode and update context
-        do {
-            unsigned char Q = SIMPLE_MODEL(QMAX,_decodeSymbol)
-                (&model.qual[last], &rc);
-
-            last = fqz_update_ctx(pm, &state, Q);
-            uncomp[i++] = pm->qmap[Q];
-        } while (state.p != 0 && i < len);
+        i = fqz_decode_quals(&model, pm, &state, &rc, uncomp, i, len, &last);
     }
 
     rec = state.rec;
@@ -1534,7 +1715,7 @@ unsigned char *uncompress_block_fqz2f(fqz_slice *s,
     rev_a[rec] = rev;
     len_a[rec] = len;
 
-    if (gp.gflags & GFLAG_DO_REV) {
+    if (gp->gflags & GFLAG_DO_REV) {
         for (i = rec = 0; i < len && rec < nrec; i += len_a[rec++]) {
             if (!rev_a[rec])
                 continue;
@@ -1554,37 +1735,632 @@ unsigned char *uncompress_block_fqz2f(fqz_slice *s,
     fqz_destroy_models(&model);
     free(rev_a);
     free(len_a);
+
+    return state.rec;
+
+ err:
+    fqz_destroy_models(&model);
+    free(rev_a);
+    free(len_a);
+
+    return -1;
+}
+
+static void fqz_decode_block(void *arg, int n) {
+    fqz_blocks *b = (fqz_blocks *)arg;
+    int nlengths = b->nlengths - b->rec[n];
+
+    int r = fqz_decode_recs(b->gp, b->in + b->in_off[n],
+                            b->in_off[n+1] - b->in_off[n],
+                            b->out + b->out_off[n],
+                            b->out_off[n+1] - b->out_off[n],
+                            nlengths > 0 ? b->lengths + b->rec[n] : NULL,
+                            nlengths);
+    if (r != b->rec[n+1] - b->rec[n])
+        b->err = 1;
+}
+
+static
+unsigned char *uncompress_block_fqz2f(fqz_slice *s,
+                                      unsigned char *in,
+                                      size_t in_size,
+                                      size_t *out_size,
+                                      int *lengths,
+                                      int nlengths,
+                                      int nthreads) {
+    fqz_gparams gp;
+    fqz_param *pm;
+    fqz_blocks b = {0};
+    memset(&gp, 0, sizeof(gp));
+
+    uint32_t len;
+    ssize_t i, rec = 0, in_idx;
+    in_idx = var_get_u32(in, in+in_size, &len);
+    *out_size = len;
+
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+    if (len > 100000)
+        return NULL;
+#endif
+
+    unsigned char *uncomp = NULL;
+
+    // Decode parameter blocks
+    if ((i = fqz_read_parameters(&gp, in+in_idx, in_size-in_idx)) < 0)
+        return NULL;
+    //dump_params(&gp);
+    in_idx += i;
+
+    // Optimisations to remove shifts from main loop
+    for (i = 0; i < gp.nparam; i++) {
+        int j;
+        pm = &gp.p[i];
+        for (j = 0; j < 1024; j++)
+            pm->ptab[j] <<= pm->ploc;
+        for (j = 0; j < 256; j++)
+            pm->dtab[j] <<= pm->dloc;
+    }
+
+    // Allocate buffers
+    uncomp = (unsigned char *)malloc(*out_size);
+    if (!uncomp)
+        goto err;
+
+    if (gp.gflags & GFLAG_MULTI_BLOCK) {
+        // Table of record counts and sizes, followed by the blocks
+        uint32_t nblocks, u32[3];
+        in_idx += var_get_u32(in+in_idx, in+in_size, &nblocks);
+        if (nblocks == 0 || nblocks > len)
+            goto err;
+
+        b.rec     = malloc((nblocks+1) * sizeof(*b.rec));
+        b.out_off = malloc((nblocks+1) * sizeof(*b.out_off));
+        b.in_off  = malloc((nblocks+1) * sizeof(*b.in_off));
+        if (!b.rec || !b.out_off || !b.in_off)
+            goto err;
+
+        b.rec[0] = b.out_off[0] = b.in_off[0] = 0;
+        for (i = 0; i < nblocks; i++) {
+            int j;
+            for (j = 0; j < 3; j++) {
+                int n = var_get_u32(in+in_idx, in+in_size, &u32[j]);
+                if (n <= 0)
+                    goto err;
+                in_idx += n;
+            }
+            if ((int64_t)b.rec[i] + u32[0] > INT_MAX)
+                goto err;
+            b.rec[i+1]     = b.rec[i] + u32[0];
+            b.out_off[i+1] = b.out_off[i] + u32[1];
+            b.in_off[i+1]  = b.in_off[i] + u32[2];
+        }
+        if (b.out_off[nblocks] != len || b.in_off[nblocks] > in_size-in_idx)
+            goto err;
+
+        b.gp = &gp;
+        b.in = in + in_idx;
+        b.out = uncomp;
+        b.lengths = lengths;
+        b.nlengths = lengths ? nlengths : 0;
+        if (htscodecs_run_jobs(nthreads, nblocks, fqz_decode_block, &b) < 0
+            || b.err)
+            goto err;
+        rec = b.rec[nblocks];
+    } else {
+        rec = fqz_decode_recs(&gp, in+in_idx, in_size-in_idx, uncomp, len,
+                              lengths, nlengths);
+        if (rec < 0)
+            goto err;
+    }
+
+    free(b.rec);
+    free(b.out_off);
+    free(b.in_off);
     fqz_free_parameters(&gp);
 
 #ifdef TEST_MAIN
     s->num_records = rec;
 #endif
+    (void)rec;
 
     return uncomp;
 
  err:
-    fqz_destroy_models(&model);
-    free(rev_a);
-    free(len_a);
+    free(b.rec);
+    free(b.out_off);
+    free(b.in_off);
     fqz_free_parameters(&gp);
     free(uncomp);
 
     return NULL;
 }
 
+//-----------------------------------------------------------------------------
+// Automatic strategy selection (FQZ_STRAT_AUTO).
+//
+// Each of the strat_opts strategies is turned into parameters using the
+// statistics of the whole slice, along with variations of its qbits,
+// pbits and dbits.  Every candidate is then trial encoded on a sample of
+// the records, on up to nthreads threads, and the slice is encoded with
+// the smallest.
+
+#define FQZ_AUTO_SAMPLE  (1<<20) // Approx. bytes of qualities per trial
+#define FQZ_AUTO_WINDOWS 8       // Sample taken from this many places
+
+// qbits, pbits and dbits deltas applied to each strategy
+static int auto_vars[][3] = {
+    { 0, 0, 0},
+    {-2, 0, 0}, {+2, 0, 0},
+    { 0,-1, 0}, { 0,+1, 0},
+    { 0, 0,-1}, { 0, 0,+1},
+};
+#define FQZ_AUTO_NVARS (sizeof(auto_vars)/sizeof(*auto_vars))
+#define FQZ_AUTO_NCAND ((FQZ_MAX_STRAT+1) * FQZ_AUTO_NVARS)
+
+// Not every table survives store_array and read_array; the latter
+// rejects a final run whose length is a multiple of 255.
+static int fqz_array_storable(unsigned int *array, int size) {
+    unsigned char buf[2048];
+    unsigned int tmp[1024];
+    int len = store_array(buf, array, size);
+
+    return read_array(buf, len, tmp, size) >= 0
+        && memcmp(tmp, array, size * sizeof(*array)) == 0;
+}
+
+static int fqz_copy_parameters(fqz_gparams *dst, fqz_gparams *src) {
+    *dst = *src;
+    if (!(dst->p = malloc(src->nparam * sizeof(*dst->p))))
+        return -1;
+    memcpy(dst->p, src->p, src->nparam * sizeof(*dst->p));
+    return 0;
+}
+
+typedef struct {
+    int vers;
+    fqz_slice *s;       // Sample records, with s->flags unused
+    unsigned char *in;  // Sample qualities
+    size_t in_size;
+    uint32_t *flags[FQZ_MAX_STRAT+1]; // Sample flags for each strategy
+    fqz_gparams *cand;
+    int *cand_strat;
+    size_t *out_size;   // SIZE_MAX on failure
+    unsigned char **out;
+    int keep_out;       // The sample is the entire slice
+} fqz_auto;
+
+static void fqz_auto_trial(void *arg, int n) {
+    fqz_auto *a = (fqz_auto *)arg;
+    fqz_gparams gp;
+    size_t nrec = a->s->num_records;
+
+    a->out_size[n] = SIZE_MAX;
+    a->out[n] = NULL;
+
+    // The encoder modifies its input, flags and parameters as it goes
+    unsigned char *in = malloc(a->in_size);
+    uint32_t *flags = malloc(nrec * sizeof(*flags));
+    if (!in || !flags || fqz_copy_parameters(&gp, &a->cand[n]) < 0) {
+        free(in);
+        free(flags);
+        return;
+    }
+    memcpy(in, a->in, a->in_size);
+    memcpy(flags, a->flags[a->cand_strat[n]], nrec * sizeof(*flags));
+
+    fqz_slice s = {a->s->num_records, a->s->len, flags};
+    size_t out_size;
+    unsigned char *out = compress_block_fqz2f(a->vers, 0, &s, in, a->in_size,
+                                              &out_size, &gp, 1, 1);
+    if (out) {
+        a->out_size[n] = out_size;
+        if (a->keep_out)
+            a->out[n] = out;
+        else
+            free(out);
+    }
+
+    fqz_free_parameters(&gp);
+    free(in);
+    free(flags);
+}
+
+// Takes up to FQZ_AUTO_SAMPLE bytes of whole records from FQZ_AUTO_WINDOWS
+// places evenly spread over the slice.  rec[] is filled out with the
+// sampled record numbers.  Returns the number of records.
+static int fqz_auto_sample(fqz_slice *s, int *rec, size_t *sample_size) {
+    int w, r, n = 0;
+    size_t size = 0;
+
+    for (w = 0; w < FQZ_AUTO_WINDOWS; w++) {
+        size_t wsize = 0;
+        int end = (int)(((int64_t)w+1) * s->num_records / FQZ_AUTO_WINDOWS);
+        r = (int)((int64_t)w * s->num_records / FQZ_AUTO_WINDOWS);
+        for (; r < end && wsize < FQZ_AUTO_SAMPLE/FQZ_AUTO_WINDOWS; r++) {
+            rec[n++] = r;
+            wsize += s->len[r];
+        }
+        size += wsize;
+    }
+
+    *sample_size = size;
+    return n;
+}
+
+// The slice is encoded as nblocks groups, see compress_block_fqz2f.
+// If best is non-NULL, the chosen parameters are copied to it and the
+// statistics of the strategy they came from to best_st.
+static
+unsigned char *fqz_compress_auto(int vers, fqz_slice *s,
+                                 unsigned char *in, size_t in_size,
+                                 size_t *out_size, int nblocks,
+                                 int nthreads, fqz_gparams *best,
+                                 fqz_slice_stats *best_st) {
+    fqz_gparams cand[FQZ_AUTO_NCAND];
+    fqz_slice_stats stats[FQZ_MAX_STRAT+1];
+    int cand_strat[FQZ_AUTO_NCAND];
+    size_t trial_size[FQZ_AUTO_NCAND];
+    unsigned char *trial_out[FQZ_AUTO_NCAND];
+    uint32_t *flags[FQZ_MAX_STRAT+1] = {NULL};
+    int nrec = s->num_records, ncand = 0, st, i, j, v;
+    int *rec = NULL;
+    unsigned char *out = NULL, *sample = NULL;
+    fqz_slice ss = {0, NULL, NULL};
+    fqz_auto a;
+
+    memset(&a, 0, sizeof(a));
+    memset(trial_out, 0, sizeof(trial_out));
+
+    if (nrec <= 0)
+        return compress_block_fqz2f(vers, 0, s, in, in_size, out_size, NULL,
+                                    nblocks, nthreads);
+
+    // Candidate parameters.  Picking a strategy also adds its selectors
+    // to the top bits of s->flags, so these are kept per strategy.
+    for (st = 0; st <= FQZ_MAX_STRAT; st++) {
+        fqz_gparams *base = &cand[ncand];
+        if (fqz_pick_parameters(base, vers, st, s, in, in_size,
+                                best ? &stats[st] : NULL) < 0)
+            goto err;
+        cand_strat[ncand++] = st;
+
+        if (!(flags[st] = malloc(nrec * sizeof(*flags[st]))))
+            goto err;
+        for (i = 0; i < nrec; i++) {
+            flags[st][i] = s->flags[i];
+            s->flags[i] &= 0xffff;
+        }
+
+        fqz_param *bp = base->p;
+        for (v = 1; v < FQZ_AUTO_NVARS; v++) {
+            int qbits = MIN(15, MAX(0, (int)bp->qbits + auto_vars[v][0]));
+            int pbits = MIN(8,  MAX(0, (int)bp->pbits + auto_vars[v][1]));
+            int dbits = MIN(3,  MAX(0, (int)bp->dbits + auto_vars[v][2]));
+            if (qbits == bp->qbits && pbits == bp->pbits && dbits == bp->dbits)
+                continue;
+
+            if (fqz_copy_parameters(&cand[ncand], base) < 0)
+                goto err;
+            fqz_param *pm = cand[ncand].p;
+            pm->qbits = qbits;
+            pm->pbits = pbits;
+            pm->dbits = dbits;
+            fqz_param_tables(pm);
+            if ((pm->use_ptab && !fqz_array_storable(pm->ptab, 1024)) ||
+                (pm->use_dtab && !fqz_array_storable(pm->dtab, 256))) {
+                fqz_free_parameters(&cand[ncand]);
+                continue;
+            }
+            cand_strat[ncand++] = st;
+        }
+    }
+
+    // The sample to trial them on
+    if (!(rec = malloc(nrec * sizeof(*rec))))
+        goto err;
+    size_t sample_size;
+    ss.num_records = fqz_auto_sample(s, rec, &sample_size);
+    if (!(ss.len = malloc(ss.num_records * sizeof(*ss.len))))
+        goto err;
+    for (st = 0; st <= FQZ_MAX_STRAT; st++)
+        if (!(a.flags[st] = malloc(ss.num_records * sizeof(*a.flags[st]))))
+            goto err;
+
+    a.keep_out = (ss.num_records == nrec && nblocks <= 1);
+    if (a.keep_out) {
+        sample = in;
+        memcpy(ss.len, s->len, nrec * sizeof(*ss.len));
+        for (st = 0; st <= FQZ_MAX_STRAT; st++)
+            memcpy(a.flags[st], flags[st], nrec * sizeof(*flags[st]));
+    } else {
+        size_t *off = malloc(nrec * sizeof(*off)), o = 0, so = 0;
+        if (!off || !(sample = malloc(sample_size))) {
+            free(off);
+            goto err;
+        }
+        for (i = 0; i < nrec; o += s->len[i++])
+            off[i] = o;
+        for (i = 0; i < ss.num_records; i++) {
+            int r = rec[i];
+            ss.len[i] = s->len[r];
+            for (st = 0; st <= FQZ_MAX_STRAT; st++)
+                a.flags[st][i] = flags[st][r];
+            memcpy(sample + so, in + off[r], s->len[r]);
+            so += s->len[r];
+        }
+        free(off);
+    }
+
+    a.vers = vers;
+    a.s = &ss;
+    a.in = sample;
+    a.in_size = sample_size;
+    a.cand = cand;
+    a.cand_strat = cand_strat;
+    a.out_size = trial_size;
+    a.out = trial_out;
+    if (htscodecs_run_jobs(nthreads, ncand, fqz_auto_trial, &a) < 0)
+        goto err;
+
+    for (i = j = 0; i < ncand; i++)
+        if (trial_size[i] < trial_size[j])
+            j = i;
+    if (trial_size[j] == SIZE_MAX)
+        goto err;
+
+    if (best) {
+        if (fqz_copy_parameters(best, &cand[j]) < 0)
+            goto err;
+        *best_st = stats[cand_strat[j]];
+    }
+
+    if (a.keep_out) {
+        out = trial_out[j];
+        trial_out[j] = NULL;
+        *out_size = trial_size[j];
+    } else {
+        memcpy(s->flags, flags[cand_strat[j]], nrec * sizeof(*s->flags));
+        out = compress_block_fqz2f(vers, 0, s, in, in_size, out_size,
+                                   &cand[j], nblocks, nthreads);
+    }
+
+ err:
+    for (i = 0; i < ncand; i++) {
+        fqz_free_parameters(&cand[i]);
+        free(trial_out[i]);
+    }
+    for (st = 0; st <= FQZ_MAX_STRAT; st++) {
+        free(flags[st]);
+        free(a.flags[st]);
+    }
+    if (sample != in)
+        free(sample);
+    free(ss.len);
+    free(rec);
+
+    return out;
+}
+
+char *fqz_compress_blocks(int vers, fqz_slice *s, char *in,
+                          size_t uncomp_size, size_t *comp_size,
+                          int strat, fqz_gparams *gp,
+                          int nblocks, int nthreads) {
+    if (uncomp_size > INT_MAX) {
+        *comp_size = 0;
+        return NULL;
+    }
+
+    // Multiple groups are not CRAM 3.1, so must be asked for explicitly
+    if (!(vers & FQZ_MULTI_BLOCK))
+        nblocks = 1;
+    vers &= ~FQZ_MULTI_BLOCK;
+
+    if (strat == FQZ_STRAT_AUTO && !gp)
+        return (char *)fqz_compress_auto(vers, s, (unsigned char *)in,
+                                         uncomp_size, comp_size, nblocks,
+                                         nthreads, NULL, NULL);
+
+    return (char *)compress_block_fqz2f(vers, MAX(0, strat), s,
+                                        (unsigned char *)in,
+                                        uncomp_size, comp_size, gp,
+                                        nblocks, nthreads);
+}
+
+char *fqz_compress_mt(int vers, fqz_slice *s, char *in, size_t uncomp_size,
+                      size_t *comp_size, int strat, fqz_gparams *gp,
+                      int nthreads) {
+    return fqz_compress_blocks(vers, s, in, uncomp_size, comp_size,
+                               strat, gp, 1, nthreads);
+}
+
 char *fqz_compress(int vers, fqz_slice *s, char *in, size_t uncomp_size,
                    size_t *comp_size, int strat, fqz_gparams *gp) {
+    return fqz_compress_mt(vers, s, in, uncomp_size, comp_size, strat, gp, 1);
+}
+
+//-----------------------------------------------------------------------------
+// Compression sessions.
+//
+// Consecutive slices from one source have near identical quality
+// statistics, so the parameters picked for one slice are kept and reused
+// for the following slices.  Each slice still gets a single cheap pass
+// to build its quality histogram and selectors, but fqz_qual_stats and
+// the table construction only rerun when the histogram or mean record
+// length drifts by more than max_drift, or the old parameters cannot
+// represent the new slice.
+
+struct fqz_session {
+    int vers, strat, nthreads;
+    double max_drift;
+    fqz_gparams gp;        // Parameters picked for an earlier slice
+    fqz_slice_stats st;    // and the statistics of that slice
+    uint64_t qtotal;       // Sum of st.qhist
+    double mean_len;       // Mean record length
+    int size_class;        // See fqz_size_class
+};
+
+// fqz_pick_parameters adjusts the strategy for small slices
+static int fqz_size_class(size_t in_size) {
+    return (in_size >= 300000) + (in_size >= 5000000);
+}
+
+fqz_session *fqz_session_create(int vers, int strat, int nthreads,
+                                double max_drift) {
+    fqz_session *z = calloc(1, sizeof(*z));
+    if (!z)
+        return NULL;
+
+    z->vers = vers;
+    z->strat = strat == FQZ_STRAT_AUTO ? strat : MAX(0, strat);
+    z->nthreads = nthreads;
+    z->max_drift = max_drift;
+
+    return z;
+}
+
+void fqz_session_destroy(fqz_session *z) {
+    if (!z)
+        return;
+
+    fqz_free_parameters(&z->gp);
+    free(z);
+}
+
+// Checks whether the session parameters can encode slice s and are
+// still a good fit for it.  If so the record selectors are added to
+// s->flags, as fqz_qual_stats would have done, and 1 is returned.
+// Otherwise returns 0, leaving s unchanged.
+static int fqz_session_reuse(fqz_session *z, fqz_slice *s,
+                             unsigned char *in, size_t in_size) {
+    fqz_param *pm = z->gp.p;
+    uint32_t qhist[256] = {0};
+    uint32_t *sel = NULL;
+    size_t i, j, rec;
+    double drift;
+    int ok = 0;
+
+    if (!pm || s->num_records <= 0 || in_size == 0 ||
+        fqz_size_class(in_size) != z->size_class)
+        return 0;
+
+    drift = fabs((double)in_size / s->num_records - z->mean_len)
+        / z->mean_len;
+    if (drift > z->max_drift)
+        return 0;
+
+    if (pm->fixed_len) {
+        for (rec = 1; rec < s->num_records; rec++)
+            if (s->len[rec] != s->len[0])
+                return 0;
+    }
+
+    if (!(sel = malloc(s->num_records * sizeof(*sel))))
+        return 0;
+
+    // Histogram and selectors
+    for (i = rec = 0; rec < s->num_records; rec++) {
+        uint32_t len = s->len[rec], tot = 0, x;
+        for (j = 0; j < len; j++, i++) {
+            tot += in[i];
+            qhist[in[i]]++;
+        }
+        tot = len ? (tot*10.0)/len+.5 : 0;
+
+        x = s->flags[rec] >> 16;
+        if (z->st.qa)
+            x |= z->st.qa_bin[MIN(2559, tot)] >> (z->st.qa == 2);
+        if (z->st.r2)
+            x = x*2 + ((s->flags[rec] & FQZ_FREAD2) ? 1 : 0);
+        if (x > z->gp.max_sel)
+            goto out;
+        sel[rec] = x;
+    }
+
+    // Symbols the parameters can't code, and the histogram drift
+    drift = 0;
+    for (i = 0; i < 256; i++) {
+        if (qhist[i] && (pm->store_qmap
+                         ? pm->qmap[i] == INT_MAX
+                         : i > pm->max_sym))
+            goto out;
+        drift += fabs((double)qhist[i] / in_size
+                      - (double)z->st.qhist[i] / z->qtotal);
+    }
+    if (drift/2 > z->max_drift)
+        goto out;
+
+    for (rec = 0; rec < s->num_records; rec++)
+        s->flags[rec] = (s->flags[rec] & 0xffff) | (sel[rec] << 16);
+    ok = 1;
+
+ out:
+    free(sel);
+    return ok;
+}
+
+char *fqz_session_compress(fqz_session *z, fqz_slice *s, char *in,
+                           size_t uncomp_size, size_t *comp_size) {
+    unsigned char *uin = (unsigned char *)in, *out;
+    fqz_gparams gp;
+    int i;
+
     if (uncomp_size > INT_MAX) {
         *comp_size = 0;
         return NULL;
     }
 
-    return (char *)compress_block_fqz2f(vers, strat, s, (unsigned char *)in,
-                                        uncomp_size, comp_size, gp);
+    fqz_fix_lengths(s, uncomp_size);
+
+    if (fqz_session_reuse(z, s, uin, uncomp_size)) {
+        // The encoder modifies the parameters it is given
+        if (fqz_copy_parameters(&gp, &z->gp) < 0)
+            return NULL;
+        out = compress_block_fqz2f(z->vers, 0, s, uin, uncomp_size,
+                                   comp_size, &gp, 1, 1);
+        fqz_free_parameters(&gp);
+        return (char *)out;
+    }
+
+    // Pick new parameters
+    fqz_free_parameters(&z->gp);
+    memset(&z->gp, 0, sizeof(z->gp));
+
+    if (z->strat == FQZ_STRAT_AUTO) {
+        out = fqz_compress_auto(z->vers, s, uin, uncomp_size, comp_size,
+                                1, z->nthreads, &z->gp, &z->st);
+    } else {
+        out = NULL;
+        if (fqz_pick_parameters(&z->gp, z->vers, z->strat, s, uin,
+                                uncomp_size, &z->st) == 0 &&
+            fqz_copy_parameters(&gp, &z->gp) == 0) {
+            out = compress_block_fqz2f(z->vers, 0, s, uin, uncomp_size,
+                                       comp_size, &gp, 1, 1);
+            fqz_free_parameters(&gp);
+        }
+    }
+
+    if (out && z->gp.p && uncomp_size > 0) {
+        for (z->qtotal = i = 0; i < 256; i++)
+            z->qtotal += z->st.qhist[i];
+        z->mean_len = (double)uncomp_size / s->num_records;
+        z->size_class = fqz_size_class(uncomp_size);
+    } else {
+        // Nothing to reuse
+        fqz_free_parameters(&z->gp);
+        z->gp.p = NULL;
+    }
+
+    return (char *)out;
 }
 
 char *fqz_decompress(char *in, size_t comp_size, size_t *uncomp_size,
                      int *lengths, int nlengths) {
+    return fqz_decompress_mt(in, comp_size, uncomp_size, lengths, nlengths, 1);
+}
+
+char *fqz_decompress_mt(char *in, size_t comp_size, size_t *uncomp_size,
+                        int *lengths, int nlengths, int nthreads) {
     return (char *)uncompress_block_fqz2f(NULL, (unsigned char *)in,
-                                          comp_size, uncomp_size, lengths, nlengths);
+                                          comp_size, uncomp_size,
+                                          lengths, nlengths, nthreads);
 }
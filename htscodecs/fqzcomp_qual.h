@@ -49,6 +49,9 @@ extern "C" {
 
 #define FQZ_MAX_STRAT 3
 
+/* Trial all strategies, plus variations, on a sample and use the best */
+#define FQZ_STRAT_AUTO -1
+
 /*
  * Minimal per-record information taken from a cram slice.
  *
@@ -67,6 +70,7 @@ typedef struct {
 static const int GFLAG_MULTI_PARAM = 1;
 static const int GFLAG_HAVE_STAB   = 2;
 static const int GFLAG_DO_REV      = 4;
+static const int GFLAG_MULTI_BLOCK = 8;
 
 // Param flags
 // Add PFLAG_HAVE_DMAP and a dmap[] for delta incr?
@@ -143,7 +147,8 @@ typedef struct {
  * @param in            Buffer of concatenated quality values (no separator)
  * @param in_size       Size of in buffer
  * @param out_size      Size of returned output
- * @param strat         FQZ compression strategy (0 to FQZ_MAX_STRAT)
+ * @param strat         FQZ compression strategy (0 to FQZ_MAX_STRAT),
+ *                      or FQZ_STRAT_AUTO
  * @param gp            Optional fqzcomp paramters (may be NULL).
  *
  * @return              The compressed quality buffer on success,
@@ -152,6 +157,59 @@ typedef struct {
 char *fqz_compress(int vers, fqz_slice *s, char *in, size_t in_size,
                    size_t *out_size, int strat, fqz_gparams *gp);
 
+/** As fqz_compress, but with FQZ_STRAT_AUTO the candidate parameters
+ *  are trialled on up to nthreads threads.
+ */
+char *fqz_compress_mt(int vers, fqz_slice *s, char *in, size_t in_size,
+                      size_t *out_size, int strat, fqz_gparams *gp,
+                      int nthreads);
+
+/** As fqz_compress_mt, but with the records split into nblocks groups
+ *  of similar size.  Each group is coded independently, with a single
+ *  copy of the parameters, so the groups can be encoded and decoded
+ *  in parallel at a small cost in compression ratio.
+ *
+ *  The groups are stored with GFLAG_MULTI_BLOCK, which is not part of
+ *  CRAM 3.1 and needs a decoder supporting it.  It is only used when
+ *  FQZ_MULTI_BLOCK is ORed into vers; otherwise nblocks is ignored and
+ *  the output is as for fqz_compress_mt.
+ */
+#define FQZ_MULTI_BLOCK (1<<16)
+
+char *fqz_compress_blocks(int vers, fqz_slice *s, char *in, size_t in_size,
+                          size_t *out_size, int strat, fqz_gparams *gp,
+                          int nblocks, int nthreads);
+
+/*
+ * A compression session, for a series of slices from the same source.
+ * The parameters picked for one slice are reused for the following
+ * slices until the quality histogram or mean record length drifts by
+ * more than max_drift (0 to 1), saving the statistics gathering on
+ * each slice.  The output is decoded by fqz_decompress as normal.
+ */
+typedef struct fqz_session fqz_session;
+
+/* A suitable default max_drift for fqz_session_create */
+#define FQZ_SESSION_DRIFT 0.1
+
+/** Creates a session compressing with strategy strat, which may be
+ *  FQZ_STRAT_AUTO.  Vers and nthreads are as for fqz_compress_mt.
+ *
+ * @return              The session on success,
+ *                      NULL on failure.
+ */
+fqz_session *fqz_session_create(int vers, int strat, int nthreads,
+                                double max_drift);
+
+/** Frees a session created by fqz_session_create. */
+void fqz_session_destroy(fqz_session *z);
+
+/** Compress a block of quality values within a session.  Arguments and
+ *  return value are as for fqz_compress.
+ */
+char *fqz_session_compress(fqz_session *z, fqz_slice *s, char *in,
+                           size_t in_size, size_t *out_size);
+
 /** Decompress a block of quality values.
  *
  * @param in            Buffer of compressed quality values
@@ -166,6 +224,12 @@ char *fqz_compress(int vers, fqz_slice *s, char *in, size_t in_size,
 char *fqz_decompress(char *in, size_t in_size, size_t *out_size,
                      int *lengths, int nlengths);
 
+/** As fqz_decompress, but decoding the groups of records written by
+ *  fqz_compress_blocks on up to nthreads threads.
+ */
+char *fqz_decompress_mt(char *in, size_t in_size, size_t *out_size,
+                        int *lengths, int nlengths, int nthreads);
+
 /** A utlity function to analyse a quality buffer to gather statistical
  *  information.  This is written into qhist and pm.  This function is only
  *  useful if you intend on passing your own fqz_gparams block to
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2019 Genome Research Ltd.
+ * Author(s): James Bonfield
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ *--------------------------------------------------------------------------
+ * The fqzcomp quality models and the loops coding them, for one alphabet
+ * size.
+ *
+ * Define NSYM before including this file, after c_simple_model.h has
+ * been included for the same NSYM and fqz_update_ctx has been defined.
+ * Only fqzcomp_qual.c uses this.
+ *
+ * A SIMPLE_MODEL codes identically for any NSYM above the largest
+ * symbol, as the unused symbols have zero frequency and stay at the end
+ * of the list.  So picking the smallest NSYM that fits gp->max_sym gives
+ * the same output while shrinking the CTX_SIZE models from 67MB (NSYM
+ * 256) to as little as 3MB (NSYM 8).
+ *
+ * Small slices visit only a fraction of the contexts, so each model is
+ * initialised when its context is first used, as recorded in
+ * m->qual_init.
+ *--------------------------------------------------------------------------
+ */
+
+#ifndef FQZ_QUAL
+#define FQZ_QUAL(a,b) PASTE3(fqz_qual,a,b)
+#endif
+
+static int FQZ_QUAL(NSYM,_create)(fqz_model *m, int max_sym) {
+    size_t sz = sizeof(SIMPLE_MODEL(NSYM,_)) * CTX_SIZE;
+
+    if (!(m->qual = htscodecs_tls_alloc(sz + CTX_SIZE)))
+        return -1;
+
+    m->qual_nsym = NSYM;
+    m->qual_max_sym = max_sym;
+    m->qual_init = (uint8_t *)m->qual + sz;
+    memset(m->qual_init, 0, CTX_SIZE);
+
+    return 0;
+}
+
+// Returns the model for ctx, initialising it on first use.
+static inline SIMPLE_MODEL(NSYM,_) *FQZ_QUAL(NSYM,_model)(fqz_model *m,
+                                                         unsigned int ctx) {
+    SIMPLE_MODEL(NSYM,_) *qual = (SIMPLE_MODEL(NSYM,_) *)m->qual + ctx;
+
+    if (!m->qual_init[ctx]) {
+        SIMPLE_MODEL(NSYM,_init)(qual, m->qual_max_sym);
+        m->qual_init[ctx] = 1;
+    }
+
+    return qual;
+}
+
+// Encodes the remaining state->p quality values of a record, starting at
+// in[i+1].  Returns the index of the last value coded.
+static inline size_t FQZ_QUAL(NSYM,_encode)(fqz_model *m,
+                                            fqz_param *pm, fqz_state *state,
+                                            RangeCoder *rc, unsigned char *in,
+                                            size_t i, size_t in_size,
+                                            unsigned int *last_p) {
+    //     gcc    clang            gcc+fqz_qual_stats imp.
+    // q40 5.033  5.026     -27%   4.137 -38%
+    // q4  5.595            -15%   4.011 -36%
+    // _Q  1.225            -11%   0.956
+    unsigned int last = *last_p;
+    int j = -1;
+
+    while (state->p >= 4 && i+j+4 < in_size) {
+        SIMPLE_MODEL(NSYM,_) *q1, *q2, *q3, *q4;
+        // Model has symbols sorted by frequency, so most common are at
+        // start.  So while model is approx 1Kb, the first cache line is
+        // a big win.
+        q1 = FQZ_QUAL(NSYM,_model)(m, last);
+        mm_prefetch(q1);
+        unsigned char qm1 = pm->qmap[in[i + ++j]];
+        last = fqz_update_ctx(pm, state, qm1);
+
+        q2 = FQZ_QUAL(NSYM,_model)(m, last);
+        mm_prefetch(q2);
+        unsigned char qm2 = pm->qmap[in[i + ++j]];
+        last = fqz_update_ctx(pm, state, qm2);
+
+        q3 = FQZ_QUAL(NSYM,_model)(m, last);
+        mm_prefetch(q3);
+        unsigned char qm3 = pm->qmap[in[i + ++j]];
+        last = fqz_update_ctx(pm, state, qm3);
+
+        q4 = FQZ_QUAL(NSYM,_model)(m, last);
+        mm_prefetch(q4);
+        unsigned char qm4 = pm->qmap[in[i + ++j]];
+        last = fqz_update_ctx(pm, state, qm4);
+
+        SIMPLE_MODEL(NSYM,_encodeSymbol)(q1, rc, qm1);
+        SIMPLE_MODEL(NSYM,_encodeSymbol)(q2, rc, qm2);
+        SIMPLE_MODEL(NSYM,_encodeSymbol)(q3, rc, qm3);
+        SIMPLE_MODEL(NSYM,_encodeSymbol)(q4, rc, qm4);
+    }
+
+    while (state->p > 0) {
+        SIMPLE_MODEL(NSYM,_) *q = FQZ_QUAL(NSYM,_model)(m, last);
+        mm_prefetch(q);
+        unsigned char qm = pm->qmap[in[i + ++j]];
+        last = fqz_update_ctx(pm, state, qm);
+        SIMPLE_MODEL(NSYM,_encodeSymbol)(q, rc, qm);
+    }
+
+    *last_p = last;
+    return i + j;
+}
+
+// Decodes quality values into out[i] onwards until the end of the record
+// or of the buffer (len).  Returns the new value of i.
+static inline ssize_t FQZ_QUAL(NSYM,_decode)(fqz_model *m,
+                                             fqz_param *pm, fqz_state *state,
+                                             RangeCoder *rc, unsigned char *out,
+                                             ssize_t i, ssize_t len,
+                                             unsigned int *last_p) {
+    unsigned int last = *last_p;
+
+    do {
+        unsigned char Q = SIMPLE_MODEL(NSYM,_decodeSymbol)
+            (FQZ_QUAL(NSYM,_model)(m, last), rc);
+
+        last = fqz_update_ctx(pm, state, Q);
+        out[i++] = pm->qmap[Q];
+    } while (state->p != 0 && i < len);
+
+    *last_p = last;
+    return i;
+}
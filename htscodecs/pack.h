@@ -52,6 +52,15 @@ extern "C" {
 uint8_t *hts_pack(uint8_t *data, int64_t len,
                   uint8_t *out_meta, int *out_meta_len, uint64_t *out_len);
 
+/*
+ * As hts_pack, but writing to a caller supplied "out" buffer which must
+ * be at least len+1 bytes long.  If out is NULL it is allocated instead,
+ * as per hts_pack.
+ */
+uint8_t *hts_pack_to(uint8_t *data, int64_t len,
+                     uint8_t *out_meta, int *out_meta_len,
+                     uint8_t *out, uint64_t *out_len);
+
 /*
  * Unpacks the meta-data portions of the hts_pack algorithm.
  * This consists of the count of symbols and their values.
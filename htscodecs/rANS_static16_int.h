@@ -52,11 +52,38 @@
 #define X_STRIPE 0x08    // For N-byte integer data; rotate & encode N streams.
 #define X_32     0x04    // 32-way unrolling instead of 4-way
 
+// Flags in the order-1 frequency table byte, below the TF_SHIFT nibble
+#define O1_FREQ_COMP  0x01 // Frequency table is itself rANS compressed
+
+// Extensions to order-1 start with O1_FREQ_EXT_LEN bytes claiming an empty
+// compressed frequency table (O1_FREQ_COMP and two zero sizes).  Older
+// decoders fail on this, rather than misreading the flags, which follow
+// in the next byte.
+#define O1_FREQ_EXT_LEN 3
+#define O1_FREQ_O2    0x02 // Order-2, with promoted pair contexts
+#define O1_FREQ_MODEL 0x04 // Shared rans_ctx model, followed by its id
+#define O1_FREQ_X64   0x08 // 64-way, followed by the order of the data
+
+// Writes the O1_FREQ_EXT_LEN byte extension marker
+static inline void o1_freq_ext_put(uint8_t *cp) {
+    cp[0] = O1_FREQ_COMP;
+    cp[1] = 0;
+    cp[2] = 0;
+}
+
+// Returns the extension flags byte of an order-1 block, or 0 if it is
+// a plain order-1 block.
+static inline int o1_freq_ext_get(const uint8_t *in, unsigned int in_size) {
+    return in_size > O1_FREQ_EXT_LEN && in[0] == O1_FREQ_COMP
+        && in[1] == 0 && in[2] == 0 ? in[O1_FREQ_EXT_LEN] : 0;
+}
+
 // Not part of the file format, but used to direct the encoder
 #define X_SIMD_AUTO 0x100 // automatically enable X_32 if we deem it worthy
 #define X_SW32_ENC  0x200 // forcibly use the software version of X_32
 #define X_SW32_DEC  0x400 // forcibly use the software version of X_32
 #define X_NO_AVX512 0x800 // turn off avx512, but permits AVX2
+#define X_64 (X_32|(1<<22)) // 64-way unrolling; RANS_ORDER_X64
 
 #define TF_SHIFT 12
 #define TOTFREQ (1<<TF_SHIFT)
@@ -79,7 +106,7 @@ unsigned char *rans_uncompress_O0_4x16(unsigned char *in, unsigned int in_size,
                                        unsigned char *out, unsigned int out_sz);
 
 int rans_compute_shift(uint32_t *F0, uint32_t (*F)[256], uint32_t *T,
-                       uint32_t *S);
+                       uint32_t *A, uint32_t *S);
 
 // Rounds to next power of 2.
 // credit to http://graphics.stanford.edu/~seander/bithacks.html
@@ -365,7 +392,8 @@ static inline int encode_freq1(uint8_t *in, uint32_t in_size, int Nway,
     // Decide between 10-bit and 12-bit freqs.
     // Fills out S[] to hold the new scaled maximum value.
     uint32_t S[256] = {0};
-    int shift = rans_compute_shift(T, F, T, S);
+    // Every symbol in[] is counted in T, as a context or the final symbol
+    int shift = rans_compute_shift(T, F, T, T, S);
 
     // Normalise so T[i] == TOTFREQ_O1
     for (i = 0; i < 256; i++) {
@@ -62,7 +62,11 @@
 #define TOTFREQ_O1_FAST (1<<TF_SHIFT_O1_FAST)
 
 
+// Number of interleaved states.  rANS_static64x16pr.c reuses this file
+// with NX set to 64, renaming the functions.
+#ifndef NX
 #define NX 32
+#endif
 
 unsigned char *rans_compress_O0_32x16(unsigned char *in,
                                       unsigned int in_size,
@@ -441,7 +445,7 @@ unsigned char *rans_compress_O1_32x16(unsigned char *in,
     }
 
     cp = out;
-    int shift = encode_freq1(in, in_size, 32, syms, &cp); 
+    int shift = encode_freq1(in, in_size, NX, syms, &cp);
     if (shift < 0) {
         free(out_free);
         htscodecs_tls_free(syms);
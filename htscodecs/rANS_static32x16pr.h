@@ -77,8 +77,29 @@ unsigned char *rans_uncompress_O1_32x16(unsigned char *in,
                                         unsigned char *out,
                                         unsigned int out_sz);
 
+// 64-way scalar versions, used by RANS_ORDER_X64
+unsigned char *rans_compress_O0_64x16(unsigned char *in,
+                                      unsigned int in_size,
+                                      unsigned char *out,
+                                      unsigned int *out_size);
+
+unsigned char *rans_uncompress_O0_64x16(unsigned char *in,
+                                        unsigned int in_size,
+                                        unsigned char *out,
+                                        unsigned int out_sz);
+
+unsigned char *rans_compress_O1_64x16(unsigned char *in,
+                                      unsigned int in_size,
+                                      unsigned char *out,
+                                      unsigned int *out_size);
+
+unsigned char *rans_uncompress_O1_64x16(unsigned char *in,
+                                        unsigned int in_size,
+                                        unsigned char *out,
+                                        unsigned int out_sz);
+
 //----------------------------------------------------------------------
-// Intel SSE4 implementation.  Only the O0 decoder for now
+// Intel SSE4 implementation
 #if defined(HAVE_SSE4_1) && defined(HAVE_SSSE3) && defined(HAVE_POPCNT)
 unsigned char *rans_compress_O0_32x16_sse4(unsigned char *in,
                                            unsigned int in_size,
@@ -90,6 +111,11 @@ unsigned char *rans_uncompress_O0_32x16_sse4(unsigned char *in,
                                              unsigned char *out,
                                              unsigned int out_sz);
 
+unsigned char *rans_compress_O1_32x16_sse4(unsigned char *in,
+                                           unsigned int in_size,
+                                           unsigned char *out,
+                                           unsigned int *out_size);
+
 unsigned char *rans_uncompress_O1_32x16_sse4(unsigned char *in,
                                              unsigned int in_size,
                                              unsigned char *out,
@@ -142,6 +168,36 @@ unsigned char *rans_uncompress_O1_32x16_avx512(unsigned char *in,
                                                unsigned int in_size,
                                                unsigned char *out,
                                                unsigned int out_sz);
+
+unsigned char *rans_compress_O0_64x16_avx512(unsigned char *in,
+                                             unsigned int in_size,
+                                             unsigned char *out,
+                                             unsigned int *out_size);
+
+unsigned char *rans_uncompress_O0_64x16_avx512(unsigned char *in,
+                                               unsigned int in_size,
+                                               unsigned char *out,
+                                               unsigned int out_sz);
+
+unsigned char *rans_compress_O1_64x16_avx512(unsigned char *in,
+                                             unsigned int in_size,
+                                             unsigned char *out,
+                                             unsigned int *out_size);
+
+unsigned char *rans_uncompress_O1_64x16_avx512(unsigned char *in,
+                                               unsigned int in_size,
+                                               unsigned char *out,
+                                               unsigned int out_sz);
+
+// Order-2 decode loop for the 32 states R[] in contexts c[].  Decodes
+// while it is safe to read 64 bytes from *ptr, then returns the number of
+// rows done for the scalar code to finish.  See rans_uncompress_O2.
+unsigned int rans_o2_decode_32x16_avx512(uint32_t *R, uint32_t *c,
+                                         uint8_t **ptr, uint8_t *ptr_end,
+                                         unsigned char *out,
+                                         unsigned int out_sz,
+                                         uint32_t *s3, uint16_t *cmap,
+                                         uint32_t *sym, unsigned int shift);
 #endif // HAVE_AVX512
 
 //----------------------------------------------------------------------
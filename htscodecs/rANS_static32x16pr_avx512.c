@@ -1066,6 +1066,167 @@ unsigned char *rans_uncompress_O1_32x16_avx512(unsigned char *in,
 
     return NULL;
 }
+
+/*
+ * Order-2 decoding.  The frequency tables, the scalar code and the
+ * s3[] entry layouts are in rANS_static4x16pr.c (see rans_o2_dec_sym).
+ *
+ * With 10-bit frequencies s3[] gives the next context directly, so there
+ * is one gather on the critical path as with order-1 plus a second
+ * off it for the symbol.  With 12-bit frequencies we gather the pair
+ * context from cmap[] first.
+ */
+unsigned int rans_o2_decode_32x16_avx512(uint32_t *R, uint32_t *c,
+                                         uint8_t **ptr, uint8_t *ptr_end,
+                                         unsigned char *out,
+                                         unsigned int out_sz,
+                                         uint32_t *s3, uint16_t *cmap,
+                                         uint32_t *sym, unsigned int shift) {
+    unsigned int isz = out_sz/NX, i = 0;
+    int iN[NX], z;
+    for (z = 0; z < NX; z++)
+        iN[z] = z*isz;
+
+    if (isz <= 64)
+        return 0;
+
+    uint16_t *sp = (uint16_t *)*ptr;
+    const uint32_t mask = (1u << shift)-1;
+    __m512i _maskv = _mm512_set1_epi32(mask);
+    __m512i _Rv1 = _mm512_loadu_si512((__m512i *)&R[0]);
+    __m512i _Rv2 = _mm512_loadu_si512((__m512i *)&R[16]);
+    __m512i _Cv1 = _mm512_loadu_si512((__m512i *)&c[0]);
+    __m512i _Cv2 = _mm512_loadu_si512((__m512i *)&c[16]);
+
+    union {
+        unsigned char tbuf[32][32];
+        uint64_t tbuf64[32][4];
+    } u __attribute__((aligned(32)));
+    unsigned int tidx = 0;
+
+    for (; i < isz-64 && (uint8_t *)sp < ptr_end; i++) {
+        __m512i _Sv1, _Sv2, _fv1, _fv2, _bv1, _bv2, _sv1, _sv2;
+        __m512i _masked1 = _mm512_and_si512(_Rv1, _maskv);
+        __m512i _masked2 = _mm512_and_si512(_Rv2, _maskv);
+
+        if (shift == TF_SHIFT_O1_FAST) {
+            //  S[z] = s3[(c[z]<<shift) + m[z]];
+            _masked1 = _mm512_add_epi32(_masked1,
+                                        _mm512_slli_epi32(_Cv1, TF_SHIFT_O1_FAST));
+            _masked2 = _mm512_add_epi32(_masked2,
+                                        _mm512_slli_epi32(_Cv2, TF_SHIFT_O1_FAST));
+            _Sv1 = _mm512_i32gather_epi32(_masked1, (int *)s3, 4);
+            _Sv2 = _mm512_i32gather_epi32(_masked2, (int *)s3, 4);
+
+            // f = S>>21, b = (S>>9) & mask, c = S & 0x1ff, s = sym[c]
+            _fv1 = _mm512_srli_epi32(_Sv1, 21);
+            _fv2 = _mm512_srli_epi32(_Sv2, 21);
+            _bv1 = _mm512_and_si512(_mm512_srli_epi32(_Sv1, 9), _maskv);
+            _bv2 = _mm512_and_si512(_mm512_srli_epi32(_Sv2, 9), _maskv);
+            _Cv1 = _mm512_and_si512(_Sv1, _mm512_set1_epi32(0x1ff));
+            _Cv2 = _mm512_and_si512(_Sv2, _mm512_set1_epi32(0x1ff));
+            _sv1 = _mm512_i32gather_epi32(_Cv1, (int *)sym, 4);
+            _sv2 = _mm512_i32gather_epi32(_Cv2, (int *)sym, 4);
+        } else {
+            //  S[z] = s3[(cmap[c[z]]<<shift) + m[z]];
+            __m512i _xv1 = _mm512_i32gather_epi32(_Cv1, (int *)cmap, 2);
+            __m512i _xv2 = _mm512_i32gather_epi32(_Cv2, (int *)cmap, 2);
+            _xv1 = _mm512_and_si512(_xv1, _mm512_set1_epi32(0xffff));
+            _xv2 = _mm512_and_si512(_xv2, _mm512_set1_epi32(0xffff));
+            _masked1 = _mm512_add_epi32(_masked1,
+                                        _mm512_slli_epi32(_xv1, TF_SHIFT_O1));
+            _masked2 = _mm512_add_epi32(_masked2,
+                                        _mm512_slli_epi32(_xv2, TF_SHIFT_O1));
+            _Sv1 = _mm512_i32gather_epi32(_masked1, (int *)s3, 4);
+            _Sv2 = _mm512_i32gather_epi32(_masked2, (int *)s3, 4);
+
+            // f = S>>20 (with 0 meaning 4096), b = (S>>8) & mask,
+            // s = S & 0xff and c = (c<<8 | s) & 0xffff
+            __m512i max_freq = _mm512_set1_epi32(TOTFREQ_O1);
+            __m512i zero = _mm512_setzero_si512();
+            _fv1 = _mm512_srli_epi32(_Sv1, TF_SHIFT_O1+8);
+            _fv2 = _mm512_srli_epi32(_Sv2, TF_SHIFT_O1+8);
+            _fv1 = _mm512_mask_blend_epi32
+                (_mm512_cmpeq_epi32_mask(_fv1, zero), _fv1, max_freq);
+            _fv2 = _mm512_mask_blend_epi32
+                (_mm512_cmpeq_epi32_mask(_fv2, zero), _fv2, max_freq);
+            _bv1 = _mm512_and_si512(_mm512_srli_epi32(_Sv1, 8), _maskv);
+            _bv2 = _mm512_and_si512(_mm512_srli_epi32(_Sv2, 8), _maskv);
+            _sv1 = _mm512_and_si512(_Sv1, _mm512_set1_epi32(0xff));
+            _sv2 = _mm512_and_si512(_Sv2, _mm512_set1_epi32(0xff));
+            _Cv1 = _mm512_and_si512(_mm512_or_si512(
+                                        _mm512_slli_epi32(_Cv1, 8), _sv1),
+                                    _mm512_set1_epi32(0xffff));
+            _Cv2 = _mm512_and_si512(_mm512_or_si512(
+                                        _mm512_slli_epi32(_Cv2, 8), _sv2),
+                                    _mm512_set1_epi32(0xffff));
+        }
+
+        //  R[z] = f[z] * (R[z] >> shift) + b[z];
+        _Rv1 = _mm512_add_epi32(
+                   _mm512_mullo_epi32(
+                       _mm512_srl_epi32(_Rv1, _mm_cvtsi32_si128(shift)),
+                       _fv1), _bv1);
+        _Rv2 = _mm512_add_epi32(
+                   _mm512_mullo_epi32(
+                       _mm512_srl_epi32(_Rv2, _mm_cvtsi32_si128(shift)),
+                       _fv2), _bv2);
+
+        // RansDecRenorm(&R[z], &ptr);
+        __m512i _renorm_mask1 = _mm512_xor_si512(_Rv1,
+                                    _mm512_set1_epi32(0x80000000));
+        __m512i _renorm_mask2 = _mm512_xor_si512(_Rv2,
+                                    _mm512_set1_epi32(0x80000000));
+
+        int _imask1 =_mm512_cmpgt_epi32_mask
+            (_mm512_set1_epi32(RANS_BYTE_L-0x80000000), _renorm_mask1);
+        int _imask2 = _mm512_cmpgt_epi32_mask
+            (_mm512_set1_epi32(RANS_BYTE_L-0x80000000), _renorm_mask2);
+
+        __m512i renorm_words1 = _mm512_cvtepu16_epi32
+            (_mm256_loadu_si256((const __m256i *)sp));
+        sp += _mm_popcnt_u32(_imask1);
+
+        __m512i renorm_words2 = _mm512_cvtepu16_epi32
+            (_mm256_loadu_si256((const __m256i *)sp));
+        sp += _mm_popcnt_u32(_imask2);
+
+        __m512i _renorm_vals1 =
+            _mm512_maskz_expand_epi32(_imask1, renorm_words1);
+        __m512i _renorm_vals2 =
+            _mm512_maskz_expand_epi32(_imask2, renorm_words2);
+
+        _Rv1 = _mm512_mask_slli_epi32(_Rv1, _imask1, _Rv1, 16);
+        _Rv2 = _mm512_mask_slli_epi32(_Rv2, _imask2, _Rv2, 16);
+
+        _Rv1 = _mm512_add_epi32(_Rv1, _renorm_vals1);
+        _Rv2 = _mm512_add_epi32(_Rv2, _renorm_vals2);
+
+        _mm_storeu_si128((__m128i *)(&u.tbuf64[tidx][0]),
+                         _mm512_cvtepi32_epi8(_sv1));
+        _mm_storeu_si128((__m128i *)(&u.tbuf64[tidx][2]),
+                         _mm512_cvtepi32_epi8(_sv2));
+
+        if (++tidx == 32) {
+            transpose_and_copy(out, iN, u.tbuf);
+            tidx = 0;
+        }
+    }
+
+    _mm512_storeu_si512((__m512i *)&R[0],  _Rv1);
+    _mm512_storeu_si512((__m512i *)&R[16], _Rv2);
+    _mm512_storeu_si512((__m512i *)&c[0],  _Cv1);
+    _mm512_storeu_si512((__m512i *)&c[16], _Cv2);
+    *ptr = (uint8_t *)sp;
+
+    unsigned int T;
+    for (z = 0; z < NX; z++)
+        for (T = 0; T < tidx; T++)
+            out[iN[z]+T] = u.tbuf[T][z];
+
+    return i;
+}
+
 #else  // HAVE_AVX512
 // Prevent "empty translation unit" errors when building without AVX512
 const char *rANS_static32x16pr_avx512_disabled = "No AVX512";
@@ -108,102 +108,100 @@ static inline __m128i _mm_i32gather_epi32x(int *b, __m128i idx, int size) {
     return _mm_set_epi32(b[c[3]], b[c[2]], b[c[1]], b[c[0]]);
 }
 
-// SSE4 implementation of the Order-0 encoder is poorly performing.
-// Disabled for now.
-#if 0
-#define LOAD128v(a,b)                                   \
-    __m128i a[8];                                       \
-    a[0] = _mm_load_si128((__m128i *)&b[0]);            \
-    a[1] = _mm_load_si128((__m128i *)&b[4]);            \
-    a[2] = _mm_load_si128((__m128i *)&b[8]);            \
-    a[3] = _mm_load_si128((__m128i *)&b[12]);           \
-    a[4] = _mm_load_si128((__m128i *)&b[16]);           \
-    a[5] = _mm_load_si128((__m128i *)&b[20]);           \
-    a[6] = _mm_load_si128((__m128i *)&b[24]);           \
-    a[7] = _mm_load_si128((__m128i *)&b[28]);
-
-#define STORE128v(a,b)                                  \
-    _mm_store_si128((__m128i *)&b[ 0], a[0]);           \
-    _mm_store_si128((__m128i *)&b[ 4], a[1]);           \
-    _mm_store_si128((__m128i *)&b[ 8], a[2]);           \
-    _mm_store_si128((__m128i *)&b[12], a[3]);           \
-    _mm_store_si128((__m128i *)&b[16], a[4]);           \
-    _mm_store_si128((__m128i *)&b[20], a[5]);           \
-    _mm_store_si128((__m128i *)&b[24], a[6]);           \
-    _mm_store_si128((__m128i *)&b[28], a[7]);
-
-static inline __m128i _mm_mulhi_epu32(__m128i a, __m128i b) {
-    // Multiply bottom 4 items and top 4 items together.
-    __m128i ab_hm = _mm_mul_epu32(_mm_srli_epi64(a, 32),_mm_srli_epi64(b, 32));
-    __m128i ab_lm = _mm_srli_epi64(_mm_mul_epu32(a, b), 32);
-
-    // Blend or and/or seems to make no difference.
-    return _mm_blend_epi16(ab_lm, ab_hm, 0xcc);
-
-//    // Shift to get hi 32-bit of each 64-bit product
-//    ab_hm = _mm_and_si128(ab_hm,_mm_set1_epi64x((uint64_t)0xffffffff00000000));
+//-----------------------------------------------------------------------------
+// Encoders.
 //
-//    return _mm_or_si128(ab_lm, ab_hm);
-}
-
-// Shift A>>B for non-constant B exists in AVX2, but not SSE world.
-// We simulate this for now by store, shift, and load.  Ugly!
-static inline __m128i _mm_srlv_epi32x(__m128i a, __m128i b) {
-// Extract and inline shift.  Slowest clang, joint fastest gcc
-//    return _mm_set_epi32(_mm_extract_epi32(a,3)>>_mm_extract_epi32(b,3),
-//                       _mm_extract_epi32(a,2)>>_mm_extract_epi32(b,2),
-//                       _mm_extract_epi32(a,1)>>_mm_extract_epi32(b,1),
-//                       _mm_extract_epi32(a,0)>>_mm_extract_epi32(b,0));
-
-// Half store and inline shift; Fastest gcc, comparable to others below clang
-//    uint32_t A[4];
-//    _mm_storeu_si128((__m128i *)&A, a);
+// Each group of 4 states is updated as per RansEncPutSymbol, with the
+// symbols for the 4 lanes loaded as whole RansEncSymbol structs and
+// transposed into x_max, rcp_freq, bias and cmpl_freq/rcp_shift vectors.
 //
-//    return _mm_set_epi32(A[3]>>_mm_extract_epi32(b,3),
-//                       A[2]>>_mm_extract_epi32(b,2),
-//                       A[1]>>_mm_extract_epi32(b,1),
-//                       A[0]>>_mm_extract_epi32(b,0));
-
-// Other half
-    uint32_t B[4];
-    _mm_storeu_si128((__m128i *)&B, b);
-    return _mm_set_epi32(_mm_extract_epi32(a,3)>>B[3],
-                         _mm_extract_epi32(a,2)>>B[2],
-                         _mm_extract_epi32(a,1)>>B[1],
-                         _mm_extract_epi32(a,0)>>B[0]);
-
-// Check if all b[] match, and constant shift if so.
-// Too costly, even on q4 where it's common for all shift to be identical.
-//    __m128i cmp = _mm_cmpeq_epi32(b, _mm_shuffle_epi32(b, 0x39));
-//    if (_mm_movemask_ps((__m128)cmp) == 15) {
-//      return _mm_srl_epi32(a, _mm_set1_epi64x(_mm_extract_epi32(b,0)));
-//      //_mm_storeu_si128((__m128i *)&B,_mm_set1_epi32(_mm_extract_epi32(b,0)));
-//    } else {
-//      uint32_t B[4];
-//      _mm_storeu_si128((__m128i *)&B, b);
-//      return _mm_set_epi32(_mm_extract_epi32(a,3)>>B[3],
-//                           _mm_extract_epi32(a,2)>>B[2],
-//                           _mm_extract_epi32(a,1)>>B[1],
-//                           _mm_extract_epi32(a,0)>>B[0]);
-//    }
-
-
-// Full store and inline shift
-//   uint32_t A[4], B[4] __attribute__((aligned(16)));
-//   _mm_storeu_si128((__m128i *)&A, a);
-//   _mm_storeu_si128((__m128i *)&B, b);
-//
-//   return _mm_set_epi32(A[3]>>B[3], A[2]>>B[2], A[1]>>B[1], A[0]>>B[0]);
-
-// Full store, shift and load
-//    uint32_t A[4], B[4] __attribute__((aligned(16)));
-//    _mm_storeu_si128((__m128i *)&A, a);
-//    _mm_storeu_si128((__m128i *)&B, b);
-//    A[0]>>=B[0];
-//    A[1]>>=B[1];
-//    A[2]>>=B[2];
-//    A[3]>>=B[3];
-//    return _mm_loadu_si128((__m128i *)A);
+// The division q = mul_hi(x, rcp_freq) >> rcp_shift is the costly part.
+// SSE has neither mulhi_epu32 nor a per-lane variable shift (srlv), so
+// we use _mm_mul_epu32 for the even and odd lanes and turn the variable
+// shift into a multiply by 2^(30-shift) followed by a constant >>30.
+// The power of two is made by building a float exponent, avoiding any
+// per lane extraction.  This gives identical results to the scalar code.
+
+// Shuffles to gather the bottom 16-bits of the states needing renorm
+// into the top of the bottom 64-bits, highest lane last, ready for
+// storing at ptr16-4.
+#define X(A) 4*A,4*A+1
+#define _ 0x80,0x80
+static const uint8_t enc_shuf_sse4[16][16] __attribute__((aligned(16))) = {
+    {  _ ,  _ ,  _ ,  _ , _,_,_,_},
+    {  _ ,  _ ,  _ ,X(0), _,_,_,_},
+    {  _ ,  _ ,  _ ,X(1), _,_,_,_},
+    {  _ ,  _ ,X(0),X(1), _,_,_,_},
+
+    {  _ ,  _ ,  _ ,X(2), _,_,_,_},
+    {  _ ,  _ ,X(0),X(2), _,_,_,_},
+    {  _ ,  _ ,X(1),X(2), _,_,_,_},
+    {  _ ,X(0),X(1),X(2), _,_,_,_},
+
+    {  _ ,  _ ,  _ ,X(3), _,_,_,_},
+    {  _ ,  _ ,X(0),X(3), _,_,_,_},
+    {  _ ,  _ ,X(1),X(3), _,_,_,_},
+    {  _ ,X(0),X(1),X(3), _,_,_,_},
+
+    {  _ ,  _ ,X(2),X(3), _,_,_,_},
+    {  _ ,X(0),X(2),X(3), _,_,_,_},
+    {  _ ,X(1),X(2),X(3), _,_,_,_},
+    {X(0),X(1),X(2),X(3), _,_,_,_},
+};
+#undef X
+#undef _
+
+// Encodes one symbol into each of 4 rANS states in Rv, for lanes
+// 0 to 3 using s0 to s3.  Renormalisation output is written downwards
+// from *ptr16, with lane 3 written first as in the scalar code.
+static inline __m128i rans_enc4_sse4(__m128i Rv, uint16_t **ptr16,
+                                     RansEncSymbol *s0, RansEncSymbol *s1,
+                                     RansEncSymbol *s2, RansEncSymbol *s3) {
+    // Transpose 4 syms into their component vectors
+    __m128i a = _mm_loadu_si128((__m128i *)s0);
+    __m128i b = _mm_loadu_si128((__m128i *)s1);
+    __m128i c = _mm_loadu_si128((__m128i *)s2);
+    __m128i d = _mm_loadu_si128((__m128i *)s3);
+
+    __m128i t0 = _mm_unpacklo_epi32(a, b);
+    __m128i t1 = _mm_unpacklo_epi32(c, d);
+    __m128i t2 = _mm_unpackhi_epi32(a, b);
+    __m128i t3 = _mm_unpackhi_epi32(c, d);
+
+    __m128i xmax = _mm_unpacklo_epi64(t0, t1);
+    __m128i rfv  = _mm_unpackhi_epi64(t0, t1);
+    __m128i bias = _mm_unpacklo_epi64(t2, t3);
+    __m128i SDv  = _mm_unpackhi_epi64(t2, t3);
+
+    // Renorm:
+    // if (x > x_max) {*--ptr16 = x & 0xffff; x >>= 16;}
+    __m128i cv = _mm_cmpgt_epi32(Rv, xmax);
+    unsigned int imask = _mm_movemask_ps((__m128)cv);
+    __m128i V = _mm_shuffle_epi8(Rv, _mm_load_si128((__m128i *)
+                                                    enc_shuf_sse4[imask]));
+    _mm_storel_epi64((__m128i *)(*ptr16-4), V);
+    *ptr16 -= _mm_popcnt_u32(imask);
+    Rv = _mm_blendv_epi8(Rv, _mm_srli_epi32(Rv, 16), cv);
+
+    // q = mul_hi(x, rcp_freq) >> (rcp_shift-32)
+    //   = (mul_hi(x, rcp_freq) * 2^(30-(rcp_shift-32))) >> 30
+    __m128i shiftv = _mm_srli_epi32(SDv, 16);
+    __m128i pow2 = _mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(127+30+32),
+                                                shiftv), 23);
+    pow2 = _mm_cvttps_epi32(_mm_castsi128_ps(pow2));
+
+    __m128i pe = _mm_mul_epu32(Rv, rfv);
+    __m128i po = _mm_mul_epu32(_mm_srli_epi64(Rv, 32),
+                               _mm_srli_epi64(rfv, 32));
+    pe = _mm_mul_epu32(_mm_srli_epi64(pe, 32), pow2);
+    po = _mm_mul_epu32(_mm_srli_epi64(po, 32), _mm_srli_epi64(pow2, 32));
+    __m128i qv = _mm_blend_epi16(_mm_srli_epi64(pe, 30),
+                                 _mm_slli_epi64(po, 2), 0xcc);
+
+    // x += bias + q*cmpl_freq
+    __m128i freqv = _mm_and_si128(SDv, _mm_set1_epi32(0xffff));
+    qv = _mm_add_epi32(_mm_mullo_epi32(qv, freqv), bias);
+    return _mm_add_epi32(Rv, qv);
 }
 
 unsigned char *rans_compress_O0_32x16_sse4(unsigned char *in,
@@ -212,7 +210,7 @@ unsigned char *rans_compress_O0_32x16_sse4(unsigned char *in,
                                            unsigned int *out_size) {
     unsigned char *cp, *out_end;
     RansEncSymbol syms[256];
-    RansState ransN[NX];
+    RansState ransN[NX] __attribute__((aligned(16)));
     uint8_t* ptr;
     uint32_t F[256+MAGIC] = {0};
     int i, j, tab_size = 0, x, z;
@@ -252,7 +250,6 @@ unsigned char *rans_compress_O0_32x16_sse4(unsigned char *in,
     cp = out;
     cp += encode_freq(cp, F);
     tab_size = cp-out;
-    //write(2, out+4, cp-(out+4));
 
     if (normalise_freq(F, fsum, TOTFREQ) < 0)
         return NULL;
@@ -272,177 +269,29 @@ unsigned char *rans_compress_O0_32x16_sse4(unsigned char *in,
     while (z-- > 0)
       RansEncPutSymbol(&ransN[z], &ptr, &syms[in[in_size-(i-z)]]);
 
-    uint32_t SB[256], SA[256], SD[256], SC[256];
-
-    // Build lookup tables for SIMD encoding
     uint16_t *ptr16 = (uint16_t *)ptr;
-    for (i = 0; i < 256; i++) {
-        SB[i] = syms[i].x_max;
-        SA[i] = syms[i].rcp_freq;
-        SD[i] = (syms[i].cmpl_freq<<0) | (syms[i].rcp_shift<<16);
-        SC[i] = syms[i].bias;
-    }
 
-    LOAD128v(Rv, ransN);
+    LOAD128(Rv, ransN);
 
-    const __m128i shuf = _mm_set_epi8(0x80, 0x80, 0x80, 0x80,
-                                      0x80, 0x80, 0x80, 0x80,
-                                      0x0d, 0x0c, 0x09, 0x08,
-                                      0x05, 0x04, 0x01, 0x00);
-
-    // FIXME: slower!
-    // q40:  340 (scalar) vs 300 (this)
-    // q4:   430 (scalar) vs 304 (this)
     for (i=(in_size &~(NX-1)); i>0; i-=NX) {
-      uint8_t *c = &in[i-NX];
-
-      int h;
-      // Slightly better in 4x8 instead of 2x16 cycles with clang,
-      // but the reverse with gcc.
-      //for (h=24; h >= 0; h -= 8) {
-      for (h=16; h >= 0; h -= 16) {
-        int H = h/4; // rans index
-        uint8_t *C = &in[i-NX+h];
-
-#define SET(i,a) _mm_set_epi32(a[C[i+3]],a[C[i+2]],a[C[i+1]],a[C[i+0]])
-        __m128i xmax8 = SET(12, SB);
-        __m128i xmax7 = SET( 8, SB);
-        __m128i xmax6 = SET( 4, SB);
-        __m128i xmax5 = SET( 0, SB);
-
-        __m128i cv8 = _mm_cmpgt_epi32(Rv[H+3], xmax8);
-        __m128i cv7 = _mm_cmpgt_epi32(Rv[H+2], xmax7);
-        __m128i cv6 = _mm_cmpgt_epi32(Rv[H+1], xmax6);
-        __m128i cv5 = _mm_cmpgt_epi32(Rv[H+0], xmax5);
-
-        // Store bottom 16-bits at ptr16
-        unsigned int imask8 = _mm_movemask_ps((__m128)cv8);
-        unsigned int imask7 = _mm_movemask_ps((__m128)cv7);
-        unsigned int imask6 = _mm_movemask_ps((__m128)cv6);
-        unsigned int imask5 = _mm_movemask_ps((__m128)cv5);
-
-#define X(A) 4*A,4*A+1,0x80,0x80
-#define _ 0x80,0x80,0x80,0x80
-        uint8_t permutec[16][16] __attribute__((aligned(16))) = {
-            {  _ ,  _ ,  _ ,  _ },
-            {  _ ,  _ ,  _ ,X(0)},
-            {  _ ,  _ ,  _ ,X(1)},
-            {  _ ,  _ ,X(0),X(1)},
-
-            {  _ ,  _ ,  _ ,X(2)},
-            {  _ ,  _ ,X(0),X(2)},
-            {  _ ,  _ ,X(1),X(2)},
-            {  _ ,X(0),X(1),X(2)},
-
-            {  _ ,  _ ,  _ ,X(3)},
-            {  _ ,  _ ,X(0),X(3)},
-            {  _ ,  _ ,X(1),X(3)},
-            {  _ ,X(0),X(1),X(3)},
-
-            {  _ ,  _ ,X(2),X(3)},
-            {  _ ,X(0),X(2),X(3)},
-            {  _ ,X(1),X(2),X(3)},
-            {X(0),X(1),X(2),X(3)},
-        };
-#undef X
-#undef _
-
-        __m128i idx8 = _mm_load_si128((__m128i *)permutec[imask8]);
-        __m128i idx7 = _mm_load_si128((__m128i *)permutec[imask7]);
-        __m128i idx6 = _mm_load_si128((__m128i *)permutec[imask6]);
-        __m128i idx5 = _mm_load_si128((__m128i *)permutec[imask5]);
-
-        // Permute; to gather together the rans states that need flushing
-        __m128i V1, V2, V3, V4, V5, V6, V7, V8;
-        V8 = _mm_shuffle_epi8(_mm_and_si128(Rv[H+3], cv8), idx8);
-        V7 = _mm_shuffle_epi8(_mm_and_si128(Rv[H+2], cv7), idx7);
-        V6 = _mm_shuffle_epi8(_mm_and_si128(Rv[H+1], cv6), idx6);
-        V5 = _mm_shuffle_epi8(_mm_and_si128(Rv[H+0], cv5), idx5);
-
-        // Shuffle alternating shorts together to collect low 16-bit
-        // elements together.  ... 9 8 5 4 1 0.
-        // Or as with avx2 code use packus instead.
-        V8 = _mm_shuffle_epi8(V8, shuf);
-        V7 = _mm_shuffle_epi8(V7, shuf);
-        V6 = _mm_shuffle_epi8(V6, shuf);
-        V5 = _mm_shuffle_epi8(V5, shuf);
-
-        _mm_storeu_si64(ptr16-4, V8); ptr16 -= _mm_popcnt_u32(imask8);
-        _mm_storeu_si64(ptr16-4, V7); ptr16 -= _mm_popcnt_u32(imask7);
-        _mm_storeu_si64(ptr16-4, V6); ptr16 -= _mm_popcnt_u32(imask6);
-        _mm_storeu_si64(ptr16-4, V5); ptr16 -= _mm_popcnt_u32(imask5);
-
-        Rv[H+3] = _mm_blendv_epi8(Rv[H+3], _mm_srli_epi32(Rv[H+3], 16), cv8);
-        Rv[H+2] = _mm_blendv_epi8(Rv[H+2], _mm_srli_epi32(Rv[H+2], 16), cv7);
-        Rv[H+1] = _mm_blendv_epi8(Rv[H+1], _mm_srli_epi32(Rv[H+1], 16), cv6);
-        Rv[H+0] = _mm_blendv_epi8(Rv[H+0], _mm_srli_epi32(Rv[H+0], 16), cv5);
-
-        // Cannot trivially replace the multiply as mulhi_epu32 doesn't
-        // exist (only mullo).
-        // However we can use _mm_mul_epu32 twice to get 64bit results
-        // (h our lanes) and shift/or to get the answer.
-        //
-        // (AVX512 allows us to hold it all in 64-bit lanes and use mullo_epi64
-        // plus a shift.  KNC has mulhi_epi32, but not sure if this is
-        // available.)
-        __m128i rfv8 = SET(12, SA);
-        __m128i rfv7 = SET( 8, SA);
-        __m128i rfv6 = SET( 4, SA);
-        __m128i rfv5 = SET( 0, SA);
-
-        rfv8 = _mm_mulhi_epu32(Rv[H+3], rfv8);
-        rfv7 = _mm_mulhi_epu32(Rv[H+2], rfv7);
-        rfv6 = _mm_mulhi_epu32(Rv[H+1], rfv6);
-        rfv5 = _mm_mulhi_epu32(Rv[H+0], rfv5);
-
-        __m128i SDv8 = SET(12, SD);
-        __m128i SDv7 = SET( 8, SD);
-        __m128i SDv6 = SET( 4, SD);
-        __m128i SDv5 = SET( 0, SD);
-
-        __m128i shiftv8 = _mm_srli_epi32(SDv8, 16);
-        __m128i shiftv7 = _mm_srli_epi32(SDv7, 16);
-        __m128i shiftv6 = _mm_srli_epi32(SDv6, 16);
-        __m128i shiftv5 = _mm_srli_epi32(SDv5, 16);
-
-        __m128i freqv8 = _mm_and_si128(SDv8, _mm_set1_epi32(0xffff));
-        __m128i freqv7 = _mm_and_si128(SDv7, _mm_set1_epi32(0xffff));
-        __m128i freqv6 = _mm_and_si128(SDv6, _mm_set1_epi32(0xffff));
-        __m128i freqv5 = _mm_and_si128(SDv5, _mm_set1_epi32(0xffff));
-
-        // Bake this into the tabel to start with?
-        shiftv8 = _mm_sub_epi32(shiftv8, _mm_set1_epi32(32));
-        shiftv7 = _mm_sub_epi32(shiftv7, _mm_set1_epi32(32));
-        shiftv6 = _mm_sub_epi32(shiftv6, _mm_set1_epi32(32));
-        shiftv5 = _mm_sub_epi32(shiftv5, _mm_set1_epi32(32));
-
-        // No way to shift by varying amounts.  Store, shift, load? Simulated
-        __m128i qv8 = _mm_srlv_epi32x(rfv8, shiftv8);
-        __m128i qv7 = _mm_srlv_epi32x(rfv7, shiftv7);
-        __m128i qv6 = _mm_srlv_epi32x(rfv6, shiftv6);
-        __m128i qv5 = _mm_srlv_epi32x(rfv5, shiftv5);
-
-        qv8 = _mm_mullo_epi32(qv8, freqv8);
-        qv7 = _mm_mullo_epi32(qv7, freqv7);
-        qv6 = _mm_mullo_epi32(qv6, freqv6);
-        qv5 = _mm_mullo_epi32(qv5, freqv5);
-
-        qv8 = _mm_add_epi32(qv8, SET(12, SC));
-        qv7 = _mm_add_epi32(qv7, SET( 8, SC));
-        qv6 = _mm_add_epi32(qv6, SET( 4, SC));
-        qv5 = _mm_add_epi32(qv5, SET( 0, SC));
-
-        Rv[H+3] = _mm_add_epi32(Rv[H+3], qv8);
-        Rv[H+2] = _mm_add_epi32(Rv[H+2], qv7);
-        Rv[H+1] = _mm_add_epi32(Rv[H+1], qv6);
-        Rv[H+0] = _mm_add_epi32(Rv[H+0], qv5);
-      }
+        uint8_t *c = &in[i-NX];
+
+#define ENC4(R,k) R = rans_enc4_sse4(R, &ptr16, &syms[c[k+0]], &syms[c[k+1]], \
+                                     &syms[c[k+2]], &syms[c[k+3]])
+        ENC4(Rv8, 28);
+        ENC4(Rv7, 24);
+        ENC4(Rv6, 20);
+        ENC4(Rv5, 16);
+        ENC4(Rv4, 12);
+        ENC4(Rv3,  8);
+        ENC4(Rv2,  4);
+        ENC4(Rv1,  0);
+#undef ENC4
     }
 
-    STORE128v(Rv, ransN);
+    STORE128(Rv, ransN);
 
     ptr = (uint8_t *)ptr16;
-
     for (z = NX-1; z >= 0; z--)
       RansEncFlush(&ransN[z], &ptr);
 
@@ -450,17 +299,113 @@ unsigned char *rans_compress_O0_32x16_sse4(unsigned char *in,
     // Finalise block size and return it
     *out_size = (out_end - ptr) + tab_size;
 
-//    cp = out;
-//    *cp++ = (in_size>> 0) & 0xff;
-//    *cp++ = (in_size>> 8) & 0xff;
-//    *cp++ = (in_size>>16) & 0xff;
-//    *cp++ = (in_size>>24) & 0xff;
+    memmove(out + tab_size, ptr, out_end-ptr);
+
+    return out;
+}
+
+unsigned char *rans_compress_O1_32x16_sse4(unsigned char *in,
+                                           unsigned int in_size,
+                                           unsigned char *out,
+                                           unsigned int *out_size) {
+    unsigned char *cp, *out_end, *out_free = NULL;
+    unsigned int tab_size;
+    int bound = rans_compress_bound_4x16(in_size,1)-20, z;
+    RansState ransN[NX] __attribute__((aligned(16)));
+
+    if (in_size < NX) // force O0 instead
+        return NULL;
+
+    if (!out) {
+        *out_size = bound;
+        out_free = out = malloc(*out_size);
+    }
+    if (!out || bound > *out_size)
+        return NULL;
+
+    if (((size_t)out)&1)
+        bound--;
+    out_end = out + bound;
+
+    RansEncSymbol (*syms)[256] = htscodecs_tls_alloc(256 * (sizeof(*syms)));
+    if (!syms) {
+        free(out_free);
+        return NULL;
+    }
+
+    cp = out;
+    int shift = encode_freq1(in, in_size, 32, syms, &cp);
+    if (shift < 0) {
+        free(out_free);
+        htscodecs_tls_free(syms);
+        return NULL;
+    }
+    tab_size = cp - out;
+
+    for (z = 0; z < NX; z++)
+      RansEncInit(&ransN[z]);
+
+    uint8_t* ptr = out_end;
+
+    int iN[NX], isz4 = in_size/NX, i;
+    for (z = 0; z < NX; z++)
+        iN[z] = (z+1)*isz4-2;
+
+    unsigned char lN[NX];
+    for (z = 0; z < NX; z++)
+        lN[z] = in[iN[z]+1];
+
+    // Deal with the remainder
+    z = NX-1;
+    lN[z] = in[in_size-1];
+    for (iN[z] = in_size-2; iN[z] > NX*isz4-2; iN[z]--) {
+        unsigned char c = in[iN[z]];
+        RansEncPutSymbol(&ransN[z], &ptr, &syms[c][lN[z]]);
+        lN[z] = c;
+    }
+
+    // All lanes are now in step, with lane z at in[z*isz4 + i], and the
+    // previous symbol (the context) one beyond that.
+    uint16_t *ptr16 = (uint16_t *)ptr;
+
+    LOAD128(Rv, ransN);
+
+    for (i = isz4-2; i >= 0; i--) {
+        uint8_t *c = &in[i];
+
+#define S(k) &syms[c[(k)*isz4]][c[(k)*isz4+1]]
+#define ENC4(R,k) R = rans_enc4_sse4(R, &ptr16, S(k+0), S(k+1), S(k+2), S(k+3))
+        ENC4(Rv8, 28);
+        ENC4(Rv7, 24);
+        ENC4(Rv6, 20);
+        ENC4(Rv5, 16);
+        ENC4(Rv4, 12);
+        ENC4(Rv3,  8);
+        ENC4(Rv2,  4);
+        ENC4(Rv1,  0);
+#undef ENC4
+#undef S
+    }
+
+    STORE128(Rv, ransN);
+
+    ptr = (uint8_t *)ptr16;
+    for (z = 0; z < NX; z++)
+        lN[z] = in[z*isz4];
+
+    for (z = NX-1; z>=0; z--)
+        RansEncPutSymbol(&ransN[z], &ptr, &syms[0][lN[z]]);
+
+    for (z = NX-1; z>=0; z--)
+        RansEncFlush(&ransN[z], &ptr);
+
+    *out_size = (out_end - ptr) + tab_size;
 
     memmove(out + tab_size, ptr, out_end-ptr);
 
+    htscodecs_tls_free(syms);
     return out;
 }
-#endif // disable SSE4 encoder
 
 unsigned char *rans_uncompress_O0_32x16_sse4(unsigned char *in,
                                              unsigned int in_size,
@@ -34,6 +34,9 @@
 #ifndef RANS_STATIC4x16_H
 #define RANS_STATIC4x16_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -44,13 +47,187 @@ unsigned char *rans_compress_to_4x16(unsigned char *in,  unsigned int in_size,
                                      int order);
 unsigned char *rans_compress_4x16(unsigned char *in, unsigned int in_size,
                                   unsigned int *out_size, int order);
+
+/*
+ * As rans_compress_to_4x16, but using up to nthreads threads for the
+ * RANS_ORDER_STRIPE sub-stream trial compressions.  The output is byte
+ * identical to the single threaded function.
+ */
+unsigned char *rans_compress_to_4x16_mt(unsigned char *in,
+                                        unsigned int in_size,
+                                        unsigned char *out,
+                                        unsigned int *out_size,
+                                        int order, int nthreads);
 unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
                                        unsigned char *out, unsigned int *out_size);
 unsigned char *rans_uncompress_4x16(unsigned char *in, unsigned int in_size,
                                     unsigned int *out_size);
 
+/*
+ * As rans_uncompress_to_4x16, but decoding the independent
+ * RANS_ORDER_STRIPE sub-streams on up to nthreads threads.
+ */
+unsigned char *rans_uncompress_to_4x16_mt(unsigned char *in,
+                                          unsigned int in_size,
+                                          unsigned char *out,
+                                          unsigned int *out_size,
+                                          int nthreads);
+
+/*
+ * 64-bit size variants for inputs beyond the INT_MAX limit of the
+ * functions above.  The input is split into independently coded segments
+ * of seg_size bytes (0 for the default of 256MB, at most 1GB), which are
+ * encoded and decoded using up to nthreads threads.  This is a separate
+ * container format; it is not readable by rans_uncompress_to_4x16.
+ *
+ * With out == NULL the output is allocated, otherwise *out_size holds the
+ * size of out on input.  *out_size is set to the used size on success.
+ * Returns out on success, NULL on failure.
+ */
+uint64_t rans_compress_bound_4x16_64(uint64_t size, int order,
+                                     uint32_t seg_size);
+unsigned char *rans_compress_to_4x16_64(unsigned char *in, uint64_t in_size,
+                                        unsigned char *out,
+                                        uint64_t *out_size, int order,
+                                        uint32_t seg_size, int nthreads);
+unsigned char *rans_uncompress_to_4x16_64(unsigned char *in,
+                                          uint64_t in_size,
+                                          unsigned char *out,
+                                          uint64_t *out_size,
+                                          int nthreads);
+
+/*
+ * Batched compression of many independent buffers, such as the data
+ * series of a CRAM slice.  Each job gives an input buffer and order.
+ * The jobs are compressed using up to nthreads threads, with scratch
+ * memory shared between consecutive jobs on each thread, into the
+ * caller supplied arena of *arena_size bytes.  This must be at least
+ * rans_compress_batch_bound_4x16 bytes.
+ *
+ * On return each job's out and out_size describe its compressed data,
+ * identical to that from rans_compress_to_4x16.  These are packed in job
+ * order at the start of the arena, and *arena_size is set to their
+ * total size.  Returns 0 on success, -1 if any job failed.
+ */
+typedef struct {
+    unsigned char *in;
+    unsigned int in_size;
+    int order;
+    unsigned char *out;      // set on return, pointing into the arena
+    unsigned int out_size;   // set on return
+} rans_batch_job;
+
+size_t rans_compress_batch_bound_4x16(rans_batch_job *jobs, int njobs);
+int rans_compress_batch_4x16(rans_batch_job *jobs, int njobs,
+                             unsigned char *arena, size_t *arena_size,
+                             int nthreads);
+
+/*
+ * A reusable context holding scratch memory for the encoder and decoder.
+ *
+ * The _ctx functions are otherwise identical to rans_compress_to_4x16
+ * and rans_uncompress_to_4x16, but retain their temporary buffers within
+ * ctx between calls instead of allocating and freeing them every time.
+ * This is beneficial when compressing many small blocks.
+ *
+ * A context may be reused for any number of calls, but must not be used
+ * by more than one thread at a time.
+ */
+typedef struct rans_ctx rans_ctx;
+
+rans_ctx *rans_ctx_create(void);
+void rans_ctx_destroy(rans_ctx *ctx);
+
+unsigned char *rans_compress_to_4x16_ctx(rans_ctx *ctx,
+                                         unsigned char *in,
+                                         unsigned int in_size,
+                                         unsigned char *out,
+                                         unsigned int *out_size,
+                                         int order);
+unsigned char *rans_uncompress_to_4x16_ctx(rans_ctx *ctx,
+                                           unsigned char *in,
+                                           unsigned int in_size,
+                                           unsigned char *out,
+                                           unsigned int *out_size);
+
+/*
+ * As above, but STRIPE sub-streams are coded using up to nthreads
+ * threads as with the _mt functions.  Each thread works with a private
+ * copy of ctx's CPU selection and shared models, so only the scratch
+ * memory of the calling thread is retained in ctx.
+ */
+unsigned char *rans_compress_to_4x16_ctx_mt(rans_ctx *ctx,
+                                            unsigned char *in,
+                                            unsigned int in_size,
+                                            unsigned char *out,
+                                            unsigned int *out_size,
+                                            int order, int nthreads);
+unsigned char *rans_uncompress_to_4x16_ctx_mt(rans_ctx *ctx,
+                                              unsigned char *in,
+                                              unsigned int in_size,
+                                              unsigned char *out,
+                                              unsigned int *out_size,
+                                              int nthreads);
+
+/*
+ * Shared static models.
+ *
+ * Registers a fixed order-0 or order-1 frequency model with ctx under
+ * model number "id" (0 to 255), replacing any existing model of that id.
+ * For order-0 F holds 256 symbol counts.  For order-1 F holds 256*256
+ * counts indexed as F[context*256 + symbol]; note the first symbol of
+ * each of the four interleaved streams is coded in context 0.  Counts
+ * need not be normalised, as this is done here once only.
+ *
+ * rans_ctx_use_model selects the model to be used by subsequent
+ * rans_compress_to_4x16_ctx calls of the same order, or disables model
+ * use if id is -1.  Such blocks reference the model by number instead of
+ * storing their own frequency table, so the decoding context must have
+ * the identical model registered.  Blocks containing symbols (or
+ * symbol pairs) absent from the model silently fall back to the normal
+ * per-block frequency tables.
+ *
+ * Both return 0 on success, -1 on failure.
+ */
+int rans_ctx_add_model(rans_ctx *ctx, int id, int order, uint32_t *F);
+int rans_ctx_use_model(rans_ctx *ctx, int id);
+
+/*
+ * Incremental decoding, yielding the uncompressed block in caller sized
+ * chunks.
+ *
+ * rans_dec_stream_init parses the header of the compressed block in[],
+ * which must remain valid until rans_dec_stream_destroy is called.
+ * out_size is only used for blocks without a stored size
+ * (RANS_ORDER_NOSZ); otherwise pass 0.  Returns NULL on failure.
+ *
+ * rans_dec_stream_size returns the total uncompressed size.
+ *
+ * rans_dec_stream_read decodes up to len further bytes into out and
+ * returns the number of bytes written, 0 once the block is exhausted or
+ * -1 on error.  Reads may be of any size, and decoding may be paused
+ * between reads indefinitely.
+ *
+ * Order-0 data, optionally with RANS_ORDER_PACK or RANS_ORDER_CAT, is
+ * decoded on demand in fixed memory.  Other formats (order-1, RLE,
+ * STRIPE and 64-way) have no sequential decode order, so these are fully
+ * decoded by rans_dec_stream_init into an internal buffer and returned
+ * from there.
+ * Blocks using shared models are not supported.
+ */
+typedef struct rans_dec_stream rans_dec_stream;
+
+rans_dec_stream *rans_dec_stream_init(unsigned char *in, unsigned int in_size,
+                                      unsigned int out_size);
+unsigned int rans_dec_stream_size(rans_dec_stream *s);
+int rans_dec_stream_read(rans_dec_stream *s, unsigned char *out,
+                         unsigned int len);
+void rans_dec_stream_destroy(rans_dec_stream *s);
+
 // CPU detection control.  Used for testing and benchmarking.
 // These bitfields control what methods are permitted to be used.
+// On x86 a mask with no RANS_CPU_DEC_* bits applies its RANS_CPU_ENC_*
+// bits to decoding too, as in earlier releases.
 #define RANS_CPU_ENC_SSE4     (1<<0)
 #define RANS_CPU_ENC_AVX2     (2<<0)
 #define RANS_CPU_ENC_AVX512   (4<<0)
@@ -63,6 +240,42 @@ unsigned char *rans_uncompress_4x16(unsigned char *in, unsigned int in_size,
 
 void rans_set_cpu(int opts);
 
+/*
+ * Per-context CPU control.  Sets the RANS_CPU_* mask used by calls made
+ * with ctx, overriding rans_set_cpu for that context only.  An opts of -1
+ * reverts to the global rans_set_cpu mask.
+ */
+void rans_ctx_set_cpu(rans_ctx *ctx, int opts);
+
+/*
+ * Reports the instruction set of the kernel that would be used to encode
+ * (decode == 0) or decode (decode != 0) a block of the given order with
+ * ctx, which may be NULL to query the global mask.  This is the single
+ * RANS_CPU_ENC_* or RANS_CPU_DEC_* bit in use, or 0 for scalar code.
+ *
+ * For encoding with RANS_ORDER_SIMD_AUTO this assumes a block large
+ * enough to use SIMD.
+ */
+int rans_cpu_kernel(rans_ctx *ctx, int order, int decode);
+
+/*
+ * Benchmarks the available 32-way kernels on synthetic data and uses the
+ * fastest for each of order-0 and order-1 encoding and decoding, in place
+ * of the built in per-vendor defaults.  It also measures the block size
+ * at which the 32-way codec overtakes the 4-way one, which is then used
+ * as the RANS_ORDER_SIMD_AUTO threshold (or the default, if it never does
+ * in the sizes tried).  The RANS_CPU_* masks still apply on top of the
+ * tuned choices.
+ *
+ * This takes a fraction of a second and should be called before any
+ * other threads use the rANS codecs.  Alternatively setting the
+ * HTSCODECS_AUTOTUNE environment variable to 1 runs it automatically on
+ * first use.
+ *
+ * Returns 0 on success, -1 on failure (leaving the defaults in place).
+ */
+int rans_autotune(void);
+
 // "Order" byte options. ORed into the order byte.
 // The bottom bits are the order itself, currently
 // supporting order-0 and order-1 but with expansion room
@@ -102,6 +315,25 @@ void rans_set_cpu(int opts);
 // Used to request automatic selection between 4-way and 32-way
 #define RANS_ORDER_SIMD_AUTO  (1<<17)
 
+// Used to choose the STRIPE sub-stream methods from a cost estimate
+// instead of trial compressing with every method.  The best K (1 to 3)
+// estimated methods are still trial compressed; K of 0 is treated as 1.
+#define RANS_ORDER_STRIPE_EST (1<<18)
+#define RANS_ORDER_STRIPE_EST_K(K) (RANS_ORDER_STRIPE_EST | (((K)&3)<<19))
+
+// Order-2 model.  This is stored as order-1, so the order byte has bit 0
+// set, with an extension header before the frequency table.  Older
+// versions of the library see this as an empty compressed table and
+// fail.  Only the most useful order-2 contexts are kept, sharing the
+// order-1 context otherwise.  4-way, or 32-way with RANS_ORDER_X32 or X64.
+#define RANS_ORDER_O2 (1<<21)
+
+// 64-way unrolling instead of 4-way, for AVX512.  This is stored as
+// order-1 and X32, with an extension header in place of the frequency
+// table followed by the real order.  Older versions of the library see
+// this as an empty compressed table and fail.
+#define RANS_ORDER_X64 (RANS_ORDER_X32 | (1<<22))
+
 #ifdef __cplusplus
 }
 #endif
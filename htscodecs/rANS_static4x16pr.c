@@ -64,6 +64,7 @@
 #include "rANS_word.h"
 #include "rANS_static4x16.h"
 #include "rANS_static16_int.h"
+#include "rANS_static32x16pr.h"
 #include "pack.h"
 #include "rle.h"
 #include "utils.h"
@@ -94,17 +95,87 @@ unsigned int rans_compress_bound_4x16(unsigned int size, int order) {
     int N = (order>>8) & 0xff;
     if (!N) N=4;
 
+    // Order-2 adds up to 256 more order-1 style contexts
+    int o2 = order & RANS_ORDER_O2;
+    int x64 = (order & RANS_ORDER_X64) == RANS_ORDER_X64;
     order &= 0xff;
+    if (o2) order |= 1;
     unsigned int sz = (order == 0
         ? 1.05*size + 257*3 + 4
         : 1.05*size + 257*257*3 + 4 + 257*3+4) +
         ((order & RANS_ORDER_PACK) ? 1 : 0) +
         ((order & RANS_ORDER_RLE) ? 1 + 257*3+4: 0) + 20 +
-        ((order & RANS_ORDER_X32) ? (32-4)*4 : 0) +
-        ((order & RANS_ORDER_STRIPE) ? 7 + 5*N: 0);
+        (x64 ? (64-4)*4 + 2 + O1_FREQ_EXT_LEN
+             : (order & RANS_ORDER_X32) ? (32-4)*4 : 0) +
+        ((order & RANS_ORDER_STRIPE) ? 7 + 5*N: 0) +
+        (o2 ? 256*(257*3+2) + 5 + O1_FREQ_EXT_LEN : 0);
     return sz + (sz&1) + 2; // make this even so buffers are word aligned
 }
 
+// Encodes in[] backwards from ptr with a static order-0 model, returning
+// the new start of the encoded data.
+static inline
+uint8_t *rans_compress_O0_4x16_syms(unsigned char *in, unsigned int in_size,
+                                    RansEncSymbol syms[256], uint8_t *ptr) {
+    RansState rans0;
+    RansState rans2;
+    RansState rans1;
+    RansState rans3;
+    int i;
+
+    RansEncInit(&rans0);
+    RansEncInit(&rans1);
+    RansEncInit(&rans2);
+    RansEncInit(&rans3);
+
+    switch (i=(in_size&3)) {
+    case 3: RansEncPutSymbol(&rans2, &ptr, &syms[in[in_size-(i-2)]]);
+    case 2: RansEncPutSymbol(&rans1, &ptr, &syms[in[in_size-(i-1)]]);
+    case 1: RansEncPutSymbol(&rans0, &ptr, &syms[in[in_size-(i-0)]]);
+    case 0:
+        break;
+    }
+    for (i=(in_size &~3); i>0; i-=4) {
+        RansEncSymbol *s3 = &syms[in[i-1]];
+        RansEncSymbol *s2 = &syms[in[i-2]];
+        RansEncSymbol *s1 = &syms[in[i-3]];
+        RansEncSymbol *s0 = &syms[in[i-4]];
+
+#if 1
+        RansEncPutSymbol(&rans3, &ptr, s3);
+        RansEncPutSymbol(&rans2, &ptr, s2);
+        RansEncPutSymbol(&rans1, &ptr, s1);
+        RansEncPutSymbol(&rans0, &ptr, s0);
+#else
+        // Slightly beter on gcc, much better on clang
+        uint16_t *ptr16 = (uint16_t *)ptr;
+
+        if (rans3 >= s3->x_max) *--ptr16 = (uint16_t)rans3, rans3 >>= 16;
+        if (rans2 >= s2->x_max) *--ptr16 = (uint16_t)rans2, rans2 >>= 16;
+        uint32_t q3 = (uint32_t) (((uint64_t)rans3 * s3->rcp_freq) >> s3->rcp_shift);
+        uint32_t q2 = (uint32_t) (((uint64_t)rans2 * s2->rcp_freq) >> s2->rcp_shift);
+        rans3 += s3->bias + q3 * s3->cmpl_freq;
+        rans2 += s2->bias + q2 * s2->cmpl_freq;
+
+        if (rans1 >= s1->x_max) *--ptr16 = (uint16_t)rans1, rans1 >>= 16;
+        if (rans0 >= s0->x_max) *--ptr16 = (uint16_t)rans0, rans0 >>= 16;
+        uint32_t q1 = (uint32_t) (((uint64_t)rans1 * s1->rcp_freq) >> s1->rcp_shift);
+        uint32_t q0 = (uint32_t) (((uint64_t)rans0 * s0->rcp_freq) >> s0->rcp_shift);
+        rans1 += s1->bias + q1 * s1->cmpl_freq;
+        rans0 += s0->bias + q0 * s0->cmpl_freq;
+
+        ptr = (uint8_t *)ptr16;
+#endif
+    }
+
+    RansEncFlush(&rans3, &ptr);
+    RansEncFlush(&rans2, &ptr);
+    RansEncFlush(&rans1, &ptr);
+    RansEncFlush(&rans0, &ptr);
+
+    return ptr;
+}
+
 // Compresses in_size bytes from 'in' to *out_size bytes in 'out'.
 //
 // NB: The output buffer does not hold the original size, so it is up to
@@ -113,13 +184,9 @@ unsigned char *rans_compress_O0_4x16(unsigned char *in, unsigned int in_size,
                                      unsigned char *out, unsigned int *out_size) {
     unsigned char *cp, *out_end;
     RansEncSymbol syms[256];
-    RansState rans0;
-    RansState rans2;
-    RansState rans1;
-    RansState rans3;
     uint8_t* ptr;
     uint32_t F[256+MAGIC] = {0};
-    int i, j, tab_size = 0, rle, x;
+    int j, tab_size = 0, rle, x;
     // -20 for order/size/meta
     uint32_t bound = rans_compress_bound_4x16(in_size,0)-20;
 
@@ -169,67 +236,152 @@ unsigned char *rans_compress_O0_4x16(unsigned char *in, unsigned int in_size,
         }
     }
 
-    RansEncInit(&rans0);
-    RansEncInit(&rans1);
-    RansEncInit(&rans2);
-    RansEncInit(&rans3);
+    ptr = rans_compress_O0_4x16_syms(in, in_size, syms, ptr);
 
-    switch (i=(in_size&3)) {
-    case 3: RansEncPutSymbol(&rans2, &ptr, &syms[in[in_size-(i-2)]]);
-    case 2: RansEncPutSymbol(&rans1, &ptr, &syms[in[in_size-(i-1)]]);
-    case 1: RansEncPutSymbol(&rans0, &ptr, &syms[in[in_size-(i-0)]]);
-    case 0:
-        break;
-    }
-    for (i=(in_size &~3); i>0; i-=4) {
-        RansEncSymbol *s3 = &syms[in[i-1]];
-        RansEncSymbol *s2 = &syms[in[i-2]];
-        RansEncSymbol *s1 = &syms[in[i-3]];
-        RansEncSymbol *s0 = &syms[in[i-4]];
+ empty:
+    // Finalise block size and return it
+    *out_size = (out_end - ptr) + tab_size;
 
-#if 1
-        RansEncPutSymbol(&rans3, &ptr, s3);
-        RansEncPutSymbol(&rans2, &ptr, s2);
-        RansEncPutSymbol(&rans1, &ptr, s1);
-        RansEncPutSymbol(&rans0, &ptr, s0);
-#else
-        // Slightly beter on gcc, much better on clang
-        uint16_t *ptr16 = (uint16_t *)ptr;
+    memmove(out + tab_size, ptr, out_end-ptr);
 
-        if (rans3 >= s3->x_max) *--ptr16 = (uint16_t)rans3, rans3 >>= 16;
-        if (rans2 >= s2->x_max) *--ptr16 = (uint16_t)rans2, rans2 >>= 16;
-        uint32_t q3 = (uint32_t) (((uint64_t)rans3 * s3->rcp_freq) >> s3->rcp_shift);
-        uint32_t q2 = (uint32_t) (((uint64_t)rans2 * s2->rcp_freq) >> s2->rcp_shift);
-        rans3 += s3->bias + q3 * s3->cmpl_freq;
-        rans2 += s2->bias + q2 * s2->cmpl_freq;
+    return out;
+}
 
-        if (rans1 >= s1->x_max) *--ptr16 = (uint16_t)rans1, rans1 >>= 16;
-        if (rans0 >= s0->x_max) *--ptr16 = (uint16_t)rans0, rans0 >>= 16;
-        uint32_t q1 = (uint32_t) (((uint64_t)rans1 * s1->rcp_freq) >> s1->rcp_shift);
-        uint32_t q0 = (uint32_t) (((uint64_t)rans0 * s0->rcp_freq) >> s0->rcp_shift);
-        rans1 += s1->bias + q1 * s1->cmpl_freq;
-        rans0 += s0->bias + q0 * s0->cmpl_freq;
+/*
+ * Fused RANS_ORDER_PACK decoding.
+ *
+ * Rather than decoding to a temporary buffer and running hts_unpack over
+ * it, the 4-way decoders can expand each packed byte as it is decoded.
+ * Byte i of the packed data becomes out[i*nsym] onwards.  Only the final
+ * byte may be partial, so that is expanded into tail[] and copied by
+ * rans_unpack_finish.
+ */
+// This is passed by value to the decode loops so the fields stay in
+// registers rather than being reloaded after every (aliasing) byte store.
+typedef struct {
+    uint64_t *map;      // nsym unpacked symbols per packed byte value
+    uint8_t *tail;      // expansion of a partial final byte
+    unsigned int nfull; // number of packed bytes expanding in full
+} rans_unpack_t;
+
+static void rans_unpack_init(rans_unpack_t *u, uint64_t map[256],
+                             uint8_t tail[8], uint8_t *pmap, int nsym,
+                             unsigned int out_sz) {
+    int x, k, bits = 8/nsym;
+    for (x = 0; x < 256; x++) {
+        uint8_t c[8] = {0};
+        for (k = 0; k < nsym; k++)
+            c[k] = pmap[(x >> (k*bits)) & ((1<<bits)-1)];
+        memcpy(&map[x], c, 8);
+    }
+    u->map = map;
+    u->tail = tail;
+    u->nfull = out_sz / nsym;
+}
 
-        ptr = (uint8_t *)ptr16;
-#endif
+static void rans_unpack_finish(rans_unpack_t *u, uint8_t *out,
+                               unsigned int out_sz, int nsym) {
+    memcpy(out + (size_t)u->nfull*nsym, u->tail, out_sz - u->nfull*nsym);
+}
+
+// Stores decoded symbol c at index i, expanding it if nsym (a constant
+// for the compiler to specialise on) is non-zero.
+static inline void rans_unpack_put(uint8_t *out, unsigned int i, uint8_t c,
+                                   rans_unpack_t u, const int nsym) {
+    if (!nsym) {
+        out[i] = c;
+        return;
     }
+    uint8_t *dst = likely(i < u.nfull) ? out + (size_t)i*nsym : u.tail;
+    memcpy(dst, &u.map[c], nsym);
+}
 
-    RansEncFlush(&rans3, &ptr);
-    RansEncFlush(&rans2, &ptr);
-    RansEncFlush(&rans1, &ptr);
-    RansEncFlush(&rans0, &ptr);
+// Decodes out_sz symbols from cp using order-0 lookup tables.
+// With nsym != 0 these are unpacked via u as they are decoded.
+// Returns 0 on success, -1 on failure.
+static inline
+int rans_uncompress_O0_4x16_tab(unsigned char *cp, unsigned char *cp_end,
+                                unsigned char *out, unsigned int out_sz,
+                                uint8_t *ssym, uint16_t *sfreq,
+                                uint16_t *sbase,
+                                rans_unpack_t u, const int nsym) {
+    int i, j;
 
- empty:
-    // Finalise block size and return it
-    *out_size = (out_end - ptr) + tab_size;
+    if (cp+16 > cp_end+8)
+        return -1;
 
-    memmove(out + tab_size, ptr, out_end-ptr);
+    RansState R[4];
+    RansDecInit(&R[0], &cp); if (R[0] < RANS_BYTE_L) return -1;
+    RansDecInit(&R[1], &cp); if (R[1] < RANS_BYTE_L) return -1;
+    RansDecInit(&R[2], &cp); if (R[2] < RANS_BYTE_L) return -1;
+    RansDecInit(&R[3], &cp); if (R[3] < RANS_BYTE_L) return -1;
 
-    return out;
+// Simple version is comparable to below, but only with -O3
+//
+//    for (i = 0; cp < cp_end-8 && i < (out_sz&~7); i+=8) {
+//        for(j=0; j<8;j++) {
+//          RansState m = RansDecGet(&R[j%4], TF_SHIFT);
+//          R[j%4] = sfreq[m] * (R[j%4] >> TF_SHIFT) + sbase[m];
+//          out[i+j] = ssym[m];
+//          RansDecRenorm(&R[j%4], &cp);
+//        }
+//    }
+
+    for (i = 0; cp < cp_end-8 && i < (out_sz&~7); i+=8) {
+        for (j = 0; j < 8; j+=4) {
+            RansState m0 = RansDecGet(&R[0], TF_SHIFT);
+            RansState m1 = RansDecGet(&R[1], TF_SHIFT);
+            rans_unpack_put(out, i+j+0, ssym[m0], u, nsym);
+            rans_unpack_put(out, i+j+1, ssym[m1], u, nsym);
+
+            R[0] = sfreq[m0] * (R[0] >> TF_SHIFT) + sbase[m0];
+            R[1] = sfreq[m1] * (R[1] >> TF_SHIFT) + sbase[m1];
+
+            RansState m2 = RansDecGet(&R[2], TF_SHIFT);
+            RansState m3 = RansDecGet(&R[3], TF_SHIFT);
+
+            RansDecRenorm(&R[0], &cp);
+            RansDecRenorm(&R[1], &cp);
+
+            R[2] = sfreq[m2] * (R[2] >> TF_SHIFT) + sbase[m2];
+            R[3] = sfreq[m3] * (R[3] >> TF_SHIFT) + sbase[m3];
+
+            RansDecRenorm(&R[2], &cp);
+            RansDecRenorm(&R[3], &cp);
+
+            rans_unpack_put(out, i+j+2, ssym[m2], u, nsym);
+            rans_unpack_put(out, i+j+3, ssym[m3], u, nsym);
+        }
+    }
+
+    // remainder
+    for (; i < out_sz; i++) {
+        RansState m = RansDecGet(&R[i%4], TF_SHIFT);
+        R[i%4] = sfreq[m] * (R[i%4] >> TF_SHIFT) + sbase[m];
+        rans_unpack_put(out, i, ssym[m], u, nsym);
+        RansDecRenormSafe(&R[i%4], &cp, cp_end+8);
+    }
+
+    return 0;
 }
 
-unsigned char *rans_uncompress_O0_4x16(unsigned char *in, unsigned int in_size,
-                                       unsigned char *out, unsigned int out_sz) {
+// Calls func with nsym as a constant: 0 (no unpacking), 2, 4 or 8.
+#define RANS_UNPACK_CALL(nsym, func, ...)       \
+    switch (nsym) {                             \
+    case 2:  func(__VA_ARGS__, 2); break;       \
+    case 4:  func(__VA_ARGS__, 4); break;       \
+    case 8:  func(__VA_ARGS__, 8); break;       \
+    default: func(__VA_ARGS__, 0); break;       \
+    }
+
+// Decodes out_sz symbols, unpacking them on the fly via u if nsym is
+// non-zero.  The unpacked output must already be allocated.
+static
+unsigned char *rans_uncompress_O0_4x16_u(unsigned char *in,
+                                         unsigned int in_size,
+                                         unsigned char *out,
+                                         unsigned int out_sz,
+                                         rans_unpack_t *u, int nsym) {
     if (in_size < 16) // 4-states at least
         return NULL;
 
@@ -244,7 +396,7 @@ unsigned char *rans_uncompress_O0_4x16(unsigned char *in, unsigned int in_size,
     /* Load in the static tables */
     unsigned char *cp = in, *out_free = NULL;
     unsigned char *cp_end = in + in_size - 8; // within 8 => be extra safe
-    int i, j;
+    int j;
     unsigned int x, y;
     uint16_t sfreq[TOTFREQ+32];
     uint16_t sbase[TOTFREQ+32]; // faster to use 32-bit on clang
@@ -281,61 +433,15 @@ unsigned char *rans_uncompress_O0_4x16(unsigned char *in, unsigned int in_size,
     if (x != TOTFREQ)
         goto err;
 
-    if (cp+16 > cp_end+8)
+    int ret = 0;
+    rans_unpack_t uv = {0};
+    if (u)
+        uv = *u;
+    RANS_UNPACK_CALL(nsym, ret = rans_uncompress_O0_4x16_tab,
+                     cp, cp_end, out, out_sz, ssym, sfreq, sbase, uv);
+    if (ret < 0)
         goto err;
 
-    RansState R[4];
-    RansDecInit(&R[0], &cp); if (R[0] < RANS_BYTE_L) goto err;
-    RansDecInit(&R[1], &cp); if (R[1] < RANS_BYTE_L) goto err;
-    RansDecInit(&R[2], &cp); if (R[2] < RANS_BYTE_L) goto err;
-    RansDecInit(&R[3], &cp); if (R[3] < RANS_BYTE_L) goto err;
-
-// Simple version is comparable to below, but only with -O3
-//
-//    for (i = 0; cp < cp_end-8 && i < (out_sz&~7); i+=8) {
-//        for(j=0; j<8;j++) {
-//          RansState m = RansDecGet(&R[j%4], TF_SHIFT);
-//          R[j%4] = sfreq[m] * (R[j%4] >> TF_SHIFT) + sbase[m];
-//          out[i+j] = ssym[m];
-//          RansDecRenorm(&R[j%4], &cp);
-//        }
-//    }
-
-    for (i = 0; cp < cp_end-8 && i < (out_sz&~7); i+=8) {
-        for (j = 0; j < 8; j+=4) {
-            RansState m0 = RansDecGet(&R[0], TF_SHIFT);
-            RansState m1 = RansDecGet(&R[1], TF_SHIFT);
-            out[i+j+0] = ssym[m0];
-            out[i+j+1] = ssym[m1];
-
-            R[0] = sfreq[m0] * (R[0] >> TF_SHIFT) + sbase[m0];
-            R[1] = sfreq[m1] * (R[1] >> TF_SHIFT) + sbase[m1];
-
-            RansState m2 = RansDecGet(&R[2], TF_SHIFT);
-            RansState m3 = RansDecGet(&R[3], TF_SHIFT);
-
-            RansDecRenorm(&R[0], &cp);
-            RansDecRenorm(&R[1], &cp);
-
-            R[2] = sfreq[m2] * (R[2] >> TF_SHIFT) + sbase[m2];
-            R[3] = sfreq[m3] * (R[3] >> TF_SHIFT) + sbase[m3];
-
-            RansDecRenorm(&R[2], &cp);
-            RansDecRenorm(&R[3], &cp);
-
-            out[i+j+2] = ssym[m2];
-            out[i+j+3] = ssym[m3];
-        }
-    }
-
-    // remainder
-    for (; i < out_sz; i++) {
-        RansState m = RansDecGet(&R[i%4], TF_SHIFT);
-        R[i%4] = sfreq[m] * (R[i%4] >> TF_SHIFT) + sbase[m];
-        out[i] = ssym[m];
-        RansDecRenormSafe(&R[i%4], &cp, cp_end+8);
-    }
-
     //fprintf(stderr, "    0 Decoded %d bytes\n", (int)(cp-in)); //c-size
 
     return out;
@@ -345,15 +451,29 @@ unsigned char *rans_uncompress_O0_4x16(unsigned char *in, unsigned int in_size,
     return NULL;
 }
 
+unsigned char *rans_uncompress_O0_4x16(unsigned char *in, unsigned int in_size,
+                                       unsigned char *out, unsigned int out_sz) {
+    return rans_uncompress_O0_4x16_u(in, in_size, out, out_sz, NULL, 0);
+}
+
 //-----------------------------------------------------------------------------
 
 // Compute the entropy of 12-bit vs 10-bit frequency tables.
 // 10 bit means smaller memory footprint when decoding and
 // more speed due to cache hits, but it *may* be a poor
 // compression fit.
+//
+// A[] marks the symbols that may occur in F, so small alphabets don't
+// pay for scanning all 256 entries of every context.
 int rans_compute_shift(uint32_t *F0, uint32_t (*F)[256], uint32_t *T,
-                       uint32_t *S) {
-    int i, j;
+                       uint32_t *A, uint32_t *S) {
+    int i, j, k, nj;
+    uint8_t js[256];
+    uint32_t f[256];
+
+    for (j = nj = 0; j < 256; j++)
+        if (A[j])
+            js[nj++] = j;
 
     double e10 = 0, e12 = 0;
     int max_tot = 0;
@@ -366,11 +486,14 @@ int rans_compute_shift(uint32_t *F0, uint32_t (*F)[256], uint32_t *T,
 
         // Number of samples that get their freq bumped to 1
         int sm10 = 0, sm12 = 0;
-        for (j = 0; j < 256; j++) {
-            if (F[i][j] && max_val / F[i][j] > TOTFREQ_O1_FAST)
+        for (k = 0; k < nj; k++) {
+            if (!(f[ns] = F[i][js[k]]))
+                continue;
+            if (max_val / f[ns] > TOTFREQ_O1_FAST)
                 sm10++;
-            if (F[i][j] && max_val / F[i][j] > TOTFREQ_O1)
+            if (max_val / f[ns] > TOTFREQ_O1)
                 sm12++;
+            ns++;
         }
 
         double l10 = log(TOTFREQ_O1_FAST + sm10);
@@ -378,17 +501,13 @@ int rans_compute_shift(uint32_t *F0, uint32_t (*F)[256], uint32_t *T,
         double T_slow = (double)TOTFREQ_O1/T[i];
         double T_fast = (double)TOTFREQ_O1_FAST/T[i];
 
-        for (j = 0; j < 256; j++) {
-            if (F[i][j]) {
-                ns++;
-
-                e10 -= F[i][j] * (fast_log(MAX(F[i][j]*T_fast,1)) - l10);
-                e12 -= F[i][j] * (fast_log(MAX(F[i][j]*T_slow,1)) - l12);
+        for (k = 0; k < ns; k++) {
+            e10 -= f[k] * (fast_log(MAX(f[k]*T_fast,1)) - l10);
+            e12 -= f[k] * (fast_log(MAX(f[k]*T_slow,1)) - l12);
 
-                // Estimation of compressed symbol freq table too.
-                e10 += 1.3;
-                e12 += 4.7;
-            }
+            // Estimation of compressed symbol freq table too.
+            e10 += 1.3;
+            e12 += 4.7;
         }
 
         // Order-1 frequencies often end up totalling under TOTFREQ.
@@ -416,47 +535,18 @@ int rans_compute_shift(uint32_t *F0, uint32_t (*F)[256], uint32_t *T,
     return shift;
 }
 
-static
-unsigned char *rans_compress_O1_4x16(unsigned char *in, unsigned int in_size,
-                                     unsigned char *out, unsigned int *out_size) {
-    unsigned char *cp, *out_end, *out_free = NULL;
-    unsigned int tab_size;
-    
-    // -20 for order/size/meta
-    uint32_t bound = rans_compress_bound_4x16(in_size,1)-20;
-
-    if (!out) {
-        *out_size = bound;
-        out_free = out = malloc(*out_size);
-    }
-    if (!out || bound > *out_size)
-        return NULL;
+// Encodes in[] backwards from ptr with a static order-1 model, returning
+// the new start of the encoded data.  Requires in_size >= 4.
+static inline
+uint8_t *rans_compress_O1_4x16_syms(unsigned char *in, unsigned int in_size,
+                                    RansEncSymbol (*syms)[256],
+                                    uint8_t *ptr) {
+    RansState rans0, rans1, rans2, rans3;
+    RansEncInit(&rans0);
+    RansEncInit(&rans1);
+    RansEncInit(&rans2);
+    RansEncInit(&rans3);
 
-    if (((size_t)out)&1)
-        bound--;
-    out_end = out + bound;
-
-    RansEncSymbol (*syms)[256] = htscodecs_tls_alloc(256 * (sizeof(*syms)));
-    if (!syms) {
-        free(out_free);
-        return NULL;
-    }
-
-    cp = out;
-    int shift = encode_freq1(in, in_size, 4, syms, &cp); 
-    if (shift < 0) {
-        htscodecs_tls_free(syms);
-        return NULL;
-    }
-    tab_size = cp - out;
-
-    RansState rans0, rans1, rans2, rans3;
-    RansEncInit(&rans0);
-    RansEncInit(&rans1);
-    RansEncInit(&rans2);
-    RansEncInit(&rans3);
-
-    uint8_t* ptr = out_end;
 
     int isz4 = in_size>>2;
     int i0 = 1*isz4-2;
@@ -505,6 +595,45 @@ unsigned char *rans_compress_O1_4x16(unsigned char *in, unsigned int in_size,
     RansEncFlush(&rans1, &ptr);
     RansEncFlush(&rans0, &ptr);
 
+    return ptr;
+}
+
+static
+unsigned char *rans_compress_O1_4x16(unsigned char *in, unsigned int in_size,
+                                     unsigned char *out, unsigned int *out_size) {
+    unsigned char *cp, *out_end, *out_free = NULL;
+    unsigned int tab_size;
+    
+    // -20 for order/size/meta
+    uint32_t bound = rans_compress_bound_4x16(in_size,1)-20;
+
+    if (!out) {
+        *out_size = bound;
+        out_free = out = malloc(*out_size);
+    }
+    if (!out || bound > *out_size)
+        return NULL;
+
+    if (((size_t)out)&1)
+        bound--;
+    out_end = out + bound;
+
+    RansEncSymbol (*syms)[256] = htscodecs_tls_alloc(256 * (sizeof(*syms)));
+    if (!syms) {
+        free(out_free);
+        return NULL;
+    }
+
+    cp = out;
+    int shift = encode_freq1(in, in_size, 4, syms, &cp); 
+    if (shift < 0) {
+        htscodecs_tls_free(syms);
+        return NULL;
+    }
+    tab_size = cp - out;
+
+    uint8_t *ptr = rans_compress_O1_4x16_syms(in, in_size, syms, out_end);
+
     *out_size = (out_end - ptr) + tab_size;
 
     cp = out;
@@ -518,9 +647,138 @@ unsigned char *rans_compress_O1_4x16(unsigned char *in, unsigned int in_size,
 #define MAGIC2 179
 //#define MAGIC2 0
 
+// Decodes out_sz symbols using the sfb[] and fb[] order-1 lookup tables,
+// starting from already initialised states R[].  "shift" and "nsym" are
+// intended to be constants, so the compiler can specialise the loop per
+// shift value and unpacking mode.
+static inline
+void rans_uncompress_O1_4x16_sfb(RansState R[4], uint8_t *ptr,
+                                 uint8_t *ptr_end,
+                                 unsigned char *out, unsigned int out_sz,
+                                 uint8_t **sfb, fb_t (*fb)[256],
+                                 rans_unpack_t u,
+                                 const unsigned int shift, const int nsym) {
+    unsigned int isz4 = out_sz>>2;
+    int l0 = 0, l1 = 0, l2 = 0, l3 = 0;
+    unsigned int i4[] = {0*isz4, 1*isz4, 2*isz4, 3*isz4};
+
+    const uint32_t mask = ((1u << shift)-1);
+    for (; i4[0] < isz4; i4[0]++, i4[1]++, i4[2]++, i4[3]++) {
+        uint16_t m, c;
+        c = sfb[l0][m = R[0] & mask];
+        R[0] = fb[l0][c].f * (R[0]>>shift) + m - fb[l0][c].b;
+        rans_unpack_put(out, i4[0], l0 = c, u, nsym);
+
+        c = sfb[l1][m = R[1] & mask];
+        R[1] = fb[l1][c].f * (R[1]>>shift) + m - fb[l1][c].b;
+        rans_unpack_put(out, i4[1], l1 = c, u, nsym);
+
+        c = sfb[l2][m = R[2] & mask];
+        R[2] = fb[l2][c].f * (R[2]>>shift) + m - fb[l2][c].b;
+        rans_unpack_put(out, i4[2], l2 = c, u, nsym);
+
+        c = sfb[l3][m = R[3] & mask];
+        R[3] = fb[l3][c].f * (R[3]>>shift) + m - fb[l3][c].b;
+        rans_unpack_put(out, i4[3], l3 = c, u, nsym);
+
+        if (ptr < ptr_end) {
+            RansDecRenorm(&R[0], &ptr);
+            RansDecRenorm(&R[1], &ptr);
+            RansDecRenorm(&R[2], &ptr);
+            RansDecRenorm(&R[3], &ptr);
+        } else {
+            RansDecRenormSafe(&R[0], &ptr, ptr_end+8);
+            RansDecRenormSafe(&R[1], &ptr, ptr_end+8);
+            RansDecRenormSafe(&R[2], &ptr, ptr_end+8);
+            RansDecRenormSafe(&R[3], &ptr, ptr_end+8);
+        }
+    }
+
+    // Remainder
+    for (; i4[3] < out_sz; i4[3]++) {
+        uint32_t m3 = R[3] & mask;
+        unsigned char c3 = sfb[l3][m3];
+        rans_unpack_put(out, i4[3], c3, u, nsym);
+        R[3] = fb[l3][c3].f * (R[3]>>shift) + m3 - fb[l3][c3].b;
+        RansDecRenormSafe(&R[3], &ptr, ptr_end + 8);
+        l3 = c3;
+    }
+}
+
+// As rans_uncompress_O1_4x16_sfb, but using the combined s3[] lookup
+// table of TF_SHIFT_O1_FAST frequency, bias and symbol.
+static inline
+void rans_uncompress_O1_4x16_s3(RansState R[4], uint8_t *ptr,
+                                uint8_t *ptr_end,
+                                unsigned char *out, unsigned int out_sz,
+                                uint32_t (*s3)[TOTFREQ_O1_FAST],
+                                rans_unpack_t u, const int nsym) {
+    unsigned int isz4 = out_sz>>2;
+    int l0 = 0, l1 = 0, l2 = 0, l3 = 0;
+    unsigned int i4[] = {0*isz4, 1*isz4, 2*isz4, 3*isz4};
+
+    const uint32_t mask = ((1u << TF_SHIFT_O1_FAST)-1);
+    for (; i4[0] < isz4; i4[0]++, i4[1]++, i4[2]++, i4[3]++) {
+        uint32_t S0 = s3[l0][R[0] & mask];
+        uint32_t S1 = s3[l1][R[1] & mask];
+        l0 = (uint8_t)S0;
+        l1 = (uint8_t)S1;
+        rans_unpack_put(out, i4[0], l0, u, nsym);
+        rans_unpack_put(out, i4[1], l1, u, nsym);
+        uint16_t F0 = S0>>(TF_SHIFT_O1_FAST+8);
+        uint16_t F1 = S1>>(TF_SHIFT_O1_FAST+8);
+        uint16_t B0 = (S0>>8) & mask;
+        uint16_t B1 = (S1>>8) & mask;
+
+        R[0] = F0 * (R[0]>>TF_SHIFT_O1_FAST) + B0;
+        R[1] = F1 * (R[1]>>TF_SHIFT_O1_FAST) + B1;
+
+        uint32_t S2 = s3[l2][R[2] & mask];
+        uint32_t S3 = s3[l3][R[3] & mask];
+        l2 = (uint8_t)S2;
+        l3 = (uint8_t)S3;
+        rans_unpack_put(out, i4[2], l2, u, nsym);
+        rans_unpack_put(out, i4[3], l3, u, nsym);
+        uint16_t F2 = S2>>(TF_SHIFT_O1_FAST+8);
+        uint16_t F3 = S3>>(TF_SHIFT_O1_FAST+8);
+        uint16_t B2 = (S2>>8) & mask;
+        uint16_t B3 = (S3>>8) & mask;
+
+        R[2] = F2 * (R[2]>>TF_SHIFT_O1_FAST) + B2;
+        R[3] = F3 * (R[3]>>TF_SHIFT_O1_FAST) + B3;
+
+        if (ptr < ptr_end) {
+            RansDecRenorm(&R[0], &ptr);
+            RansDecRenorm(&R[1], &ptr);
+            RansDecRenorm(&R[2], &ptr);
+            RansDecRenorm(&R[3], &ptr);
+        } else {
+            RansDecRenormSafe(&R[0], &ptr, ptr_end+8);
+            RansDecRenormSafe(&R[1], &ptr, ptr_end+8);
+            RansDecRenormSafe(&R[2], &ptr, ptr_end+8);
+            RansDecRenormSafe(&R[3], &ptr, ptr_end+8);
+        }
+    }
+
+    // Remainder
+    for (; i4[3] < out_sz; i4[3]++) {
+        uint32_t S = s3[l3][R[3] & ((1u<<TF_SHIFT_O1_FAST)-1)];
+        l3 = (uint8_t)S;
+        rans_unpack_put(out, i4[3], l3, u, nsym);
+        R[3] = (S>>(TF_SHIFT_O1_FAST+8)) * (R[3]>>TF_SHIFT_O1_FAST)
+            + ((S>>8) & ((1u<<TF_SHIFT_O1_FAST)-1));
+        RansDecRenormSafe(&R[3], &ptr, ptr_end + 8);
+    }
+}
+
+// Decodes out_sz symbols, unpacking them on the fly via u if nsym is
+// non-zero.
 static
-unsigned char *rans_uncompress_O1_4x16(unsigned char *in, unsigned int in_size,
-                                       unsigned char *out, unsigned int out_sz) {
+unsigned char *rans_uncompress_O1_4x16_u(unsigned char *in,
+                                         unsigned int in_size,
+                                         unsigned char *out,
+                                         unsigned int out_sz,
+                                         rans_unpack_t *u, int nsym) {
     if (in_size < 16) // 4-states at least
         return NULL;
 
@@ -649,9 +907,9 @@ unsigned char *rans_uncompress_O1_4x16(unsigned char *in, unsigned int in_size,
     RansDecInit(&rans2, &ptr); if (rans2 < RANS_BYTE_L) goto err;
     RansDecInit(&rans3, &ptr); if (rans3 < RANS_BYTE_L) goto err;
 
-    unsigned int isz4 = out_sz>>2;
-    int l0 = 0, l1 = 0, l2 = 0, l3 = 0;
-    unsigned int i4[] = {0*isz4, 1*isz4, 2*isz4, 3*isz4};
+    rans_unpack_t uv = {0};
+    if (u)
+        uv = *u;
 
     RansState R[4];
     R[0] = rans0;
@@ -663,144 +921,22 @@ unsigned char *rans_uncompress_O1_4x16(unsigned char *in, unsigned int in_size,
     // loop with shift as a variable.
     if (shift == TF_SHIFT_O1) {
         // TF_SHIFT_O1 = 12
-
-        const uint32_t mask = ((1u << TF_SHIFT_O1)-1);
-        for (; i4[0] < isz4; i4[0]++, i4[1]++, i4[2]++, i4[3]++) {
-            uint16_t m, c;
-            c = sfb[l0][m = R[0] & mask];
-            R[0] = fb[l0][c].f * (R[0]>>TF_SHIFT_O1) + m - fb[l0][c].b;
-            out[i4[0]] = l0 = c;
-
-            c = sfb[l1][m = R[1] & mask];
-            R[1] = fb[l1][c].f * (R[1]>>TF_SHIFT_O1) + m - fb[l1][c].b;
-            out[i4[1]] = l1 = c;
-
-            c = sfb[l2][m = R[2] & mask];
-            R[2] = fb[l2][c].f * (R[2]>>TF_SHIFT_O1) + m - fb[l2][c].b;
-            out[i4[2]] = l2 = c;
-
-            c = sfb[l3][m = R[3] & mask];
-            R[3] = fb[l3][c].f * (R[3]>>TF_SHIFT_O1) + m - fb[l3][c].b;
-            out[i4[3]] = l3 = c;
-
-            if (ptr < ptr_end) {
-                RansDecRenorm(&R[0], &ptr);
-                RansDecRenorm(&R[1], &ptr);
-                RansDecRenorm(&R[2], &ptr);
-                RansDecRenorm(&R[3], &ptr);
-            } else {
-                RansDecRenormSafe(&R[0], &ptr, ptr_end+8);
-                RansDecRenormSafe(&R[1], &ptr, ptr_end+8);
-                RansDecRenormSafe(&R[2], &ptr, ptr_end+8);
-                RansDecRenormSafe(&R[3], &ptr, ptr_end+8);
-            }
-        }
-
-        // Remainder
-        for (; i4[3] < out_sz; i4[3]++) {
-            uint32_t m3 = R[3] & ((1u<<TF_SHIFT_O1)-1);
-            unsigned char c3 = sfb[l3][m3];
-            out[i4[3]] = c3;
-            R[3] = fb[l3][c3].f * (R[3]>>TF_SHIFT_O1) + m3 - fb[l3][c3].b;
-            RansDecRenormSafe(&R[3], &ptr, ptr_end + 8);
-            l3 = c3;
-        }
+        RANS_UNPACK_CALL(nsym, rans_uncompress_O1_4x16_sfb,
+                         R, ptr, ptr_end, out, out_sz, sfb, fb, uv,
+                         TF_SHIFT_O1);
     } else if (!s3_fast_on) {
         // TF_SHIFT_O1 = 10 with sfb[256][1024] & fb[256]256] array lookup
         // Slightly faster for -o193 on q4 (high comp), but also less
         // initialisation cost for smaller data
-        const uint32_t mask = ((1u << TF_SHIFT_O1_FAST)-1);
-        for (; i4[0] < isz4; i4[0]++, i4[1]++, i4[2]++, i4[3]++) {
-            uint16_t m, c;
-            c = sfb[l0][m = R[0] & mask];
-            R[0] = fb[l0][c].f * (R[0]>>TF_SHIFT_O1_FAST) + m - fb[l0][c].b;
-            out[i4[0]] = l0 = c;
-
-            c = sfb[l1][m = R[1] & mask];
-            R[1] = fb[l1][c].f * (R[1]>>TF_SHIFT_O1_FAST) + m - fb[l1][c].b;
-            out[i4[1]] = l1 = c;
-
-            c = sfb[l2][m = R[2] & mask];
-            R[2] = fb[l2][c].f * (R[2]>>TF_SHIFT_O1_FAST) + m - fb[l2][c].b;
-            out[i4[2]] = l2 = c;
-
-            c = sfb[l3][m = R[3] & mask];
-            R[3] = fb[l3][c].f * (R[3]>>TF_SHIFT_O1_FAST) + m - fb[l3][c].b;
-            out[i4[3]] = l3 = c;
-
-            if (ptr < ptr_end) {
-                RansDecRenorm(&R[0], &ptr);
-                RansDecRenorm(&R[1], &ptr);
-                RansDecRenorm(&R[2], &ptr);
-                RansDecRenorm(&R[3], &ptr);
-            } else {
-                RansDecRenormSafe(&R[0], &ptr, ptr_end+8);
-                RansDecRenormSafe(&R[1], &ptr, ptr_end+8);
-                RansDecRenormSafe(&R[2], &ptr, ptr_end+8);
-                RansDecRenormSafe(&R[3], &ptr, ptr_end+8);
-            }
-        }
-
-        // Remainder
-        for (; i4[3] < out_sz; i4[3]++) {
-            uint32_t m3 = R[3] & ((1u<<TF_SHIFT_O1_FAST)-1);
-            unsigned char c3 = sfb[l3][m3];
-            out[i4[3]] = c3;
-            R[3] = fb[l3][c3].f * (R[3]>>TF_SHIFT_O1_FAST) + m3 - fb[l3][c3].b;
-            RansDecRenormSafe(&R[3], &ptr, ptr_end + 8);
-            l3 = c3;
-        }
+        RANS_UNPACK_CALL(nsym, rans_uncompress_O1_4x16_sfb,
+                         R, ptr, ptr_end, out, out_sz, sfb, fb, uv,
+                         TF_SHIFT_O1_FAST);
     } else {
         // TF_SHIFT_O1_FAST.
         // Significantly faster for -o1 on q40 (low comp).
         // Higher initialisation cost, so only use if big blocks.
-        const uint32_t mask = ((1u << TF_SHIFT_O1_FAST)-1);
-        for (; i4[0] < isz4; i4[0]++, i4[1]++, i4[2]++, i4[3]++) {
-            uint32_t S0 = s3[l0][R[0] & mask];
-            uint32_t S1 = s3[l1][R[1] & mask];
-            l0 = out[i4[0]] = S0;
-            l1 = out[i4[1]] = S1;
-            uint16_t F0 = S0>>(TF_SHIFT_O1_FAST+8);
-            uint16_t F1 = S1>>(TF_SHIFT_O1_FAST+8);
-            uint16_t B0 = (S0>>8) & mask;
-            uint16_t B1 = (S1>>8) & mask;
-
-            R[0] = F0 * (R[0]>>TF_SHIFT_O1_FAST) + B0;
-            R[1] = F1 * (R[1]>>TF_SHIFT_O1_FAST) + B1;
-
-            uint32_t S2 = s3[l2][R[2] & mask];
-            uint32_t S3 = s3[l3][R[3] & mask];
-            l2 = out[i4[2]] = S2;
-            l3 = out[i4[3]] = S3;
-            uint16_t F2 = S2>>(TF_SHIFT_O1_FAST+8);
-            uint16_t F3 = S3>>(TF_SHIFT_O1_FAST+8);
-            uint16_t B2 = (S2>>8) & mask;
-            uint16_t B3 = (S3>>8) & mask;
-
-            R[2] = F2 * (R[2]>>TF_SHIFT_O1_FAST) + B2;
-            R[3] = F3 * (R[3]>>TF_SHIFT_O1_FAST) + B3;
-
-            if (ptr < ptr_end) {
-                RansDecRenorm(&R[0], &ptr);
-                RansDecRenorm(&R[1], &ptr);
-                RansDecRenorm(&R[2], &ptr);
-                RansDecRenorm(&R[3], &ptr);
-            } else {
-                RansDecRenormSafe(&R[0], &ptr, ptr_end+8);
-                RansDecRenormSafe(&R[1], &ptr, ptr_end+8);
-                RansDecRenormSafe(&R[2], &ptr, ptr_end+8);
-                RansDecRenormSafe(&R[3], &ptr, ptr_end+8);
-            }
-        }
-
-        // Remainder
-        for (; i4[3] < out_sz; i4[3]++) {
-            uint32_t S = s3[l3][R[3] & ((1u<<TF_SHIFT_O1_FAST)-1)];
-            l3 = out[i4[3]] = S;
-            R[3] = (S>>(TF_SHIFT_O1_FAST+8)) * (R[3]>>TF_SHIFT_O1_FAST)
-                + ((S>>8) & ((1u<<TF_SHIFT_O1_FAST)-1));
-            RansDecRenormSafe(&R[3], &ptr, ptr_end + 8);
-        }
+        RANS_UNPACK_CALL(nsym, rans_uncompress_O1_4x16_s3,
+                         R, ptr, ptr_end, out, out_sz, s3, uv);
     }
     //fprintf(stderr, "    1 Decoded %d bytes\n", (int)(ptr-in)); //c-size
 
@@ -817,193 +953,859 @@ unsigned char *rans_uncompress_O1_4x16(unsigned char *in, unsigned int in_size,
     return NULL;
 }
 
+static
+unsigned char *rans_uncompress_O1_4x16(unsigned char *in, unsigned int in_size,
+                                       unsigned char *out, unsigned int out_sz) {
+    return rans_uncompress_O1_4x16_u(in, in_size, out, out_sz, NULL, 0);
+}
+
 /*-----------------------------------------------------------------------------
- * r32x16 implementation, included here for now for simplicity
+ * Order-2 rANS.
+ *
+ * Full order-2 tables have 64k contexts, which are too large to store per
+ * block and too slow to initialise when decoding.  Instead we start from
+ * the order-1 model and promote up to RANS_O2_NCTX of the (prev2, prev1)
+ * pairs that most reduce the entropy to contexts of their own.  All other
+ * pairs share the order-1 context of prev1.
+ *
+ * This is stored as an order-1 stream with bit 1 set in the frequency
+ * table header byte.  The (possibly compressed) table is the number of
+ * promoted pairs and the pairs themselves, followed by the alphabet and
+ * frequency tables for the 256 order-1 contexts then the promoted ones.
+ *
+ * It is 4-way interleaved, or with RANS_ORDER_X32 (or X64) 32-way with
+ * the same layout as the 32x16 order-1 codec.
  */
-#include "rANS_static32x16pr.h"
-
-// Test interface for restricting the auto-detection methods so we
-// can forcibly compare different implementations on the same machine.
-// See RANS_CPU_ defines in rANS_static4x16.h
-static int rans_cpu = 0xFFFF; // all
-void rans_set_cpu(int opts) {
-    rans_cpu = opts;
+#define RANS_O2_NCTX  256   // max promoted contexts; must be <= 256
+#define RANS_O2_NCAND 1024  // max pairs evaluated for promotion
+#define RANS_O2_MIN   64    // min pair frequency to be evaluated
+
+typedef struct {
+    uint32_t pair;
+    double val;
+} rans_o2_cand;
+
+static int rans_o2_cand_cmp(const void *vp1, const void *vp2) {
+    const rans_o2_cand *c1 = (const rans_o2_cand *)vp1;
+    const rans_o2_cand *c2 = (const rans_o2_cand *)vp2;
+    if (c1->val != c2->val)
+        return c1->val < c2->val ? 1 : -1;
+    return (c1->pair > c2->pair) - (c1->pair < c2->pair);
 }
 
-#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
-// Icc and Clang both also set __GNUC__ on linux, but not on Windows.
-#include <cpuid.h>
-
-#if defined(__clang__) && defined(__has_attribute)
-#  if __has_attribute(unused)
-#    define UNUSED __attribute__((unused))
-#  else
-#    define UNUSED
-#  endif
-#elif defined(__GNUC__) && __GNUC__ >= 3
-#  define UNUSED __attribute__((unused))
-#else
-#  define UNUSED
-#endif
-
-// CPU detection is performed once.  NB this has an assumption that we're
-// not migrating between processes with different instruction stes, but
-// to date the only systems I know of that support this don't have different
-// capabilities (that we use) per core.
-#ifndef NO_THREADS
-static pthread_once_t rans_cpu_once = PTHREAD_ONCE_INIT;
-#endif
+// Context for in[i], where the stream being encoded started at in[start].
+static inline int rans_o2_ctx(unsigned char *in, int i, int start,
+                              uint16_t *cmap) {
+    int c1 = i > start   ? in[i-1] : 0;
+    int c2 = i > start+1 ? in[i-2] : 0;
+    return cmap[(c2<<8) | c1];
+}
 
-static int have_ssse3   UNUSED = 0;
-static int have_sse4_1  UNUSED = 0;
-static int have_popcnt  UNUSED = 0;
-static int have_avx2    UNUSED = 0;
-static int have_avx512f UNUSED = 0;
-static int is_amd       UNUSED = 0;
+// Chooses which order-2 contexts to promote, filling out cmap[], pairs[k]
+// and F/T[256+k] for each of the K promoted contexts, with F/T[0..255]
+// being the remaining order-1 stats of the nx interleaved streams.
+// Returns K, or -1 on error.
+static int rans_o2_model(unsigned char *in, unsigned int in_size, int nx,
+                         uint16_t *cmap, uint32_t *pairs,
+                         uint32_t (*F)[256], uint32_t *T) {
+    int i, j, k, z, ncand = 0;
+    unsigned int isz = in_size / nx;
+
+    uint32_t *P = htscodecs_tls_calloc(65536, sizeof(*P));
+    rans_o2_cand *cand = malloc(65536 * sizeof(*cand));
+    uint32_t (*F2)[256] = htscodecs_tls_calloc(RANS_O2_NCAND, sizeof(*F2));
+    if (!P || !cand || !F2)
+        goto err;
 
-static void htscodecs_tls_cpu_init(void) {
-    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
-    // These may be unused, depending on HAVE_* config.h macros
+    // Pair frequencies plus the full order-1 stats
+    for (z = 0; z < nx; z++) {
+        unsigned int e = z < nx-1 ? (z+1)*isz : in_size, h = 0;
+        for (i = z*isz; i < e; i++) {
+            P[h]++;
+            F[h&0xff][in[i]]++;
+            h = ((h<<8) | in[i]) & 0xffff;
+        }
+    }
+    for (i = 0; i < 256; i++)
+        for (T[i] = j = 0; j < 256; j++)
+            T[i] += F[i][j];
+
+    // Evaluate the most frequent pairs only
+    for (i = 0; i < 65536; i++) {
+        if (P[i] >= RANS_O2_MIN) {
+            cand[ncand].pair = i;
+            cand[ncand++].val = P[i];
+        }
+    }
+    qsort(cand, ncand, sizeof(*cand), rans_o2_cand_cmp);
+    if (ncand > RANS_O2_NCAND)
+        ncand = RANS_O2_NCAND;
+
+    for (i = 0; i < 65536; i++)
+        cmap[i] = i & 0xff;
+    for (k = 0; k < ncand; k++)
+        cmap[cand[k].pair] = 256+k;
+
+    for (z = 0; z < nx; z++) {
+        unsigned int e = z < nx-1 ? (z+1)*isz : in_size, h = 0;
+        for (i = z*isz; i < e; i++) {
+            if (cmap[h] >= 256)
+                F2[cmap[h]-256][in[i]]++;
+            h = ((h<<8) | in[i]) & 0xffff;
+        }
+    }
 
-    int level = __get_cpuid_max(0, NULL);
-    __cpuid_count(0, 0, eax, ebx, ecx, edx);
-    is_amd = (ecx == 0x444d4163);
-    if (level >= 1) {
-        __cpuid_count(1, 0, eax, ebx, ecx, edx);
-#if defined(bit_SSSE3)
-        have_ssse3 = ecx & bit_SSSE3;
-#endif
-#if defined(bit_POPCNT)
-        have_popcnt = ecx & bit_POPCNT;
-#endif
-#if defined(bit_SSE4_1)
-        have_sse4_1 = ecx & bit_SSE4_1;
-#endif
+    // Bits saved over the order-1 context, less an estimate of the
+    // frequency table size.
+    for (k = 0; k < ncand; k++) {
+        int c1 = cand[k].pair & 0xff;
+        double t1 = log2(T[c1]), t2 = log2(P[cand[k].pair]);
+        double gain = -16;
+        for (j = 0; j < 256; j++) {
+            if (F2[k][j])
+                gain += F2[k][j] * ((log2(F2[k][j]) - t2) -
+                                    (log2(F[c1][j]) - t1)) - 12;
+        }
+        cand[k].val = gain;
     }
-    if (level >= 7) {
-        __cpuid_count(7, 0, eax, ebx, ecx, edx);
-#if defined(bit_AVX2)
-        have_avx2 = ebx & bit_AVX2;
-#endif
-#if defined(bit_AVX512F)
-        have_avx512f = ebx & bit_AVX512F;
-#endif
+    qsort(cand, ncand, sizeof(*cand), rans_o2_cand_cmp);
+
+    // Keep the best, removing their stats from the order-1 contexts.
+    // NB cand[] is now in gain order while F2 is in frequency order.
+    for (k = 0; k < ncand && k < RANS_O2_NCTX && cand[k].val > 0; k++) {
+        int pair = cand[k].pair, c1 = pair & 0xff, src = cmap[pair]-256;
+        memcpy(F[256+k], F2[src], sizeof(*F));
+        T[256+k] = P[pair];
+        T[c1] -= P[pair];
+        for (j = 0; j < 256; j++)
+            F[c1][j] -= F2[src][j];
     }
+    int K = k;
 
-    if (!have_popcnt) have_avx512f = have_avx2 = have_sse4_1 = 0;
-    if (!have_ssse3)  have_sse4_1 = 0;
+    for (i = 0; i < 65536; i++)
+        cmap[i] = i & 0xff;
+    for (k = 0; k < K; k++)
+        cmap[pairs[k] = cand[k].pair] = 256+k;
 
-    if (!(rans_cpu & RANS_CPU_ENC_AVX512)) have_avx512f = 0;
-    if (!(rans_cpu & RANS_CPU_ENC_AVX2))   have_avx2 = 0;
-    if (!(rans_cpu & RANS_CPU_ENC_SSE4))   have_sse4_1 = 0;
+    htscodecs_tls_free(F2);
+    htscodecs_tls_free(P);
+    free(cand);
+    return K;
+
+ err:
+    htscodecs_tls_free(F2);
+    htscodecs_tls_free(P);
+    free(cand);
+    return -1;
 }
 
-static inline
-unsigned char *(*rans_enc_func(int do_simd, int order))
-    (unsigned char *in,
-     unsigned int in_size,
-     unsigned char *out,
-     unsigned int *out_size) {
-    if (!do_simd) { // SIMD disabled
-        return order & 1
-            ? rans_compress_O1_4x16
-            : rans_compress_O0_4x16;
-    }
+// Encodes with nx (4 or 32) interleaved states, falling back to the
+// order-1 codec "o1" of the same width when order-2 doesn't help.
+static
+unsigned char *rans_compress_O2(unsigned char *in, unsigned int in_size,
+                                unsigned char *out, unsigned int *out_size,
+                                int nx,
+                                unsigned char *(*o1)(unsigned char *in,
+                                                     unsigned int in_size,
+                                                     unsigned char *out,
+                                                     unsigned int *out_size)) {
+    unsigned char *cp, *out_end, *out_free = NULL;
+    unsigned int tab_size;
+    int i, j, K;
 
-#ifdef NO_THREADS
-    htscodecs_tls_cpu_init();
-#else
-    int err = pthread_once(&rans_cpu_once, htscodecs_tls_cpu_init);
-    if (err != 0) {
-        fprintf(stderr, "Initialising TLS data failed: pthread_once: %s\n",
-                strerror(err));
-        fprintf(stderr, "Using scalar code only\n");
-    }
-#endif
+    // -20 for order/size/meta
+    uint32_t bound = rans_compress_bound_4x16(in_size, RANS_ORDER_O2)-20;
 
-    if (order & 1) {
-#if defined(HAVE_AVX512)
-        if (have_avx512f && (!is_amd || !have_avx2))
-            return rans_compress_O1_32x16_avx512;
-#endif
-#if defined(HAVE_AVX2)
-        if (have_avx2)
-            return rans_compress_O1_32x16_avx2;
-#endif
-#if defined(HAVE_SSE4_1) && defined(HAVE_SSSE3) && defined(HAVE_POPCNT)
-        if (have_sse4_1) 
-            return rans_compress_O1_32x16;
-#endif
-        return rans_compress_O1_32x16;
-    } else {
-#if defined(HAVE_AVX512)
-        if (have_avx512f && (!is_amd || !have_avx2))
-            return rans_compress_O0_32x16_avx512;
-#endif
-#if defined(HAVE_AVX2)
-        if (have_avx2)
-            return rans_compress_O0_32x16_avx2;
-#endif
-#if defined(HAVE_SSE4_1) && defined(HAVE_SSSE3) && defined(HAVE_POPCNT)
-        if (have_sse4_1)
-            return rans_compress_O0_32x16;
-#endif
-        return rans_compress_O0_32x16;
-    }
-}
+    if (in_size < 16*nx)
+        return o1(in, in_size, out, out_size);
 
-static inline
-unsigned char *(*rans_dec_func(int do_simd, int order))
-    (unsigned char *in,
-     unsigned int in_size,
-     unsigned char *out,
-     unsigned int out_size) {
+    uint16_t *cmap = htscodecs_tls_alloc(65536 * sizeof(*cmap));
+    uint32_t (*F)[256] = htscodecs_tls_calloc(256+RANS_O2_NCTX, sizeof(*F));
+    RansEncSymbol (*syms)[256] = NULL;
+    uint32_t T[256+RANS_O2_NCTX] = {0}, pairs[RANS_O2_NCTX];
+    if (!cmap || !F)
+        goto err;
 
-    if (!do_simd) { // SIMD disabled
-        return order & 1
-            ? rans_uncompress_O1_4x16
-            : rans_uncompress_O0_4x16;
+    // Use plain order-1 if we have no worthwhile order-2 contexts.
+    if ((K = rans_o2_model(in, in_size, nx, cmap, pairs, F, T)) <= 0) {
+        htscodecs_tls_free(F);
+        htscodecs_tls_free(cmap);
+        return K < 0 ? NULL : o1(in, in_size, out, out_size);
     }
 
-#ifdef NO_THREADS
-    htscodecs_tls_cpu_init();
-#else
-    int err = pthread_once(&rans_cpu_once, htscodecs_tls_cpu_init);
-    if (err != 0) {
-        fprintf(stderr, "Initialising TLS data failed: pthread_once: %s\n",
-                strerror(err));
-        fprintf(stderr, "Using scalar code only\n");
+    if (!out) {
+        *out_size = bound;
+        out_free = out = malloc(*out_size);
     }
-#endif
+    if (!out || bound > *out_size)
+        goto err;
 
-    if (order & 1) {
-#if defined(HAVE_AVX512)
-        if (have_avx512f)
-            return rans_uncompress_O1_32x16_avx512;
-#endif
-#if defined(HAVE_AVX2)
-        if (have_avx2)
-            return rans_uncompress_O1_32x16_avx2;
-#endif
-#if defined(HAVE_SSE4_1) && defined(HAVE_SSSE3) && defined(HAVE_POPCNT)
-        if (have_sse4_1)
-            return rans_uncompress_O1_32x16_sse4;
+    if (((size_t)out)&1)
+        bound--;
+    out_end = out + bound;
+
+    syms = htscodecs_tls_alloc((256+K) * sizeof(*syms));
+    if (!syms)
+        goto err;
+
+    o1_freq_ext_put(out);
+    uint8_t *hdr = cp = out + O1_FREQ_EXT_LEN;
+    *cp++ = 0; // shift and flags
+    cp += var_put_u32(cp, NULL, K);
+    for (i = 0; i < K; i++) {
+        *cp++ = pairs[i] >> 8;
+        *cp++ = pairs[i] & 0xff;
+    }
+
+    // Alphabet of all symbols, which are also the order-1 contexts.
+    uint32_t A[256] = {0};
+    for (i = 0; i < 256+K; i++)
+        for (j = 0; j < 256; j++)
+            A[j] |= F[i][j];
+    A[0] = 1;
+    cp += encode_alphabet(cp, A);
+
+    uint32_t S[256+RANS_O2_NCTX] = {0};
+    int shift1 = rans_compute_shift(T, F, T, A, S);
+    int shift2 = rans_compute_shift(T+256, F+256, T+256, A, S+256);
+    int shift = shift1 > shift2 ? shift1 : shift2;
+
+    for (i = 0; i < 256+K; i++) {
+        unsigned int x;
+        if (i < 256 && !A[i])
+            continue;
+
+        if (T[i]) {
+            uint32_t max_val = S[i];
+            if (shift == TF_SHIFT_O1_FAST && max_val > TOTFREQ_O1_FAST)
+                max_val = TOTFREQ_O1_FAST;
+
+            if (normalise_freq(F[i], T[i], max_val) < 0)
+                goto err;
+            T[i] = max_val;
+        }
+
+        cp += encode_freq_d(cp, A, F[i]);
+        if (!T[i])
+            continue;
+
+        normalise_freq_shift(F[i], T[i], 1<<shift);
+        for (x = j = 0; j < 256; j++) {
+            RansEncSymbolInit(&syms[i][j], x, F[i][j], shift);
+            x += F[i][j];
+        }
+    }
+
+    *hdr = (shift<<4) | O1_FREQ_O2;
+    if (cp - hdr > 1000) {
+        // try rans0 compression of header, as per encode_freq1
+        uint8_t *op = hdr;
+        unsigned int u_freq_sz = cp-(op+1);
+        unsigned int c_freq_sz;
+        unsigned char *c_freq = rans_compress_O0_4x16(op+1, u_freq_sz, NULL,
+                                                      &c_freq_sz);
+        if (c_freq && c_freq_sz + 6 < cp-op) {
+            *op++ |= 1; // compressed
+            op += var_put_u32(op, NULL, u_freq_sz);
+            op += var_put_u32(op, NULL, c_freq_sz);
+            memcpy(op, c_freq, c_freq_sz);
+            cp = op+c_freq_sz;
+        }
+        free(c_freq);
+    }
+    tab_size = cp - out;
+
+    // Encode backwards, in the reverse order of the decoder.
+    RansState R[32];
+    int isz = in_size / nx, z;
+    for (z = 0; z < nx; z++)
+        RansEncInit(&R[z]);
+
+    uint8_t *ptr = out_end;
+    for (i = in_size-1; i >= nx*isz; i--)
+        RansEncPutSymbol(&R[nx-1], &ptr,
+                         &syms[rans_o2_ctx(in, i, (nx-1)*isz, cmap)][in[i]]);
+
+    for (i = isz-1; i >= 0; i--) {
+        for (z = nx-1; z >= 0; z--) {
+            int p = z*isz + i;
+            RansEncPutSymbol(&R[z], &ptr,
+                             &syms[rans_o2_ctx(in, p, z*isz, cmap)][in[p]]);
+        }
+    }
+
+    for (z = nx-1; z >= 0; z--)
+        RansEncFlush(&R[z], &ptr);
+
+    *out_size = (out_end - ptr) + tab_size;
+    memmove(out + tab_size, ptr, out_end-ptr);
+
+    htscodecs_tls_free(syms);
+    htscodecs_tls_free(F);
+    htscodecs_tls_free(cmap);
+    return out;
+
+ err:
+    htscodecs_tls_free(syms);
+    htscodecs_tls_free(F);
+    htscodecs_tls_free(cmap);
+    free(out_free);
+    return NULL;
+}
+
+static
+unsigned char *rans_compress_O2_4x16(unsigned char *in, unsigned int in_size,
+                                     unsigned char *out, unsigned int *out_size) {
+    return rans_compress_O2(in, in_size, out, out_size, 4,
+                            rans_compress_O1_4x16);
+}
+
+// Decodes one symbol from state R in context *c.
+//
+// With 10-bit frequencies each s3[] entry holds the frequency, the offset
+// within the symbol's range and the context of the following symbol,
+// keeping the pair lookup off the critical path.  sym[] maps that context
+// back to the symbol.  12-bit frequencies don't leave room for this, so
+// *c is the (prev2, prev1) pair instead and entries hold the symbol,
+// with a frequency of 4096 wrapping to zero.
+//
+// "shift" is intended to be a constant, so the compiler can specialise
+// the callers per shift value.
+static inline
+unsigned char rans_o2_dec_sym(RansState *R, uint32_t *c, uint32_t *s3,
+                              uint16_t *cmap, uint32_t *sym,
+                              const unsigned int shift) {
+    const uint32_t mask = (1u << shift)-1;
+    if (shift == TF_SHIFT_O1_FAST) {
+        uint32_t S = s3[(*c << shift) + (*R & mask)];
+        *R = (S>>21) * (*R>>shift) + ((S>>9) & mask);
+        *c = S & 0x1ff;
+        return sym[*c];
+    } else {
+        uint32_t S = s3[(cmap[*c] << shift) + (*R & mask)];
+        uint32_t f = S>>(shift+8);
+        *R = (f ? f : TOTFREQ_O1) * (*R>>shift) + ((S>>8) & mask);
+        *c = ((*c<<8) | (S & 0xff)) & 0xffff;
+        return S;
+    }
+}
+
+// Decodes rows i onwards of the nx interleaved streams, plus the
+// remainder held by the last state.
+static inline
+void rans_uncompress_O2_s3(RansState *R0, uint32_t *c0, const int nx,
+                           unsigned int i, uint8_t *ptr, uint8_t *ptr_end,
+                           unsigned char *out, unsigned int out_sz,
+                           uint32_t *s3, uint16_t *cmap, uint32_t *sym,
+                           const unsigned int shift) {
+    unsigned int isz = out_sz / nx;
+    int z;
+
+    // Local copies, as otherwise the stores to out[] may alias them
+    RansState R[32];
+    uint32_t c[32];
+    for (z = 0; z < nx; z++) {
+        R[z] = R0[z];
+        c[z] = c0[z];
+    }
+
+    for (; i < isz; i++) {
+        for (z = 0; z < nx; z++)
+            out[z*isz + i] = rans_o2_dec_sym(&R[z], &c[z], s3, cmap, sym,
+                                             shift);
+
+        if (ptr < ptr_end) {
+            for (z = 0; z < nx; z++)
+                RansDecRenorm(&R[z], &ptr);
+        } else {
+            for (z = 0; z < nx; z++)
+                RansDecRenormSafe(&R[z], &ptr, ptr_end + 2*nx);
+        }
+    }
+
+    // Remainder
+    for (i = nx*isz; i < out_sz; i++) {
+        out[i] = rans_o2_dec_sym(&R[nx-1], &c[nx-1], s3, cmap, sym, shift);
+        RansDecRenormSafe(&R[nx-1], &ptr, ptr_end + 2*nx);
+    }
+}
+
+// Decodes nx (4 or 32) interleaved states.  With simd set the AVX512
+// kernel decodes as much as it safely can before the scalar code
+// finishes off.
+static
+unsigned char *rans_uncompress_O2(unsigned char *in, unsigned int in_size,
+                                  unsigned char *out, unsigned int out_sz,
+                                  const int nx, int simd) {
+    if (in_size < 4*nx) // 4-states at least
+        return NULL;
+
+    if (out_sz >= INT_MAX)
+        return NULL; // protect against some overflow cases
+
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+    if (out_sz > 100000)
+        return NULL;
+#endif
+
+    unsigned char *cp = in, *cp_end = in+in_size, *out_free = NULL;
+    unsigned char *c_freq = NULL;
+    uint32_t *s3 = NULL;
+    uint16_t *cmap = NULL;
+    uint32_t K = 0, sym[256+RANS_O2_NCTX];
+    int i, j;
+
+    if (!(o1_freq_ext_get(in, in_size) & O1_FREQ_O2))
+        return NULL;
+    cp += O1_FREQ_EXT_LEN;
+
+    unsigned int shift = *cp >> 4;
+    if (shift != TF_SHIFT_O1 && shift != TF_SHIFT_O1_FAST)
+        return NULL;
+
+    // compressed header? If so uncompress it
+    unsigned char *tab_end = NULL;
+    unsigned char *c_freq_end = cp_end;
+    if (*cp++ & 1) {
+        uint32_t u_freq_sz, c_freq_sz;
+        cp += var_get_u32(cp, cp_end, &u_freq_sz);
+        cp += var_get_u32(cp, cp_end, &c_freq_sz);
+        if (c_freq_sz > cp_end - cp)
+            goto err;
+        tab_end = cp + c_freq_sz;
+        if (!(c_freq = rans_uncompress_O0_4x16(cp, c_freq_sz, NULL, u_freq_sz)))
+            goto err;
+        cp = c_freq;
+        c_freq_end = c_freq + u_freq_sz;
+    }
+
+    cp += var_get_u32(cp, c_freq_end, &K);
+    if (K == 0 || K > RANS_O2_NCTX || 2*K > c_freq_end - cp)
+        goto err;
+
+    // cmap[] is padded for the 32-bit SIMD gathers
+    cmap = htscodecs_tls_alloc((65536+2) * sizeof(*cmap));
+    s3 = htscodecs_tls_alloc(((256+K) << shift) * sizeof(*s3));
+    if (!cmap || !s3)
+        goto err;
+
+    // sym[] is the last symbol of each context
+    for (i = 0; i < 65536+2; i++)
+        cmap[i] = i & 0xff;
+    for (i = 0; i < 256; i++)
+        sym[i] = i;
+    for (i = 0; i < K; i++, cp += 2) {
+        cmap[(cp[0]<<8) | cp[1]] = 256+i;
+        sym[256+i] = cp[1];
+    }
+
+    uint32_t A[256] = {0};
+    int fsz = decode_alphabet(cp, c_freq_end, A);
+    if (!fsz)
+        goto err;
+    cp += fsz;
+
+    for (i = 0; i < 256+K; i++) {
+        // Contexts without a table are zeroed, so they fail to decode
+        // rather than reading uninitialised memory.
+        uint32_t *s3i = &s3[i << shift];
+        uint32_t F[256] = {0}, T = 0, x;
+        if (i >= 256 || A[i]) {
+            fsz = decode_freq_d(cp, c_freq_end, A, F, &T);
+            if (!fsz)
+                goto err;
+            cp += fsz;
+        }
+        if (!T) {
+            memset(s3i, 0, (1<<shift) * sizeof(*s3i));
+            continue;
+        }
+
+        normalise_freq_shift(F, T, 1<<shift);
+
+        // See rans_o2_dec_sym for the entry layouts
+        uint16_t *next = &cmap[sym[i]<<8];
+        for (j = x = 0; j < 256; j++) {
+            if (!F[j])
+                continue;
+            if (F[j] > (1<<shift) - x)
+                goto err;
+            uint32_t y, e = shift == TF_SHIFT_O1_FAST
+                ? (F[j]<<21) | next[j]
+                : (F[j]<<(shift+8)) | j;
+            int bshift = shift == TF_SHIFT_O1_FAST ? 9 : 8;
+            for (y = 0; y < F[j]; y++)
+                s3i[x+y] = e + (y<<bshift);
+            x += F[j];
+        }
+        if (x != (1<<shift))
+            goto err;
+    }
+
+    if (tab_end)
+        cp = tab_end;
+    free(c_freq);
+    c_freq = NULL;
+
+    if (cp_end - cp < 4*nx)
+        goto err;
+
+    if (!out)
+        out_free = out = malloc(out_sz);
+    if (!out)
+        goto err;
+
+    RansState R[32];
+    uint32_t c[32];
+    uint8_t *ptr = cp, *ptr_end = in + in_size - 2*nx;
+    for (i = 0; i < nx; i++) {
+        RansDecInit(&R[i], &ptr);
+        if (R[i] < RANS_BYTE_L)
+            goto err;
+        c[i] = shift == TF_SHIFT_O1_FAST ? cmap[0] : 0;
+    }
+
+    unsigned int row = 0;
+#if defined(__x86_64__) && defined(HAVE_AVX512)
+    if (simd)
+        row = rans_o2_decode_32x16_avx512(R, c, &ptr, ptr_end, out, out_sz,
+                                          s3, cmap, sym, shift);
 #endif
-        return rans_uncompress_O1_32x16;
+
+    if (nx == 4) {
+        if (shift == TF_SHIFT_O1)
+            rans_uncompress_O2_s3(R, c, 4, row, ptr, ptr_end, out, out_sz,
+                                  s3, cmap, sym, TF_SHIFT_O1);
+        else
+            rans_uncompress_O2_s3(R, c, 4, row, ptr, ptr_end, out, out_sz,
+                                  s3, cmap, sym, TF_SHIFT_O1_FAST);
     } else {
+        if (shift == TF_SHIFT_O1)
+            rans_uncompress_O2_s3(R, c, 32, row, ptr, ptr_end, out, out_sz,
+                                  s3, cmap, sym, TF_SHIFT_O1);
+        else
+            rans_uncompress_O2_s3(R, c, 32, row, ptr, ptr_end, out, out_sz,
+                                  s3, cmap, sym, TF_SHIFT_O1_FAST);
+    }
+
+    htscodecs_tls_free(s3);
+    htscodecs_tls_free(cmap);
+    return out;
+
+ err:
+    htscodecs_tls_free(s3);
+    htscodecs_tls_free(cmap);
+    free(out_free);
+    free(c_freq);
+    return NULL;
+}
+
+static
+unsigned char *rans_uncompress_O2_4x16(unsigned char *in, unsigned int in_size,
+                                       unsigned char *out, unsigned int out_sz) {
+    return rans_uncompress_O2(in, in_size, out, out_sz, 4, 0);
+}
+
+/*-----------------------------------------------------------------------------
+ * r32x16 implementation, included here for now for simplicity
+ */
+
+static
+unsigned char *rans_compress_O2_32x16(unsigned char *in, unsigned int in_size,
+                                      unsigned char *out,
+                                      unsigned int *out_size) {
+    return rans_compress_O2(in, in_size, out, out_size, 32,
+                            rans_compress_O1_32x16);
+}
+
+static
+unsigned char *rans_uncompress_O2_32x16(unsigned char *in,
+                                        unsigned int in_size,
+                                        unsigned char *out,
+                                        unsigned int out_sz) {
+    return rans_uncompress_O2(in, in_size, out, out_sz, 32, 0);
+}
+
+#if defined(__x86_64__) && defined(HAVE_AVX512)
+static
+unsigned char *rans_uncompress_O2_32x16_avx512(unsigned char *in,
+                                               unsigned int in_size,
+                                               unsigned char *out,
+                                               unsigned int out_sz) {
+    return rans_uncompress_O2(in, in_size, out, out_sz, 32, 1);
+}
+#endif
+
+// Test interface for restricting the auto-detection methods so we
+// can forcibly compare different implementations on the same machine.
+// See RANS_CPU_ defines in rANS_static4x16.h
+static int rans_cpu = 0xFFFF; // all
+void rans_set_cpu(int opts) {
+    rans_cpu = opts;
+}
+
+// Kernel choices measured by rans_autotune.  Kernels are RANS_CPU_ENC_*
+// values, 0 for scalar, or -1 for untuned in which case the built in
+// heuristics apply.  x32_min is the smallest block size for which the
+// 32-way codec beat the 4-way one.  Both are indexed by [decode][order].
+#define RANS_X32_MIN 50000 // untuned x32_min
+static struct {
+    int kernel[2][2];
+    unsigned int x32_min[2][2];
+} rans_tune = {
+    {{-1, -1}, {-1, -1}},
+    {{RANS_X32_MIN, RANS_X32_MIN}, {RANS_X32_MIN, RANS_X32_MIN}},
+};
+
+// Returns the tuned kernel if it is one of the "avail" RANS_CPU_ENC_* bits,
+// or -1 if the default choice should be used instead.
+static inline int rans_tuned_kernel(int order, int decode, int avail) {
+    int k = rans_tune.kernel[decode][order & 1];
+    return k == 0 || (k > 0 && (avail & k)) ? k : -1;
+}
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+// Icc and Clang both also set __GNUC__ on linux, but not on Windows.
+#include <cpuid.h>
+
+#if defined(__clang__) && defined(__has_attribute)
+#  if __has_attribute(unused)
+#    define UNUSED __attribute__((unused))
+#  else
+#    define UNUSED
+#  endif
+#elif defined(__GNUC__) && __GNUC__ >= 3
+#  define UNUSED __attribute__((unused))
+#else
+#  define UNUSED
+#endif
+
+// CPU detection is performed once.  NB this has an assumption that we're
+// not migrating between processes with different instruction stes, but
+// to date the only systems I know of that support this don't have different
+// capabilities (that we use) per core.
+//
+// The RANS_CPU_* mask is applied separately on every call, so it may be
+// changed at any time and differ per rans_ctx.
+#ifndef NO_THREADS
+static pthread_once_t rans_cpu_once = PTHREAD_ONCE_INIT;
+#endif
+
+static int have_ssse3   UNUSED = 0;
+static int have_sse4_1  UNUSED = 0;
+static int have_popcnt  UNUSED = 0;
+static int have_avx2    UNUSED = 0;
+static int have_avx512f UNUSED = 0;
+static int is_amd       UNUSED = 0;
+
+static void htscodecs_tls_cpu_init(void) {
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    // These may be unused, depending on HAVE_* config.h macros
+
+    int level = __get_cpuid_max(0, NULL);
+    __cpuid_count(0, 0, eax, ebx, ecx, edx);
+    is_amd = (ecx == 0x444d4163);
+    if (level >= 1) {
+        __cpuid_count(1, 0, eax, ebx, ecx, edx);
+#if defined(bit_SSSE3)
+        have_ssse3 = ecx & bit_SSSE3;
+#endif
+#if defined(bit_POPCNT)
+        have_popcnt = ecx & bit_POPCNT;
+#endif
+#if defined(bit_SSE4_1)
+        have_sse4_1 = ecx & bit_SSE4_1;
+#endif
+    }
+    if (level >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+#if defined(bit_AVX2)
+        have_avx2 = ebx & bit_AVX2;
+#endif
+#if defined(bit_AVX512F)
+        have_avx512f = ebx & bit_AVX512F;
+#endif
+    }
+
+    if (!have_popcnt) have_avx512f = have_avx2 = have_sse4_1 = 0;
+    if (!have_ssse3)  have_sse4_1 = 0;
+}
+
+// Picks the instruction set of the kernel for do_simd and order from
+// those present and permitted by the RANS_CPU_* mask "cpu".  Returns a
+// RANS_CPU_ENC_* value (RANS_CPU_DEC_* if decoding), or 0 for scalar code.
+static int rans_cpu_select(int cpu, int do_simd, int order, int decode) {
+    if (!do_simd)
+        return 0;
+
+#ifdef NO_THREADS
+    htscodecs_tls_cpu_init();
+#else
+    int err = pthread_once(&rans_cpu_once, htscodecs_tls_cpu_init);
+    if (err != 0) {
+        fprintf(stderr, "Initialising TLS data failed: pthread_once: %s\n",
+                strerror(err));
+        fprintf(stderr, "Using scalar code only\n");
+        return 0;
+    }
+#endif
+
+    // Decoder bits are the encoder ones shifted by 8.  Masks without
+    // any x86 decoder bits use the encoder bits for both, as they did
+    // before the decoder bits were honoured.
+    int shift = decode ? 8 : 0;
+    if (decode && !(cpu & (RANS_CPU_DEC_SSE4 | RANS_CPU_DEC_AVX2 |
+                           RANS_CPU_DEC_AVX512)))
+        cpu <<= 8;
+    cpu >>= shift;
+    int avx512 = 0, avx2 = 0, sse4 = 0;
+#if defined(HAVE_AVX512)
+    avx512 = have_avx512f && (cpu & RANS_CPU_ENC_AVX512);
+#endif
+#if defined(HAVE_AVX2)
+    avx2 = have_avx2 && (cpu & RANS_CPU_ENC_AVX2);
+#endif
+#if defined(HAVE_SSE4_1) && defined(HAVE_SSSE3) && defined(HAVE_POPCNT)
+    sse4 = have_sse4_1 && (cpu & RANS_CPU_ENC_SSE4);
+#endif
+
+    if (do_simd == X_64)
+        return avx512 ? RANS_CPU_ENC_AVX512 << shift : 0;
+
+    // Order-2 only has an AVX512 decoder
+    if (order == 2)
+        return avx512 && decode ? RANS_CPU_DEC_AVX512 : 0;
+
+    int k = rans_tuned_kernel(order, decode,
+                              (avx512 ? RANS_CPU_ENC_AVX512 : 0) |
+                              (avx2   ? RANS_CPU_ENC_AVX2   : 0) |
+                              (sse4   ? RANS_CPU_ENC_SSE4   : 0));
+    if (k >= 0)
+        return k << shift;
+
+    // AVX512 is slower than AVX2 on AMD, except for order-1 decoding
+    if (avx512 && (!is_amd || !avx2 || (decode && (order & 1))))
+        return RANS_CPU_ENC_AVX512 << shift;
+    if (avx2)
+        return RANS_CPU_ENC_AVX2 << shift;
+    if (sse4)
+        return RANS_CPU_ENC_SSE4 << shift;
+    return 0;
+}
+
+static inline
+unsigned char *(*rans_enc_func(int do_simd, int order, int cpu))
+    (unsigned char *in,
+     unsigned int in_size,
+     unsigned char *out,
+     unsigned int *out_size) {
+    if (order == 2)
+        return do_simd ? rans_compress_O2_32x16 : rans_compress_O2_4x16;
+    if (!do_simd) { // SIMD disabled
+        return order & 1
+            ? rans_compress_O1_4x16
+            : rans_compress_O0_4x16;
+    }
+
+    int kernel = rans_cpu_select(cpu, do_simd, order, 0);
+
+    if (do_simd == X_64) {
+#if defined(HAVE_AVX512)
+        if (kernel == RANS_CPU_ENC_AVX512)
+            return order & 1
+                ? rans_compress_O1_64x16_avx512
+                : rans_compress_O0_64x16_avx512;
+#endif
+        return order & 1
+            ? rans_compress_O1_64x16
+            : rans_compress_O0_64x16;
+    }
+
+    switch (kernel) {
+#if defined(HAVE_AVX512)
+    case RANS_CPU_ENC_AVX512:
+        return order & 1
+            ? rans_compress_O1_32x16_avx512
+            : rans_compress_O0_32x16_avx512;
+#endif
+#if defined(HAVE_AVX2)
+    case RANS_CPU_ENC_AVX2:
+        return order & 1
+            ? rans_compress_O1_32x16_avx2
+            : rans_compress_O0_32x16_avx2;
+#endif
+#if defined(HAVE_SSE4_1) && defined(HAVE_SSSE3) && defined(HAVE_POPCNT)
+    case RANS_CPU_ENC_SSE4:
+        return order & 1
+            ? rans_compress_O1_32x16_sse4
+            : rans_compress_O0_32x16_sse4;
+#endif
+    default:
+        return order & 1
+            ? rans_compress_O1_32x16
+            : rans_compress_O0_32x16;
+    }
+}
+
+static inline
+unsigned char *(*rans_dec_func(int do_simd, int order, int cpu))
+    (unsigned char *in,
+     unsigned int in_size,
+     unsigned char *out,
+     unsigned int out_size) {
+    if (order == 2) {
+        if (!do_simd)
+            return rans_uncompress_O2_4x16;
+#if defined(HAVE_AVX512)
+        if (rans_cpu_select(cpu, X_32, 2, 1) == RANS_CPU_DEC_AVX512)
+            return rans_uncompress_O2_32x16_avx512;
+#endif
+        return rans_uncompress_O2_32x16;
+    }
+
+    if (!do_simd) { // SIMD disabled
+        return order & 1
+            ? rans_uncompress_O1_4x16
+            : rans_uncompress_O0_4x16;
+    }
+
+    int kernel = rans_cpu_select(cpu, do_simd, order, 1);
+
+    if (do_simd == X_64) {
 #if defined(HAVE_AVX512)
-        if (have_avx512f && (!is_amd || !have_avx2))
-            return rans_uncompress_O0_32x16_avx512;
+        if (kernel == RANS_CPU_DEC_AVX512)
+            return order & 1
+                ? rans_uncompress_O1_64x16_avx512
+                : rans_uncompress_O0_64x16_avx512;
+#endif
+        return order & 1
+            ? rans_uncompress_O1_64x16
+            : rans_uncompress_O0_64x16;
+    }
+
+    switch (kernel) {
+#if defined(HAVE_AVX512)
+    case RANS_CPU_DEC_AVX512:
+        return order & 1
+            ? rans_uncompress_O1_32x16_avx512
+            : rans_uncompress_O0_32x16_avx512;
 #endif
 #if defined(HAVE_AVX2)
-        if (have_avx2)
-            return rans_uncompress_O0_32x16_avx2;
+    case RANS_CPU_DEC_AVX2:
+        return order & 1
+            ? rans_uncompress_O1_32x16_avx2
+            : rans_uncompress_O0_32x16_avx2;
 #endif
 #if defined(HAVE_SSE4_1) && defined(HAVE_SSSE3) && defined(HAVE_POPCNT)
-        if (have_sse4_1)
-            return rans_uncompress_O0_32x16_sse4;
+    case RANS_CPU_DEC_SSE4:
+        return order & 1
+            ? rans_uncompress_O1_32x16_sse4
+            : rans_uncompress_O0_32x16_sse4;
 #endif
-        return rans_uncompress_O0_32x16;
+    default:
+        return order & 1
+            ? rans_uncompress_O1_32x16
+            : rans_uncompress_O0_32x16;
     }
 }
 
@@ -1037,15 +1839,33 @@ static inline int have_neon() {
 #endif
 }
 
+// Picks the instruction set of the kernel for do_simd and order from
+// those present and permitted by the RANS_CPU_* mask "cpu".  Returns a
+// RANS_CPU_ENC_* value (RANS_CPU_DEC_* if decoding), or 0 for scalar code.
+static int rans_cpu_select(int cpu, int do_simd, int order, int decode) {
+    if (order == 2 || do_simd != X_32)
+        return 0;
+    int neon = decode ? RANS_CPU_DEC_NEON : RANS_CPU_ENC_NEON;
+    if (!(cpu & neon) || !have_neon())
+        return 0;
+    return rans_tuned_kernel(order, decode, RANS_CPU_ENC_NEON) == 0 ? 0 : neon;
+}
+
 static inline
-unsigned char *(*rans_enc_func(int do_simd, int order))
+unsigned char *(*rans_enc_func(int do_simd, int order, int cpu))
     (unsigned char *in,
      unsigned int in_size,
      unsigned char *out,
      unsigned int *out_size) {
+    if (order == 2)
+        return do_simd ? rans_compress_O2_32x16 : rans_compress_O2_4x16;
 
-    if (do_simd) {
-        if ((rans_cpu & RANS_CPU_ENC_NEON) && have_neon())
+    if (do_simd == X_64) {
+        return order & 1
+            ? rans_compress_O1_64x16
+            : rans_compress_O0_64x16;
+    } else if (do_simd) {
+        if (rans_cpu_select(cpu, do_simd, order, 0))
             return order & 1
                 ? rans_compress_O1_32x16_neon
                 : rans_compress_O0_32x16_neon;
@@ -1061,14 +1881,20 @@ unsigned char *(*rans_enc_func(int do_simd, int order))
 }
 
 static inline
-unsigned char *(*rans_dec_func(int do_simd, int order))
+unsigned char *(*rans_dec_func(int do_simd, int order, int cpu))
     (unsigned char *in,
      unsigned int in_size,
      unsigned char *out,
      unsigned int out_size) {
+    if (order == 2)
+        return do_simd ? rans_uncompress_O2_32x16 : rans_uncompress_O2_4x16;
 
-    if (do_simd) {
-        if ((rans_cpu & RANS_CPU_DEC_NEON) && have_neon())
+    if (do_simd == X_64) {
+        return order & 1
+            ? rans_uncompress_O1_64x16
+            : rans_uncompress_O0_64x16;
+    } else if (do_simd) {
+        if (rans_cpu_select(cpu, do_simd, order, 1))
             return order & 1
                 ? rans_uncompress_O1_32x16_neon
                 : rans_uncompress_O0_32x16_neon;
@@ -1085,14 +1911,24 @@ unsigned char *(*rans_dec_func(int do_simd, int order))
 
 #else // !(defined(__GNUC__) && defined(__x86_64__)) && !defined(__ARM_NEON)
 
+static int rans_cpu_select(int cpu, int do_simd, int order, int decode) {
+    return 0;
+}
+
 static inline
-unsigned char *(*rans_enc_func(int do_simd, int order))
+unsigned char *(*rans_enc_func(int do_simd, int order, int cpu))
     (unsigned char *in,
      unsigned int in_size,
      unsigned char *out,
      unsigned int *out_size) {
+    if (order == 2)
+        return do_simd ? rans_compress_O2_32x16 : rans_compress_O2_4x16;
 
-    if (do_simd) {
+    if (do_simd == X_64) {
+        return order & 1
+            ? rans_compress_O1_64x16
+            : rans_compress_O0_64x16;
+    } else if (do_simd) {
         return order & 1
             ? rans_compress_O1_32x16
             : rans_compress_O0_32x16;
@@ -1101,27 +1937,694 @@ unsigned char *(*rans_enc_func(int do_simd, int order))
             ? rans_compress_O1_4x16
             : rans_compress_O0_4x16;
     }
-}
+}
+
+static inline
+unsigned char *(*rans_dec_func(int do_simd, int order, int cpu))
+    (unsigned char *in,
+     unsigned int in_size,
+     unsigned char *out,
+     unsigned int out_size) {
+    if (order == 2)
+        return do_simd ? rans_uncompress_O2_32x16 : rans_uncompress_O2_4x16;
+
+    if (do_simd == X_64) {
+        return order & 1
+            ? rans_uncompress_O1_64x16
+            : rans_uncompress_O0_64x16;
+    } else if (do_simd) {
+        return order & 1
+            ? rans_uncompress_O1_32x16
+            : rans_uncompress_O0_32x16;
+    } else {
+        return order & 1
+            ? rans_uncompress_O1_4x16
+            : rans_uncompress_O0_4x16;
+    }
+}
+
+#endif
+
+/*-----------------------------------------------------------------------------
+ * Kernel autotuning.
+ *
+ * Times each available 32-way kernel against synthetic data, separately
+ * for order-0 and order-1 encoding and decoding, and then the fastest
+ * against the 4-way codec over a range of block sizes to find where the
+ * 32-way codec starts to pay off.  The results replace the fixed vendor
+ * based heuristics in rans_cpu_select and the RANS_ORDER_SIMD_AUTO size
+ * threshold.  The encoded output is unchanged by the choice of kernel,
+ * but SIMD_AUTO may pick a different format.
+ */
+#define RANS_TUNE_LEN  (1<<17) // largest block size tried
+// Smallest block size tried.  Below this the extra 112 bytes of 32-way
+// state is a significant cost to the compression ratio, whatever the speed.
+#define RANS_TUNE_MIN  (1<<14)
+#define RANS_TUNE_WORK (1<<17) // bytes processed per measurement
+
+static double rans_tune_now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Best of three times to process RANS_TUNE_WORK bytes in blocks of in_size.
+// Exactly one of enc and dec is set.  Returns -1 on failure.
+static double rans_tune_time(unsigned char *(*enc)(unsigned char *in,
+                                                   unsigned int in_size,
+                                                   unsigned char *out,
+                                                   unsigned int *out_size),
+                             unsigned char *(*dec)(unsigned char *in,
+                                                   unsigned int in_size,
+                                                   unsigned char *out,
+                                                   unsigned int out_size),
+                             unsigned char *in, unsigned int in_size,
+                             unsigned char *out, unsigned int out_size) {
+    int nrep = RANS_TUNE_WORK / in_size, trial, i;
+    double best = -1;
+    if (nrep < 1)
+        nrep = 1;
+
+    for (trial = 0; trial < 3; trial++) {
+        double t = rans_tune_now();
+        for (i = 0; i < nrep; i++) {
+            unsigned int sz = out_size;
+            if (enc ? !enc(in, in_size, out, &sz)
+                    : !dec(in, in_size, out, out_size))
+                return -1;
+        }
+        t = rans_tune_now() - t;
+        if (best < 0 || t < best)
+            best = t;
+    }
+
+    return best;
+}
+
+// Times 4-way and 32-way coding of "in" at each power of two size,
+// setting x32_min to the size from which 32-way is consistently faster.
+// If 32-way never wins up to RANS_TUNE_LEN, larger blocks are untested
+// so we keep the default.
+static int rans_tune_x32(int order, unsigned char *in,
+                         unsigned char *comp, unsigned char *out) {
+    unsigned int comp_max = rans_compress_bound_4x16(RANS_TUNE_LEN, X_32|1);
+    unsigned int x32_min[2] = {UINT_MAX, UINT_MAX}, sz;
+    int decode;
+
+    for (sz = RANS_TUNE_LEN; sz >= RANS_TUNE_MIN; sz /= 2) {
+        for (decode = 0; decode < 2; decode++) {
+            double t[2];
+            int x;
+            for (x = 0; x < 2; x++) {
+                int do_simd = x ? X_32 : 0;
+                unsigned int clen = comp_max;
+                if (!rans_enc_func(do_simd, order, rans_cpu)
+                    (in, sz, comp, &clen))
+                    return -1;
+                t[x] = decode
+                    ? rans_tune_time(NULL,
+                                     rans_dec_func(do_simd, order, rans_cpu),
+                                     comp, clen, out, sz)
+                    : rans_tune_time(rans_enc_func(do_simd, order, rans_cpu),
+                                     NULL, in, sz, comp, comp_max);
+                if (t[x] < 0)
+                    return -1;
+            }
+
+            // Only lower the threshold while 32-way keeps winning
+            if (t[1] < t[0] &&
+                (sz == RANS_TUNE_LEN || x32_min[decode] == sz*2))
+                x32_min[decode] = sz;
+        }
+    }
+
+    for (decode = 0; decode < 2; decode++)
+        rans_tune.x32_min[decode][order] = x32_min[decode] == UINT_MAX
+            ? RANS_X32_MIN : x32_min[decode];
+    return 0;
+}
+
+static void rans_tune_reset(void) {
+    int order, decode;
+    for (order = 0; order < 2; order++) {
+        for (decode = 0; decode < 2; decode++) {
+            rans_tune.kernel[decode][order] = -1;
+            rans_tune.x32_min[decode][order] = RANS_X32_MIN;
+        }
+    }
+}
+
+int rans_autotune(void) {
+    static const int kernels[] = {
+        0, RANS_CPU_ENC_SSE4, RANS_CPU_ENC_AVX2, RANS_CPU_ENC_AVX512,
+        RANS_CPU_ENC_NEON,
+    };
+    unsigned int comp_max = rans_compress_bound_4x16(RANS_TUNE_LEN, X_32|1);
+    unsigned char *in = malloc(RANS_TUNE_LEN);
+    unsigned char *comp = malloc(comp_max);
+    unsigned char *out = malloc(RANS_TUNE_LEN);
+    int order, decode, ret = -1;
+    unsigned int i;
+
+    rans_tune_reset();
+    if (!in || !comp || !out)
+        goto err;
+
+    // Quality-like data: a skewed alphabet of 40 symbols with strong
+    // dependence on the previous symbol.
+    uint32_t r = 12345;
+    int c = 20;
+    for (i = 0; i < RANS_TUNE_LEN; i++) {
+        r = r * 1103515245 + 12345;
+        int x = (r >> 16) & 63;
+        c += x < 8 ? x - 4 : x < 12 ? 8 : x < 16 ? -8 : 0;
+        c = c < 0 ? 0 : c > 39 ? 39 : c;
+        in[i] = 33 + c;
+    }
+
+    for (order = 0; order < 2; order++) {
+        for (decode = 0; decode < 2; decode++) {
+            double best = -1;
+            int best_k = -1, j;
+            for (j = 0; j < (int)(sizeof(kernels)/sizeof(*kernels)); j++) {
+                int k = kernels[j], mask = k | (k<<8);
+                if (rans_cpu_select(mask, X_32, order, decode)
+                    != (decode ? k<<8 : k))
+                    continue; // unavailable
+
+                // All kernels produce the same encoded data
+                unsigned int clen = comp_max;
+                if (!rans_enc_func(X_32, order, mask)
+                    (in, RANS_TUNE_LEN, comp, &clen))
+                    goto err;
+                double t = decode
+                    ? rans_tune_time(NULL, rans_dec_func(X_32, order, mask),
+                                     comp, clen, out, RANS_TUNE_LEN)
+                    : rans_tune_time(rans_enc_func(X_32, order, mask), NULL,
+                                     in, RANS_TUNE_LEN, comp, comp_max);
+                if (t < 0)
+                    goto err;
+                if (best < 0 || t < best) {
+                    best = t;
+                    best_k = k;
+                }
+            }
+            rans_tune.kernel[decode][order] = best_k;
+        }
+
+        if (rans_tune_x32(order, in, comp, out) < 0)
+            goto err;
+    }
+    ret = 0;
+
+ err:
+    if (ret < 0)
+        rans_tune_reset();
+    free(in);
+    free(comp);
+    free(out);
+    return ret;
+}
+
+// Runs rans_autotune once if the HTSCODECS_AUTOTUNE environment variable
+// is set to a non-zero value.
+#ifndef NO_THREADS
+static pthread_once_t rans_tune_once = PTHREAD_ONCE_INIT;
+#endif
+
+static void rans_tune_env(void) {
+    char *env = getenv("HTSCODECS_AUTOTUNE");
+    if (env && atoi(env))
+        rans_autotune();
+}
+
+static inline void rans_tune_init(void) {
+#ifdef NO_THREADS
+    static int done = 0;
+    if (!done) {
+        done = 1;
+        rans_tune_env();
+    }
+#else
+    pthread_once(&rans_tune_once, rans_tune_env);
+#endif
+}
+
+// The smallest block size for which RANS_ORDER_SIMD_AUTO uses the 32-way
+// codec.  This needs to be faster for both encoding and decoding.
+static inline unsigned int rans_x32_min(int order) {
+    unsigned int e = rans_tune.x32_min[0][order & 1];
+    unsigned int d = rans_tune.x32_min[1][order & 1];
+    return e > d ? e : d;
+}
+
+/*-----------------------------------------------------------------------------
+ * Reusable scratch memory.
+ *
+ * Without a context every call mallocs and frees its own temporary
+ * buffers.  With one, the buffers are grown on demand and retained
+ * between calls.  Each buffer has a fixed purpose so the non-recursive
+ * STRIPE sub-stream calls can share the parent's context without
+ * clobbering its buffers.  A context must not be used by more than one
+ * thread at a time.
+ *
+ * Note the large O1 decoder tables already come from the per-thread
+ * htscodecs_tls_alloc pool, so they are not duplicated here.
+ */
+enum rans_ctx_buf {
+    RC_TRANSPOSED,   // encoder: STRIPE transposed input
+    RC_BEST,         // encoder: STRIPE best trial so far
+    RC_PACKED,       // encoder: PACK output
+    RC_META,         // encoder: RLE run lengths
+    RC_RLE,          // encoder: RLE literals
+    RC_UNSTRIPE,     // decoder: STRIPE sub-stream output
+    RC_TMP,          // decoder: PACK / RLE intermediate
+    RC_UMETA,        // decoder: uncompressed RLE run lengths
+    RC_NBUF
+};
+
+// A shared static model; see rans_ctx_add_model.
+#define RANS_NMODELS 256
+typedef struct {
+    int order;
+    uint32_t *F;             // normalised freqs, [256] or [256][256]
+    RansEncSymbol *syms;     // encoder symbols, [256] or [256][256]
+
+    // Order-0 decoder tables
+    uint8_t  *ssym;
+    uint16_t *sfreq, *sbase;
+
+    // Order-1 decoder tables, TF_SHIFT_O1 only
+    uint8_t *sfb_, *sfb[256];
+    fb_t (*fb)[256];
+} rans_model;
+
+struct rans_ctx {
+    unsigned char *buf[RC_NBUF];
+    size_t sz[RC_NBUF];
+
+    rans_model *model[RANS_NMODELS];
+    int enc_model;           // model used by the encoder, or -1 for none
+
+    int cpu;                 // RANS_CPU_* mask, or -1 to use rans_set_cpu's
+};
+
+rans_ctx *rans_ctx_create(void) {
+    rans_ctx *ctx = calloc(1, sizeof(rans_ctx));
+    if (ctx) {
+        ctx->enc_model = -1;
+        ctx->cpu = -1;
+    }
+    return ctx;
+}
+
+void rans_ctx_set_cpu(rans_ctx *ctx, int opts) {
+    ctx->cpu = opts;
+}
+
+// The RANS_CPU_* mask in effect for calls using ctx, which may be NULL.
+static inline int rans_ctx_cpu(rans_ctx *ctx) {
+    return ctx && ctx->cpu >= 0 ? ctx->cpu : rans_cpu;
+}
+
+int rans_cpu_kernel(rans_ctx *ctx, int order, int decode) {
+    int cpu = rans_ctx_cpu(ctx);
+    rans_tune_init();
+    int do_simd = (order & RANS_ORDER_X64) == RANS_ORDER_X64
+        ? X_64 : order & RANS_ORDER_X32;
+    if (!decode && (order & RANS_ORDER_SIMD_AUTO))
+        do_simd |= X_32;
+
+    return rans_cpu_select(cpu, do_simd,
+                           (order & RANS_ORDER_O2) ? 2 : order & 1, decode);
+}
+
+static void rans_model_free(rans_model *m) {
+    if (!m)
+        return;
+
+    free(m->F);
+    free(m->syms);
+    free(m->ssym);
+    free(m->sfreq);
+    free(m->sbase);
+    free(m->sfb_);
+    free(m->fb);
+    free(m);
+}
+
+void rans_ctx_destroy(rans_ctx *ctx) {
+    if (!ctx)
+        return;
+
+    int i;
+    for (i = 0; i < RC_NBUF; i++)
+        free(ctx->buf[i]);
+    for (i = 0; i < RANS_NMODELS; i++)
+        rans_model_free(ctx->model[i]);
+    free(ctx);
+}
+
+// Returns a scratch buffer of at least size bytes.  Contents are undefined.
+static unsigned char *rans_ctx_alloc(rans_ctx *ctx, int b, size_t size) {
+    if (!ctx)
+        return malloc(size);
+
+    if (ctx->sz[b] < size) {
+        free(ctx->buf[b]);
+        if (!(ctx->buf[b] = malloc(size))) {
+            ctx->sz[b] = 0;
+            return NULL;
+        }
+        ctx->sz[b] = size;
+    }
+
+    return ctx->buf[b];
+}
+
+static void rans_ctx_free(rans_ctx *ctx, void *ptr) {
+    if (!ctx)
+        free(ptr);
+}
+
+/*
+ * Threaded STRIPE jobs cannot share ctx's scratch buffers, so each one
+ * works on a child context instead.  This inherits the CPU selection and
+ * borrows the (read only) shared models, but has its own buffers.
+ * Returns NULL if parent is NULL.
+ */
+static rans_ctx *rans_ctx_child(rans_ctx *child, rans_ctx *parent) {
+    if (!parent)
+        return NULL;
+
+    memset(child, 0, sizeof(*child));
+    memcpy(child->model, parent->model, sizeof(child->model));
+    child->enc_model = -1;
+    child->cpu = parent->cpu;
+    return child;
+}
+
+static void rans_ctx_child_free(rans_ctx *child) {
+    if (!child)
+        return;
+
+    int i;
+    for (i = 0; i < RC_NBUF; i++)
+        free(child->buf[i]);
+}
+
+/*-----------------------------------------------------------------------------
+ * Shared static models.
+ *
+ * The frequencies are normalised and both the encoder symbols and the
+ * decoder lookup tables are built once at registration, so blocks coded
+ * with a model neither store nor parse a frequency table.  These always
+ * use the 4-way scalar order-0 and order-1 (12-bit) codecs.
+ */
+
+// Normalises 256 counts in F to tot, with a deterministic result.
+// Returns the original sum, or -1 on failure.
+static int64_t rans_model_normalise(uint32_t *F, uint32_t tot) {
+    int64_t T = 0;
+    int j;
+    for (j = 0; j < 256; j++)
+        T += F[j];
+    if (T > INT_MAX)
+        return -1;
+    if (T && normalise_freq(F, T, tot) < 0)
+        return -1;
+    return T;
+}
+
+int rans_ctx_add_model(rans_ctx *ctx, int id, int order, uint32_t *F) {
+    if (!ctx || id < 0 || id >= RANS_NMODELS || (order & ~1) || !F)
+        return -1;
+
+    rans_model *m = calloc(1, sizeof(*m));
+    if (!m)
+        return -1;
+    m->order = order;
+
+    int i, j, x;
+    if (order == 0) {
+        if (!(m->F = malloc(256 * sizeof(*m->F))) ||
+            !(m->syms = malloc(256 * sizeof(*m->syms))) ||
+            !(m->ssym  = calloc(TOTFREQ, sizeof(*m->ssym))) ||
+            !(m->sfreq = calloc(TOTFREQ, sizeof(*m->sfreq))) ||
+            !(m->sbase = calloc(TOTFREQ, sizeof(*m->sbase))))
+            goto err;
+
+        memcpy(m->F, F, 256 * sizeof(*F));
+        if (rans_model_normalise(m->F, TOTFREQ) <= 0)
+            goto err;
+
+        for (j = x = 0; j < 256; j++) {
+            if (!m->F[j])
+                continue;
+            RansEncSymbolInit(&m->syms[j], x, m->F[j], TF_SHIFT);
+            for (i = x; i < x + m->F[j]; i++) {
+                m->ssym [i] = j;
+                m->sfreq[i] = m->F[j];
+                m->sbase[i] = i - x;
+            }
+            x += m->F[j];
+        }
+    } else {
+        if (!(m->F = malloc(256*256 * sizeof(*m->F))) ||
+            !(m->syms = malloc(256*256 * sizeof(*m->syms))) ||
+            !(m->sfb_ = calloc(256, TOTFREQ_O1)) ||
+            !(m->fb = calloc(256, sizeof(*m->fb))))
+            goto err;
+
+        memcpy(m->F, F, 256*256 * sizeof(*F));
+        RansEncSymbol (*syms)[256] = (RansEncSymbol (*)[256])m->syms;
+        for (i = 0; i < 256; i++) {
+            uint32_t *Fi = &m->F[i*256];
+            m->sfb[i] = m->sfb_ + i*TOTFREQ_O1;
+            int64_t T = rans_model_normalise(Fi, TOTFREQ_O1);
+            if (T < 0)
+                goto err;
+
+            for (j = x = 0; j < 256; j++) {
+                RansEncSymbolInit(&syms[i][j], x, Fi[j], TF_SHIFT_O1);
+                if (!Fi[j])
+                    continue;
+                memset(&m->sfb[i][x], j, Fi[j]);
+                m->fb[i][j].f = Fi[j];
+                m->fb[i][j].b = x;
+                x += Fi[j];
+            }
+        }
+    }
+
+    rans_model_free(ctx->model[id]);
+    ctx->model[id] = m;
+    return 0;
+
+ err:
+    rans_model_free(m);
+    return -1;
+}
+
+int rans_ctx_use_model(rans_ctx *ctx, int id) {
+    if (!ctx || id < -1 || id >= RANS_NMODELS || (id >= 0 && !ctx->model[id]))
+        return -1;
+    ctx->enc_model = id;
+    return 0;
+}
+
+// Returns 1 if every symbol coded from in[] has a non-zero frequency
+// in model m, 0 otherwise.
+static int rans_model_covers(rans_model *m, unsigned char *in,
+                             unsigned int in_size) {
+    unsigned int i;
+
+    if (m->order == 0) {
+        uint32_t P[256+MAGIC] = {0};
+        present8(in, in_size, P);
+        for (i = 0; i < 256; i++)
+            if (P[i] && !m->F[i])
+                return 0;
+        return 1;
+    }
+
+    // We check every adjacent pair plus all symbols in context 0, which is
+    // a superset of those used by the 4 interleaved streams.
+    uint32_t bad = 0;
+    for (i = 1; i < in_size; i++)
+        bad |= !m->F[in[i-1]*256 + in[i]];
+    for (i = 0; i < 4; i++)
+        bad |= !m->F[in[i*(in_size>>2)]];
+    return !bad;
+}
+
+// Encodes in[] using model "id".  The block is stored as order-1, with
+// an O1_FREQ_MODEL extension header and a varint model id instead of the
+// frequency table, followed by the rANS states and data.  The
+// model's own order is used for the data.  *out_size holds the size of
+// out on input.
+static unsigned char *rans_compress_model_4x16(rans_model *m, int id,
+                                               unsigned char *in,
+                                               unsigned int in_size,
+                                               unsigned char *out,
+                                               unsigned int *out_size) {
+    uint32_t bound = rans_compress_bound_4x16(in_size, 0) - 20;
+    if (bound > *out_size)
+        return NULL;
+
+    o1_freq_ext_put(out);
+    out[O1_FREQ_EXT_LEN] = O1_FREQ_MODEL;
+    int id_len = O1_FREQ_EXT_LEN + 1 +
+        var_put_u32(out + O1_FREQ_EXT_LEN + 1, out + *out_size, id);
+    uint8_t *out_end = out + bound, *ptr;
+    if (((size_t)out_end)&1)
+        out_end--;
+
+    ptr = m->order
+        ? rans_compress_O1_4x16_syms(in, in_size,
+                                     (RansEncSymbol (*)[256])m->syms, out_end)
+        : rans_compress_O0_4x16_syms(in, in_size, m->syms, out_end);
+
+    memmove(out + id_len, ptr, out_end - ptr);
+    *out_size = id_len + (out_end - ptr);
+    return out;
+}
+
+// Decodes an order-1 block flagged with O1_FREQ_MODEL.
+static unsigned char *rans_uncompress_model_4x16(rans_ctx *ctx,
+                                                 unsigned char *in,
+                                                 unsigned int in_size,
+                                                 unsigned char *out,
+                                                 unsigned int out_sz) {
+    uint32_t id;
+    if (!(o1_freq_ext_get(in, in_size) & O1_FREQ_MODEL))
+        return NULL;
+    int n = var_get_u32(in + O1_FREQ_EXT_LEN + 1, in + in_size, &id);
+    int id_len = O1_FREQ_EXT_LEN + 1 + n;
+    if (!ctx || !n || id >= RANS_NMODELS || !ctx->model[id])
+        return NULL;
+
+    rans_model *m = ctx->model[id];
+    int order = m->order;
+
+    in += id_len;
+    in_size -= id_len;
+    if (in_size < 16 || out_sz >= INT_MAX)
+        return NULL;
+
+    rans_unpack_t no_unpack = {0};
+    if (order == 0) {
+        if (rans_uncompress_O0_4x16_tab(in, in + in_size - 8, out, out_sz,
+                                        m->ssym, m->sfreq, m->sbase,
+                                        no_unpack, 0) < 0)
+            return NULL;
+        return out;
+    }
+
+    RansState R[4];
+    uint8_t *ptr = in, *ptr_end = in + in_size - 8;
+    RansDecInit(&R[0], &ptr); if (R[0] < RANS_BYTE_L) return NULL;
+    RansDecInit(&R[1], &ptr); if (R[1] < RANS_BYTE_L) return NULL;
+    RansDecInit(&R[2], &ptr); if (R[2] < RANS_BYTE_L) return NULL;
+    RansDecInit(&R[3], &ptr); if (R[3] < RANS_BYTE_L) return NULL;
+
+    rans_uncompress_O1_4x16_sfb(R, ptr, ptr_end, out, out_sz,
+                                m->sfb, m->fb, no_unpack, TF_SHIFT_O1, 0);
+    return out;
+}
+
+/*-----------------------------------------------------------------------------
+ * Threaded trial compression of the STRIPE sub-streams.
+ *
+ * Every sub-stream / method pair is an independent job writing to its own
+ * buffer.  The caller then picks the smallest per sub-stream using the same
+ * tie-breaking as the serial code, so the output is identical regardless of
+ * the number of threads used.
+ */
+static const int rans_stripe_methods[] = {1,64,128,0};
+#define NSTRIPE_METHODS \
+    ((int)(sizeof(rans_stripe_methods)/sizeof(*rans_stripe_methods)))
+
+/*
+ * Sets allow[j] to whether rans_stripe_methods[j] should be tried for a
+ * STRIPE sub-stream.  This is all methods permitted by order, or with
+ * RANS_ORDER_STRIPE_EST only the best K of those by estimated size.
+ */
+static void rans_stripe_allow(unsigned char *in, unsigned int in_size,
+                              int order, int allow[NSTRIPE_METHODS]) {
+    int meth[NSTRIPE_METHODS], idx[NSTRIPE_METHODS], sel[NSTRIPE_METHODS];
+    int j, n = 0;
+
+    for (j = 0; j < NSTRIPE_METHODS; j++) {
+        int m = rans_stripe_methods[j];
+        allow[j] = (order & m) == m;
+
+        // order-1 *only*; bit check above cannot elide order-0
+        if ((order & RANS_ORDER_STRIPE_NO0) && (m&1) == 0)
+            allow[j] = 0;
+
+        if (allow[j]) {
+            idx[n] = j;
+            meth[n++] = m;
+        }
+    }
 
-static inline
-unsigned char *(*rans_dec_func(int do_simd, int order))
-    (unsigned char *in,
-     unsigned int in_size,
-     unsigned char *out,
-     unsigned int out_size) {
+    if (!(order & RANS_ORDER_STRIPE_EST) || n <= 1)
+        return;
 
-    if (do_simd) {
-        return order & 1
-            ? rans_uncompress_O1_32x16
-            : rans_uncompress_O0_32x16;
-    } else {
-        return order & 1
-            ? rans_uncompress_O1_4x16
-            : rans_uncompress_O0_4x16;
-    }
+    // On failure we just try them all
+    if (htscodecs_pick_methods(in, in_size, meth, n, (order>>19)&3, sel) < 0)
+        return;
+
+    for (j = 0; j < n; j++)
+        allow[idx[j]] = sel[j];
 }
 
-#endif
+static
+unsigned char *rans_compress_to_4x16_int(rans_ctx *ctx,
+                                         unsigned char *in,
+                                         unsigned int in_size,
+                                         unsigned char *out,
+                                         unsigned int *out_size,
+                                         int order, int nthreads);
+
+typedef struct {
+    rans_ctx *ctx;
+    unsigned char *in;
+    unsigned int *part_len, *idx;
+    int order;
+    int (*allow)[NSTRIPE_METHODS];
+    unsigned char **out;
+    unsigned int *out_len;
+} rans_stripe_enc;
+
+static void rans_stripe_trial(void *arg, int job) {
+    rans_stripe_enc *s = (rans_stripe_enc *)arg;
+    int i = job / NSTRIPE_METHODS;
+    int m = rans_stripe_methods[job % NSTRIPE_METHODS];
+
+    s->out[job] = NULL;
+    s->out_len[job] = UINT_MAX;
+
+    if (!s->allow[i][job % NSTRIPE_METHODS])
+        return;
+
+    int sub_order = m | RANS_ORDER_NOSZ | (s->order & RANS_ORDER_X64);
+    unsigned int olen = rans_compress_bound_4x16(s->part_len[i], sub_order);
+    if (!(s->out[job] = malloc(olen)))
+        return;
+
+    rans_ctx child, *c = rans_ctx_child(&child, s->ctx);
+    if (!rans_compress_to_4x16_int(c, s->in + s->idx[i], s->part_len[i],
+                                   s->out[job], &olen, sub_order, 1)) {
+        rans_ctx_child_free(c);
+        free(s->out[job]);
+        s->out[job] = NULL;
+        return;
+    }
+    rans_ctx_child_free(c);
+    s->out_len[job] = olen;
+}
 
 /*-----------------------------------------------------------------------------
  * Simple interface to the order-0 vs order-1 encoders and decoders.
@@ -1131,11 +2634,53 @@ unsigned char *(*rans_dec_func(int do_simd, int order))
 unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
                                      unsigned char *out,unsigned int *out_size,
                                      int order) {
+    return rans_compress_to_4x16_int(NULL, in, in_size, out, out_size,
+                                     order, 1);
+}
+
+unsigned char *rans_compress_to_4x16_mt(unsigned char *in,
+                                        unsigned int in_size,
+                                        unsigned char *out,
+                                        unsigned int *out_size,
+                                        int order, int nthreads) {
+    return rans_compress_to_4x16_int(NULL, in, in_size, out, out_size,
+                                     order, nthreads);
+}
+
+unsigned char *rans_compress_to_4x16_ctx(rans_ctx *ctx,
+                                         unsigned char *in,
+                                         unsigned int in_size,
+                                         unsigned char *out,
+                                         unsigned int *out_size,
+                                         int order) {
+    return rans_compress_to_4x16_int(ctx, in, in_size, out, out_size,
+                                     order, 1);
+}
+
+unsigned char *rans_compress_to_4x16_ctx_mt(rans_ctx *ctx,
+                                            unsigned char *in,
+                                            unsigned int in_size,
+                                            unsigned char *out,
+                                            unsigned int *out_size,
+                                            int order, int nthreads) {
+    return rans_compress_to_4x16_int(ctx, in, in_size, out, out_size,
+                                     order, nthreads);
+}
+
+static
+unsigned char *rans_compress_to_4x16_int(rans_ctx *ctx,
+                                         unsigned char *in,
+                                         unsigned int in_size,
+                                         unsigned char *out,
+                                         unsigned int *out_size,
+                                         int order, int nthreads) {
     if (in_size > INT_MAX) {
         *out_size = 0;
         return NULL;
     }
 
+    rans_tune_init();
+
     unsigned int c_meta_len;
     uint8_t *meta = NULL, *rle = NULL, *packed = NULL;
     uint8_t *out_free = NULL;
@@ -1151,21 +2696,23 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
     unsigned char *out_end = out + *out_size;
 
     // Permit 32-way unrolling for large blocks, paving the way for
-    // AVX2 and AVX512 SIMD variants.
-    if ((order & RANS_ORDER_SIMD_AUTO) && in_size >= 50000
+    // AVX2 and AVX512 SIMD variants.  64-way is never chosen here, as
+    // existing CRAM 3.1 readers cannot decode it; see RANS_ORDER_X64.
+    if ((order & RANS_ORDER_SIMD_AUTO) && in_size >= rans_x32_min(order)
         && !(order & RANS_ORDER_STRIPE))
         order |= X_32;
 
     if (in_size <= 20)
         order &= ~RANS_ORDER_STRIPE;
     if (in_size <= 1000)
-        order &= ~RANS_ORDER_X32;
+        order &= ~RANS_ORDER_X64;
 
     if (order & RANS_ORDER_STRIPE) {
         int N = (order>>8) & 0xff;
         if (N == 0) N = 4; // default for compatibility with old tests
 
-        unsigned char *transposed = malloc(in_size);
+        unsigned char *transposed = rans_ctx_alloc(ctx, RC_TRANSPOSED,
+                                                   in_size);
         unsigned int part_len[256];
         unsigned int idx[256];
         if (!transposed) {
@@ -1212,28 +2759,84 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
         unsigned char *out_best = NULL;
         unsigned int out_best_len = 0;
 
+        int allow[256][NSTRIPE_METHODS];
+        for (i = 0; i < N; i++)
+            rans_stripe_allow(transposed+idx[i], part_len[i], order,
+                              allow[i]);
+
         out2_start = out2 = out+7+5*N; // shares a buffer with c_meta
-        for (i = 0; i < N; i++) {
+        if (nthreads > 1) {
+            int njobs = N * NSTRIPE_METHODS;
+            unsigned char **trial = calloc(njobs, sizeof(*trial));
+            unsigned int *trial_len = malloc(njobs * sizeof(*trial_len));
+            rans_stripe_enc se = {
+                ctx, transposed, part_len, idx, order, allow, trial, trial_len
+            };
+            int err = !trial || !trial_len
+                || htscodecs_run_jobs(nthreads, njobs, rans_stripe_trial,
+                                      &se) < 0;
+
+            for (i = 0; !err && i < N; i++) {
+                unsigned int best_sz = UINT_MAX;
+                int best_j = -1;
+                for (j = 0; j < NSTRIPE_METHODS; j++) {
+                    if (best_sz > trial_len[i*NSTRIPE_METHODS + j]) {
+                        best_sz = trial_len[i*NSTRIPE_METHODS + j];
+                        best_j = j;
+                    }
+                }
+                if (best_j < 0 || best_sz > (size_t)(out_end - out2)) {
+                    err = 1;
+                    break;
+                }
+
+                memcpy(out2, trial[i*NSTRIPE_METHODS + best_j], best_sz);
+                out2 += best_sz;
+                c_meta_len += var_put_u32(out+c_meta_len, out_end, best_sz);
+            }
+
+            if (trial)
+                for (j = 0; j < njobs; j++)
+                    free(trial[j]);
+            free(trial);
+            free(trial_len);
+
+            if (err) {
+                rans_ctx_free(ctx, transposed);
+                free(out_free);
+                return NULL;
+            }
+        }
+
+        // Shared models are for whole blocks only, not STRIPE sub-streams.
+        int enc_model = ctx ? ctx->enc_model : -1;
+        if (ctx)
+            ctx->enc_model = -1;
+
+        for (i = 0; nthreads <= 1 && i < N; i++) {
             // Brute force try all methods.
             int j, m[] = {1,64,128,0}, best_j = 0, best_sz = in_size+10;
             for (j = 0; j < sizeof(m)/sizeof(*m); j++) {
-                if ((order & m[j]) != m[j])
+                if (!allow[i][j])
                     continue;
 
-                // order-1 *only*; bit check above cannot elide order-0
-                if ((order & RANS_ORDER_STRIPE_NO0) && (m[j]&1) == 0)
-                    continue;
                 olen2 = *out_size - (out2 - out);
-                rans_compress_to_4x16(transposed+idx[i], part_len[i],
-                                      out2, &olen2,
-                                      m[j] | RANS_ORDER_NOSZ
-                                      | (order&RANS_ORDER_X32));
+                rans_compress_to_4x16_int(ctx, transposed+idx[i],
+                                          part_len[i], out2, &olen2,
+                                          m[j] | RANS_ORDER_NOSZ
+                                          | (order&RANS_ORDER_X64), 1);
                 if (best_sz > olen2) {
                     best_sz = olen2;
                     best_j = j;
                     if (j < sizeof(m)/sizeof(*m) && olen2 > out_best_len) {
-                        unsigned char *tmp = realloc(out_best, olen2);
+                        unsigned char *tmp = ctx
+                            ? rans_ctx_alloc(ctx, RC_BEST, olen2)
+                            : realloc(out_best, olen2);
                         if (!tmp) {
+                            rans_ctx_free(ctx, out_best);
+                            rans_ctx_free(ctx, transposed);
+                            if (ctx)
+                                ctx->enc_model = enc_model;
                             free(out_free);
                             return NULL;
                         }
@@ -1254,11 +2857,12 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
             out2 += olen2;
             c_meta_len += var_put_u32(out+c_meta_len, out_end, olen2);
         }
-        if (out_best)
-            free(out_best);
+        if (ctx)
+            ctx->enc_model = enc_model;
+        rans_ctx_free(ctx, out_best);
 
         memmove(out+c_meta_len, out2_start, out2-out2_start);
-        free(transposed);
+        rans_ctx_free(ctx, transposed);
         *out_size = c_meta_len + out2-out2_start;
         return out;
     }
@@ -1275,7 +2879,14 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
     int do_pack = order & RANS_ORDER_PACK;
     int do_rle  = order & RANS_ORDER_RLE;
     int no_size = order & RANS_ORDER_NOSZ;
-    int do_simd = order & RANS_ORDER_X32;
+    int do_simd = (order & RANS_ORDER_X64) == RANS_ORDER_X64
+        ? X_64 : order & RANS_ORDER_X32;
+    int do_o2   = order & RANS_ORDER_O2;
+    if (do_o2)
+        order |= 1;
+
+    rans_model *model = ctx && ctx->enc_model >= 0 && !do_o2
+        ? ctx->model[ctx->enc_model] : NULL;
 
     out[0] = order;
     c_meta_len = 1;
@@ -1283,7 +2894,7 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
     if (!no_size)
         c_meta_len += var_put_u32(&out[1], out_end, in_size);
 
-    order &= 3;
+    order &= 1;
 
     // Format is compressed meta-data, compressed data.
     // Meta-data can be empty, pack, rle lengths, or pack + rle lengths.
@@ -1294,12 +2905,15 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
         // PACK 2, 4 or 8 symbols into one byte.
         int pmeta_len;
         uint64_t packed_len;
-        packed = hts_pack(in, in_size, out+c_meta_len, &pmeta_len, &packed_len);
+        packed = rans_ctx_alloc(ctx, RC_PACKED, (size_t)in_size+1);
+        if (packed && !hts_pack_to(in, in_size, out+c_meta_len, &pmeta_len,
+                                   packed, &packed_len)) {
+            rans_ctx_free(ctx, packed);
+            packed = NULL;
+        }
         if (!packed) {
             out[0] &= ~RANS_ORDER_PACK;
             do_pack = 0;
-            free(packed);
-            packed = NULL;
         } else {
             in = packed;
             in_size = packed_len;
@@ -1320,7 +2934,12 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
         unsigned int rmeta_len, c_rmeta_len;
         uint64_t rle_len;
         c_rmeta_len = in_size+257;
-        if (!(meta = malloc(c_rmeta_len))) {
+        meta = rans_ctx_alloc(ctx, RC_META, c_rmeta_len);
+        rle  = rans_ctx_alloc(ctx, RC_RLE, (size_t)in_size*2);
+        if (!meta || !rle) {
+            rans_ctx_free(ctx, meta);
+            rans_ctx_free(ctx, rle);
+            rans_ctx_free(ctx, packed);
             free(out_free);
             return NULL;
         }
@@ -1329,7 +2948,7 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
         int rle_nsyms = 0;
         uint64_t rmeta_len64;
         rle = hts_rle_encode(in, in_size, meta, &rmeta_len64,
-                             rle_syms, &rle_nsyms, NULL, &rle_len);
+                             rle_syms, &rle_nsyms, rle, &rle_len);
         memmove(meta+1+rle_nsyms, meta, rmeta_len64);
         meta[0] = rle_nsyms;
         memcpy(meta+1, rle_syms, rle_nsyms);
@@ -1339,14 +2958,15 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
             // Not worth the speed hit.
             out[0] &= ~RANS_ORDER_RLE;
             do_rle = 0;
-            free(rle);
+            rans_ctx_free(ctx, rle);
             rle = NULL;
         } else {
             // Compress lengths with O0 and literals with O0/O1 ("order" param)
             int sz = var_put_u32(out+c_meta_len, out_end, rmeta_len*2), sz2;
             sz += var_put_u32(out+c_meta_len+sz, out_end, rle_len);
             c_rmeta_len = *out_size - (c_meta_len+sz+5);
-            rans_enc_func(do_simd, 0)(meta, rmeta_len, out+c_meta_len+sz+5, &c_rmeta_len);
+            rans_enc_func(do_simd & X_32, 0, rans_ctx_cpu(ctx))
+                (meta, rmeta_len, out+c_meta_len+sz+5, &c_rmeta_len);
             if (c_rmeta_len < rmeta_len) {
                 sz2 = var_put_u32(out+c_meta_len+sz, out_end, c_rmeta_len);
                 memmove(out+c_meta_len+sz+sz2, out+c_meta_len+sz+5, c_rmeta_len);
@@ -1364,7 +2984,7 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
             in_size = rle_len;
         }
 
-        free(meta);
+        rans_ctx_free(ctx, meta);
     } else if (do_rle) {
         out[0] &= ~RANS_ORDER_RLE;
     }
@@ -1375,17 +2995,39 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
         order  &= ~1;
     }
 
-    rans_enc_func(do_simd, order)(in, in_size, out+c_meta_len, out_size);
+    if (model && model->order == order && in_size
+        && rans_model_covers(model, in, in_size)
+        && rans_compress_model_4x16(model, ctx->enc_model, in, in_size,
+                                    out+c_meta_len, out_size)) {
+        out[0] |= 1; // model blocks are flagged in the order-1 header
+    } else if (do_simd == X_64 && !(do_o2 && order)
+               && *out_size >= O1_FREQ_EXT_LEN+2) {
+        // As are 64-way ones, followed by the real order
+        const int hlen = O1_FREQ_EXT_LEN+2;
+        o1_freq_ext_put(out+c_meta_len);
+        out[c_meta_len+O1_FREQ_EXT_LEN]   = O1_FREQ_X64;
+        out[c_meta_len+O1_FREQ_EXT_LEN+1] = order;
+        out[0] |= 1;
+        *out_size -= hlen;
+        rans_enc_func(X_64, order, rans_ctx_cpu(ctx))
+            (in, in_size, out+c_meta_len+hlen, out_size);
+        *out_size += hlen;
+    } else {
+        // Order-2 has no 64-way variant, so uses 32-way instead
+        rans_enc_func(do_simd & X_32, do_o2 && order ? 2 : order,
+                      rans_ctx_cpu(ctx))
+            (in, in_size, out+c_meta_len, out_size);
+    }
 
     if (*out_size >= in_size) {
-        out[0] &= ~3;
+        out[0] &= ~1;
         out[0] |= RANS_ORDER_CAT | no_size;
         memcpy(out+c_meta_len, in, in_size);
         *out_size = in_size;
     }
 
-    free(rle);
-    free(packed);
+    rans_ctx_free(ctx, rle);
+    rans_ctx_free(ctx, packed);
 
     *out_size += c_meta_len;
 
@@ -1397,14 +3039,211 @@ unsigned char *rans_compress_4x16(unsigned char *in, unsigned int in_size,
     return rans_compress_to_4x16(in, in_size, NULL, out_size, order);
 }
 
+static
+unsigned char *rans_uncompress_to_4x16_int(rans_ctx *ctx,
+                                           unsigned char *in,
+                                           unsigned int in_size,
+                                           unsigned char *out,
+                                           unsigned int *out_size,
+                                           int nthreads);
+
+/*
+ * Decodes STRIPE sub-stream "job" into its slot of the transposed buffer.
+ * Each job works on a distinct part of the input and output, so these
+ * can be run in parallel.
+ */
+typedef struct {
+    rans_ctx *ctx;
+    unsigned char *in;
+    unsigned int in_size;
+    unsigned int *offN, *ulenN, *idxN;
+    unsigned char *outN;
+    int *err;
+} rans_stripe_dec;
+
+static void rans_stripe_decode(void *arg, int job) {
+    rans_stripe_dec *s = (rans_stripe_dec *)arg;
+    unsigned int olen = s->ulenN[job];
+    rans_ctx child, *c = rans_ctx_child(&child, s->ctx);
+
+    if (!rans_uncompress_to_4x16_int(c, s->in + s->offN[job],
+                                     s->in_size - s->offN[job],
+                                     s->outN + s->idxN[job], &olen, 1)
+        || olen != s->ulenN[job])
+        s->err[job] = 1;
+    rans_ctx_child_free(c);
+}
+
 unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
                                        unsigned char *out, unsigned int *out_size) {
+    return rans_uncompress_to_4x16_int(NULL, in, in_size, out, out_size, 1);
+}
+
+unsigned char *rans_uncompress_to_4x16_mt(unsigned char *in,
+                                          unsigned int in_size,
+                                          unsigned char *out,
+                                          unsigned int *out_size,
+                                          int nthreads) {
+    return rans_uncompress_to_4x16_int(NULL, in, in_size, out, out_size,
+                                       nthreads);
+}
+
+unsigned char *rans_uncompress_to_4x16_ctx(rans_ctx *ctx,
+                                           unsigned char *in,
+                                           unsigned int in_size,
+                                           unsigned char *out,
+                                           unsigned int *out_size) {
+    return rans_uncompress_to_4x16_int(ctx, in, in_size, out, out_size, 1);
+}
+
+unsigned char *rans_uncompress_to_4x16_ctx_mt(rans_ctx *ctx,
+                                              unsigned char *in,
+                                              unsigned int in_size,
+                                              unsigned char *out,
+                                              unsigned int *out_size,
+                                              int nthreads) {
+    return rans_uncompress_to_4x16_int(ctx, in, in_size, out, out_size,
+                                       nthreads);
+}
+
+uint64_t rans_compress_bound_4x16_64(uint64_t size, int order,
+                                     uint32_t seg_size) {
+    return htscodecs_seg_bound(size, seg_size, order,
+                               rans_compress_bound_4x16);
+}
+
+unsigned char *rans_compress_to_4x16_64(unsigned char *in, uint64_t in_size,
+                                        unsigned char *out,
+                                        uint64_t *out_size, int order,
+                                        uint32_t seg_size, int nthreads) {
+    return htscodecs_seg_compress(in, in_size, out, out_size, order,
+                                  seg_size, nthreads,
+                                  rans_compress_bound_4x16,
+                                  rans_compress_to_4x16);
+}
+
+unsigned char *rans_uncompress_to_4x16_64(unsigned char *in,
+                                          uint64_t in_size,
+                                          unsigned char *out,
+                                          uint64_t *out_size,
+                                          int nthreads) {
+    return htscodecs_seg_uncompress(in, in_size, out, out_size, nthreads,
+                                    rans_uncompress_to_4x16);
+}
+
+/*-----------------------------------------------------------------------------
+ * Batched compression of many small buffers.
+ *
+ * The jobs are divided into contiguous runs of roughly equal input size,
+ * one per thread.  Each run compresses its jobs in turn with a single
+ * rans_ctx, so scratch buffers are allocated once per run rather than
+ * per call, into bound sized slots of the arena.  The slots are then
+ * packed together in job order.
+ */
+typedef struct {
+    rans_batch_job *jobs;
+    int *first;     // run r is jobs first[r] to first[r+1]-1
+    size_t *off;    // arena offset of each job's slot
+    unsigned char *arena;
+} rans_batch;
+
+static void rans_batch_run(void *arg, int run) {
+    rans_batch *b = (rans_batch *)arg;
+    rans_ctx *ctx = rans_ctx_create(); // NULL is still usable
+    int i;
+
+    for (i = b->first[run]; i < b->first[run+1]; i++) {
+        rans_batch_job *j = &b->jobs[i];
+        unsigned int sz = b->off[i+1] - b->off[i];
+        j->out = rans_compress_to_4x16_int(ctx, j->in, j->in_size,
+                                           b->arena + b->off[i], &sz,
+                                           j->order, 1);
+        j->out_size = j->out ? sz : 0;
+    }
+
+    rans_ctx_destroy(ctx);
+}
+
+size_t rans_compress_batch_bound_4x16(rans_batch_job *jobs, int njobs) {
+    size_t sz = 0;
+    int i;
+    for (i = 0; i < njobs; i++)
+        sz += rans_compress_bound_4x16(jobs[i].in_size, jobs[i].order);
+    return sz;
+}
+
+int rans_compress_batch_4x16(rans_batch_job *jobs, int njobs,
+                             unsigned char *arena, size_t *arena_size,
+                             int nthreads) {
+    rans_batch b = {jobs, NULL, NULL, arena};
+    size_t total = 0, used = 0;
+    int i, r, nruns, ret = -1;
+
+    if (njobs <= 0) {
+        *arena_size = 0;
+        return njobs < 0 ? -1 : 0;
+    }
+
+    nruns = nthreads < 1 ? 1 : nthreads > njobs ? njobs : nthreads;
+    b.first = malloc((nruns+1) * sizeof(*b.first));
+    b.off = malloc((njobs+1) * sizeof(*b.off));
+    if (!b.first || !b.off)
+        goto err;
+
+    b.off[0] = 0;
+    for (i = 0; i < njobs; i++) {
+        b.off[i+1] = b.off[i]
+            + rans_compress_bound_4x16(jobs[i].in_size, jobs[i].order);
+        total += jobs[i].in_size;
+    }
+    if (b.off[njobs] > *arena_size)
+        goto err;
+
+    // Split into runs of about total/nruns input bytes
+    size_t acc = 0;
+    b.first[0] = 0;
+    for (i = 0, r = 1; i < njobs && r < nruns; i++) {
+        acc += jobs[i].in_size;
+        if (acc * nruns >= total * r)
+            b.first[r++] = i+1;
+    }
+    while (r <= nruns)
+        b.first[r++] = njobs;
+
+    if (htscodecs_run_jobs(nruns, nruns, rans_batch_run, &b) < 0)
+        goto err;
+
+    for (i = 0; i < njobs; i++) {
+        if (!jobs[i].out)
+            goto err;
+        memmove(arena + used, jobs[i].out, jobs[i].out_size);
+        jobs[i].out = arena + used;
+        used += jobs[i].out_size;
+    }
+    *arena_size = used;
+    ret = 0;
+
+ err:
+    free(b.first);
+    free(b.off);
+    return ret;
+}
+
+static
+unsigned char *rans_uncompress_to_4x16_int(rans_ctx *ctx,
+                                           unsigned char *in,
+                                           unsigned int in_size,
+                                           unsigned char *out,
+                                           unsigned int *out_size,
+                                           int nthreads) {
     unsigned char *in_end = in + in_size;
     unsigned char *out_free = NULL, *tmp_free = NULL, *meta_free = NULL;
 
     if (in_size == 0)
         return NULL;
 
+    rans_tune_init();
+
     if (*in & RANS_ORDER_STRIPE) {
         unsigned int ulen, olen, c_meta_len = 1;
         int i;
@@ -1458,22 +3297,43 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
         //fprintf(stderr, "    stripe meta %d\n", c_meta_len); //c-size
 
         // Uncompress the N streams
-        unsigned char *outN = malloc(ulen);
+        unsigned char *outN = rans_ctx_alloc(ctx, RC_UNSTRIPE, ulen);
         if (!outN) {
             free(out_free);
             return NULL;
         }
-        for (i = 0; i < N; i++) {
+        if (nthreads > 1) {
+            unsigned int offN[256];
+            int errN[256] = {0}, err = 0;
+            for (i = 0; i < N; i++) {
+                offN[i] = c_meta_len;
+                c_meta_len += clenN[i];
+            }
+            rans_stripe_dec sd = {ctx, in, in_size, offN, ulenN, idxN, outN,
+                                  errN};
+            if (htscodecs_run_jobs(nthreads, N, rans_stripe_decode, &sd) < 0)
+                err = 1;
+            for (i = 0; i < N; i++)
+                err |= errN[i];
+            if (err) {
+                free(out_free);
+                rans_ctx_free(ctx, outN);
+                return NULL;
+            }
+        }
+        for (i = 0; nthreads <= 1 && i < N; i++) {
             olen = ulenN[i];
             if (in_size < c_meta_len) {
                 free(out_free);
-                free(outN);
+                rans_ctx_free(ctx, outN);
                 return NULL;
             }
-            if (!rans_uncompress_to_4x16(in+c_meta_len, in_size-c_meta_len, outN + idxN[i], &olen)
+            if (!rans_uncompress_to_4x16_int(ctx, in+c_meta_len,
+                                             in_size-c_meta_len,
+                                             outN + idxN[i], &olen, 1)
                 || olen != ulenN[i]) {
                 free(out_free);
-                free(outN);
+                rans_ctx_free(ctx, outN);
                 return NULL;
             }
             c_meta_len += clenN[i];
@@ -1481,7 +3341,7 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
 
         unstripe(out, outN, ulen, N, idxN);
 
-        free(outN);
+        rans_ctx_free(ctx, outN);
         *out_size = ulen;
         return out;
     }
@@ -1550,30 +3410,6 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
     // Format is meta data (Pack and RLE in that order if present),
     // followed by rANS compressed data.
 
-    if (do_pack || do_rle) {
-        if (!(tmp = tmp_free = malloc(*out_size)))
-            goto err;
-        if (do_pack && do_rle) {
-            tmp1 = out;
-            tmp2 = tmp;
-            tmp3 = out;
-        } else if (do_pack) {
-            tmp1 = tmp;
-            tmp2 = tmp1;
-            tmp3 = out;
-        } else if (do_rle) {
-            tmp1 = tmp;
-            tmp2 = out;
-            tmp3 = out;
-        }
-    } else {
-        // neither
-        tmp  = NULL;
-        tmp1 = out;
-        tmp2 = out;
-        tmp3 = out;
-    }
-
     // Decode the bit-packing map.
     uint8_t map[16] = {0};
     int npacked_sym = 0;
@@ -1598,6 +3434,37 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
         tmp1_size = osz;
     }
 
+    // The 4-way order-0 and order-1 decoders can unpack as they decode,
+    // avoiding a pass through the temporary buffer.
+    int fuse_pack = do_pack && !do_rle && !do_cat && !do_simd
+        && (npacked_sym == 2 || npacked_sym == 4 || npacked_sym == 8)
+        && in_size && !(order && o1_freq_ext_get(in, in_size));
+
+    if ((do_pack && !fuse_pack) || do_rle) {
+        if (!(tmp = tmp_free = rans_ctx_alloc(ctx, RC_TMP, *out_size)))
+            goto err;
+        if (do_pack && do_rle) {
+            tmp1 = out;
+            tmp2 = tmp;
+            tmp3 = out;
+        } else if (do_pack) {
+            tmp1 = tmp;
+            tmp2 = tmp1;
+            tmp3 = out;
+        } else if (do_rle) {
+            tmp1 = tmp;
+            tmp2 = out;
+            tmp3 = out;
+        }
+    } else {
+        // neither
+        tmp  = NULL;
+        tmp1 = out;
+        tmp2 = out;
+        tmp3 = out;
+    }
+
+
     uint8_t *meta = NULL;
     uint32_t u_meta_size = 0;
     if (do_rle) {
@@ -1615,7 +3482,10 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
             sz += var_get_u32(in+sz, in_end, &c_meta_size);
             u_meta_size /= 2;
 
-            meta_free = meta = rans_dec_func(do_simd, 0)(in+sz, in_size-sz, NULL, u_meta_size);
+            if (!(meta_free = rans_ctx_alloc(ctx, RC_UMETA, u_meta_size)))
+                goto err;
+            meta = rans_dec_func(do_simd, 0, rans_ctx_cpu(ctx))
+                (in+sz, in_size-sz, meta_free, u_meta_size);
             if (!meta)
                 goto err;
         }
@@ -1627,6 +3497,10 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
     }
     //fprintf(stderr, "    meta_size %d bytes\n", (int)(in - orig_in)); //c-size
 
+    // Order-1 extensions, such as order-2 and 64-way, are flagged in the
+    // frequency table header.
+    int o1_ext = order && !do_cat ? o1_freq_ext_get(in, in_size) : 0;
+
     // uncompress RLE data.  in -> tmp1
     if (in_size) {
         if (do_cat) {
@@ -1636,8 +3510,40 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
             if (tmp1_size > *out_size)
                 goto err;
             memcpy(tmp1, in, tmp1_size);
+        } else if (o1_ext & O1_FREQ_MODEL) {
+            tmp1 = rans_uncompress_model_4x16(ctx, in, in_size,
+                                              tmp1, tmp1_size);
+            if (!tmp1)
+                goto err;
+        } else if (o1_ext & O1_FREQ_X64) {
+            const int hlen = O1_FREQ_EXT_LEN+2;
+            if (!do_simd || in_size < hlen || in[hlen-1] > 1)
+                goto err;
+            tmp1 = rans_dec_func(X_64, in[hlen-1], rans_ctx_cpu(ctx))
+                (in+hlen, in_size-hlen, tmp1, tmp1_size);
+            if (!tmp1)
+                goto err;
+        } else if (fuse_pack) {
+            rans_unpack_t u;
+            uint64_t umap[256];
+            uint8_t utail[8];
+            if ((unpacked_sz + npacked_sym-1) / npacked_sym > tmp1_size)
+                goto err;
+            rans_unpack_init(&u, umap, utail, map, npacked_sym, unpacked_sz);
+            tmp1 = order
+                ? rans_uncompress_O1_4x16_u(in, in_size, out, tmp1_size,
+                                            &u, npacked_sym)
+                : rans_uncompress_O0_4x16_u(in, in_size, out, tmp1_size,
+                                            &u, npacked_sym);
+            if (!tmp1)
+                goto err;
+            rans_unpack_finish(&u, out, unpacked_sz, npacked_sym);
+            tmp1_size = unpacked_sz;
         } else {
-            tmp1 = rans_dec_func(do_simd, order)(in, in_size, tmp1, tmp1_size);
+            // Order-2 is stored as order-1 with a frequency table flag
+            int o = (o1_ext & O1_FREQ_O2) ? 2 : order;
+            tmp1 = rans_dec_func(do_simd, o, rans_ctx_cpu(ctx))
+                (in, in_size, tmp1, tmp1_size);
             if (!tmp1)
                 goto err;
         }
@@ -1659,10 +3565,10 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
                             meta+1, rle_nsyms, tmp2, &unrle_size))
             goto err;
         tmp3_size = tmp2_size = unrle_size;
-        free(meta_free);
+        rans_ctx_free(ctx, meta_free);
         meta_free = NULL;
     }
-    if (do_pack) {
+    if (do_pack && !fuse_pack) {
         // Unpack bits via pack-map.  tmp2 -> tmp3
         if (npacked_sym == 1)
             unpacked_sz = tmp2_size;
@@ -1673,16 +3579,15 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
         tmp3_size = unpacked_sz;
     }
 
-    if (tmp)
-        free(tmp);
+    rans_ctx_free(ctx, tmp);
 
     *out_size = tmp3_size;
     return tmp3;
 
  err:
-    free(meta_free);
+    rans_ctx_free(ctx, meta_free);
     free(out_free);
-    free(tmp_free);
+    rans_ctx_free(ctx, tmp_free);
     return NULL;
 }
 
@@ -1690,3 +3595,257 @@ unsigned char *rans_uncompress_4x16(unsigned char *in, unsigned int in_size,
                                     unsigned int *out_size) {
     return rans_uncompress_to_4x16(in, in_size, NULL, out_size);
 }
+
+/*-----------------------------------------------------------------------------
+ * Incremental decoding.
+ *
+ * The N-way order-0 codecs interleave their states so symbol i is always
+ * decoded from state i%N, and renormalisation happens in output order.
+ * Hence a single symbol at a time decoder produces exactly the same output
+ * as the unrolled and SIMD variants, and can be paused at any point.
+ */
+
+// Packed bytes decoded per PACK refill.
+#define RDS_PBUF 4096
+
+struct rans_dec_stream {
+    unsigned int out_size;  // total uncompressed size
+    unsigned int out_pos;   // bytes returned so far
+
+    // Fallback for formats with no sequential decode order
+    unsigned char *full;
+
+    // Order-0 rANS or CAT source of (possibly packed) symbols
+    int do_cat;
+    unsigned char *cp, *cp_end;
+    unsigned int sym_pos, sym_size;
+    int nx;
+    RansState R[32];
+    uint32_t s3[TOTFREQ];
+
+    // PACK
+    int do_pack, npacked_sym;
+    uint8_t map[16];
+    unsigned int ub_pos, ub_len;
+    unsigned char pbuf[RDS_PBUF];
+    unsigned char ubuf[RDS_PBUF*8];
+};
+
+rans_dec_stream *rans_dec_stream_init(unsigned char *in, unsigned int in_size,
+                                      unsigned int out_size) {
+    unsigned char *in_end = in + in_size;
+    rans_dec_stream *s;
+
+    if (in_size == 0)
+        return NULL;
+
+    if (!(s = calloc(1, sizeof(*s))))
+        return NULL;
+
+    int order = *in;
+    if (order & (RANS_ORDER_STRIPE | RANS_ORDER_RLE | 1)) {
+        // No sequential decode order, so decode everything now
+        if ((order & (RANS_ORDER_STRIPE | RANS_ORDER_NOSZ))
+            == RANS_ORDER_NOSZ) {
+            if (!(s->full = malloc(out_size ? out_size : 1)))
+                goto err;
+        }
+        s->out_size = out_size;
+        unsigned char *out = rans_uncompress_to_4x16(in, in_size, s->full,
+                                                     &s->out_size);
+        if (!out)
+            goto err;
+        s->full = out;
+        return s;
+    }
+
+    in++; in_size--;
+    s->nx = order & RANS_ORDER_X32 ? 32 : 4;
+    s->do_cat  = order & RANS_ORDER_CAT;
+    s->do_pack = order & RANS_ORDER_PACK;
+
+    unsigned int osz;
+    if (!(order & RANS_ORDER_NOSZ)) {
+        int sz = var_get_u32(in, in_end, &osz);
+        in += sz;
+        in_size -= sz;
+    } else {
+        osz = out_size;
+    }
+
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+    if (osz > 100000)
+        goto err;
+#endif
+
+    if (osz >= INT_MAX)
+        goto err;
+    s->out_size = s->sym_size = osz;
+
+    if (s->do_pack) {
+        uint32_t c_meta_size = hts_unpack_meta(in, in_size, osz, s->map,
+                                               &s->npacked_sym);
+        if (c_meta_size == 0)
+            goto err;
+        in      += c_meta_size;
+        in_size -= c_meta_size;
+
+        unsigned int psz;
+        int sz = var_get_u32(in, in_end, &psz);
+        in += sz;
+        in_size -= sz;
+        if (psz > osz)
+            goto err;
+        s->sym_size = psz;
+
+        // Packed data must be sufficient for the unpacked length
+        switch (s->npacked_sym) {
+        case 1:
+            s->out_size = psz;
+            break;
+        case 2: case 4: case 8:
+            if ((osz + s->npacked_sym-1) / s->npacked_sym > psz)
+                goto err;
+            break;
+        }
+    }
+
+    if (!in_size) {
+        // Nothing entropy encoded, so only a constant PACK has any output
+        s->sym_size = 0;
+        if (!s->do_pack || s->npacked_sym == 1)
+            s->out_size = 0;
+        else if (s->npacked_sym != 0)
+            goto err;
+        return s;
+    }
+
+    s->cp = in;
+    s->cp_end = in_end;
+    if (s->do_cat) {
+        if (s->sym_size > in_size)
+            goto err;
+        return s;
+    }
+
+    uint32_t F[256] = {0}, fsum;
+    int fsz = decode_freq(s->cp, s->cp_end, F, &fsum);
+    if (!fsz)
+        goto err;
+    s->cp += fsz;
+
+    normalise_freq_shift(F, fsum, TOTFREQ);
+    if (rans_F_to_s3(F, TF_SHIFT, s->s3))
+        goto err;
+
+    int z;
+    if (s->cp_end - s->cp < s->nx * 4)
+        goto err;
+    for (z = 0; z < s->nx; z++) {
+        RansDecInit(&s->R[z], &s->cp);
+        if (s->R[z] < RANS_BYTE_L)
+            goto err;
+    }
+
+    return s;
+
+ err:
+    rans_dec_stream_destroy(s);
+    return NULL;
+}
+
+unsigned int rans_dec_stream_size(rans_dec_stream *s) {
+    return s->out_size;
+}
+
+// Fetches the next n rANS (or CAT) symbols into out.
+static void rans_dec_stream_syms(rans_dec_stream *s, unsigned char *out,
+                                 unsigned int n) {
+    if (s->do_cat) {
+        memcpy(out, s->cp + s->sym_pos, n);
+        s->sym_pos += n;
+        return;
+    }
+
+    const uint32_t mask = TOTFREQ-1;
+    unsigned int i, z = s->sym_pos & (s->nx-1);
+    RansState *R = s->R;
+    uint32_t *s3 = s->s3;
+    unsigned char *cp = s->cp;
+
+    for (i = 0; i < n; i++) {
+        uint32_t S = s3[R[z] & mask];
+        R[z] = (S>>(TF_SHIFT+8)) * (R[z] >> TF_SHIFT) + ((S>>8) & mask);
+        out[i] = S;
+        RansDecRenormSafe(&R[z], &cp, s->cp_end);
+        z = (z+1) & (s->nx-1);
+    }
+
+    s->cp = cp;
+    s->sym_pos += n;
+}
+
+int rans_dec_stream_read(rans_dec_stream *s, unsigned char *out,
+                         unsigned int len) {
+    if (len > s->out_size - s->out_pos)
+        len = s->out_size - s->out_pos;
+    if (len > INT_MAX)
+        len = INT_MAX;
+
+    if (s->full) {
+        memcpy(out, s->full + s->out_pos, len);
+        s->out_pos += len;
+        return len;
+    }
+
+    if (!s->do_pack || s->npacked_sym == 1) {
+        rans_dec_stream_syms(s, out, len);
+        s->out_pos += len;
+        return len;
+    }
+
+    if (s->npacked_sym == 0) {
+        memset(out, s->map[0], len);
+        s->out_pos += len;
+        return len;
+    }
+
+    // Unpack a buffer at a time, keeping any excess for the next call
+    unsigned int done = 0;
+    while (done < len) {
+        if (s->ub_pos == s->ub_len) {
+            unsigned int n = s->sym_size - s->sym_pos;
+            if (n == 0)
+                return -1;
+            if (n > RDS_PBUF)
+                n = RDS_PBUF;
+            uint64_t ulen = (uint64_t)n * s->npacked_sym;
+            uint64_t left = s->out_size - s->out_pos - done;
+            if (ulen > left)
+                ulen = left;
+            rans_dec_stream_syms(s, s->pbuf, n);
+            if (!hts_unpack(s->pbuf, n, s->ubuf, ulen, s->npacked_sym,
+                            s->map))
+                return -1;
+            s->ub_pos = 0;
+            s->ub_len = ulen;
+        }
+
+        unsigned int n = s->ub_len - s->ub_pos;
+        if (n > len - done)
+            n = len - done;
+        memcpy(out + done, s->ubuf + s->ub_pos, n);
+        s->ub_pos += n;
+        done += n;
+    }
+
+    s->out_pos += len;
+    return len;
+}
+
+void rans_dec_stream_destroy(rans_dec_stream *s) {
+    if (!s)
+        return;
+    free(s->full);
+    free(s);
+}
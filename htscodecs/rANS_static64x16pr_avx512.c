@@ -0,0 +1,712 @@
+/*
+ * Copyright (c) 2017-2023, 2026 Genome Research Ltd.
+ * Author(s): James Bonfield
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * This is an AVX512 implementation of the 64-way interleaved 16-bit rANS
+ * used by RANS_ORDER_X64.  It follows the 32-way AVX512 code closely, but
+ * with 4 vectors of 16 states instead of 2.  The extra independent
+ * vectors help hide the latency of the gathers, particularly in the
+ * order-1 decoder.
+ *
+ * Each step of 16 states is a separate inline function, called in turn
+ * for each vector.
+ */
+
+#include "config.h"
+
+#if defined(__x86_64__) && defined(HAVE_AVX512)
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <x86intrin.h>
+
+#include "rANS_word.h"
+#include "rANS_static4x16.h"
+#define ROT32_SIMD
+#include "rANS_static16_int.h"
+#include "varint.h"
+#include "utils.h"
+
+#define NX 64
+
+#define LOAD512(a,b)                                     \
+    __m512i a##1 = _mm512_load_si512((__m512i *)&b[0]);  \
+    __m512i a##2 = _mm512_load_si512((__m512i *)&b[16]); \
+    __m512i a##3 = _mm512_load_si512((__m512i *)&b[32]); \
+    __m512i a##4 = _mm512_load_si512((__m512i *)&b[48]);
+
+#define STORE512(a,b)                                   \
+    _mm512_store_si512((__m512i *)&b[0],  a##1);        \
+    _mm512_store_si512((__m512i *)&b[16], a##2);        \
+    _mm512_store_si512((__m512i *)&b[32], a##3);        \
+    _mm512_store_si512((__m512i *)&b[48], a##4);
+
+//-----------------------------------------------------------------------------
+// Encoding
+
+// q = mul_hi(R, rcp_freq) >> rcp_shift; R += bias + q * cmpl_freq;
+// SDv holds cmpl_freq in the bottom 16 bits and rcp_shift-32 in the top.
+static inline __m512i enc16_update(__m512i Rv, __m512i rfv, __m512i SDv,
+                                   __m512i biasv) {
+    __m512i rf_hm = _mm512_mul_epu32(_mm512_srli_epi64(Rv,  32),
+                                     _mm512_srli_epi64(rfv, 32));
+    __m512i rf_lm = _mm512_srli_epi64(_mm512_mul_epu32(Rv, rfv), 32);
+    rf_hm = _mm512_and_epi32(rf_hm,
+                             _mm512_set1_epi64((uint64_t)0xffffffff<<32));
+    rfv = _mm512_or_epi32(rf_lm, rf_hm);
+
+    __m512i qv = _mm512_srlv_epi32(rfv, _mm512_srli_epi32(SDv, 16));
+    qv = _mm512_mullo_epi32(qv, _mm512_and_si512(SDv,
+                                                 _mm512_set1_epi32(0xffff)));
+    return _mm512_add_epi32(Rv, _mm512_add_epi32(qv, biasv));
+}
+
+// Renormalise 16 states, writing the bottom 16-bits of those exceeding
+// xmax downwards from *ptr16 with the highest lane last.
+static inline __m512i enc16_renorm(__m512i Rv, __m512i xmax,
+                                   uint16_t **ptr16) {
+    __mmask16 gt_mask = _mm512_cmpgt_epi32_mask(Rv, xmax);
+    int pc = _mm_popcnt_u32(gt_mask);
+    __m512i Rp = _mm512_and_si512(Rv, _mm512_set1_epi32(0xffff));
+    Rp = _mm512_maskz_compress_epi32(gt_mask, Rp);
+    _mm512_mask_cvtepi32_storeu_epi16(*ptr16-pc, (1<<pc)-1, Rp);
+    *ptr16 -= pc;
+
+    return _mm512_mask_srli_epi32(Rv, gt_mask, Rv, 16);
+}
+
+// Order-0 step for the 16 states in Rv using symbols cv.
+static inline __m512i enc16_O0(__m512i Rv, __m512i cv, uint16_t **ptr16,
+                               uint32_t *SB, uint32_t *SA,
+                               uint32_t *SD, uint32_t *SC) {
+    Rv = enc16_renorm(Rv, _mm512_i32gather_epi32(cv, SB, 4), ptr16);
+    return enc16_update(Rv,
+                        _mm512_i32gather_epi32(cv, SA, 4),
+                        _mm512_i32gather_epi32(cv, SD, 4),
+                        _mm512_i32gather_epi32(cv, SC, 4));
+}
+
+unsigned char *rans_compress_O0_64x16_avx512(unsigned char *in,
+                                             unsigned int in_size,
+                                             unsigned char *out,
+                                             unsigned int *out_size) {
+    unsigned char *cp, *out_end;
+    RansEncSymbol syms[256];
+    RansState ransN[NX] __attribute__((aligned(64)));
+    uint8_t* ptr;
+    uint32_t F[256+MAGIC] = {0};
+    int i, j, tab_size = 0, x, z;
+    // -20 for order/size/meta
+    uint32_t bound = rans_compress_bound_4x16(in_size,0)-20;
+
+    if (!out) {
+        *out_size = bound;
+        out = malloc(*out_size);
+    }
+    if (!out || bound > *out_size)
+        return NULL;
+
+    // If "out" isn't word aligned, tweak out_end/ptr to ensure it is.
+    // We already added more round in bound to allow for this.
+    if (((size_t)out)&1)
+        bound--;
+    ptr = out_end = out + bound;
+
+    if (in_size == 0)
+        goto empty;
+
+    // Compute statistics
+    if (hist8(in, in_size, F) < 0)
+        return NULL;
+
+    // Normalise so frequences sum to power of 2
+    uint32_t fsum = in_size;
+    uint32_t max_val = round2(fsum);
+    if (max_val > TOTFREQ)
+        max_val = TOTFREQ;
+
+    if (normalise_freq(F, fsum, max_val) < 0)
+        return NULL;
+    fsum=max_val;
+
+    cp = out;
+    cp += encode_freq(cp, F);
+    tab_size = cp-out;
+
+    if (normalise_freq(F, fsum, TOTFREQ) < 0)
+        return NULL;
+
+    // Encode statistics and build lookup tables for SIMD encoding.
+    uint32_t SB[256], SA[256], SD[256], SC[256];
+    for (x = j = 0; j < 256; j++) {
+        if (F[j]) {
+            RansEncSymbolInit(&syms[j], x, F[j], TF_SHIFT);
+            SB[j] = syms[j].x_max;
+            SA[j] = syms[j].rcp_freq;
+            SD[j] = (syms[j].cmpl_freq<<0) | ((syms[j].rcp_shift-32)<<16);
+            SC[j] = syms[j].bias;
+            x += F[j];
+        }
+    }
+
+    for (z = 0; z < NX; z++)
+      RansEncInit(&ransN[z]);
+
+    z = i = in_size&(NX-1);
+    while (z-- > 0)
+      RansEncPutSymbol(&ransN[z], &ptr, &syms[in[in_size-(i-z)]]);
+
+    LOAD512(Rv, ransN);
+
+    uint16_t *ptr16 = (uint16_t *)ptr;
+    for (i=(in_size &~(NX-1)); i>0; i-=NX) {
+        uint8_t *c = &in[i-NX];
+
+        __m512i c1 = _mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i *)c));
+        __m512i c2 = _mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i *)(c+16)));
+        __m512i c3 = _mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i *)(c+32)));
+        __m512i c4 = _mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i *)(c+48)));
+
+        // Highest states first, as they're written to ptr16 first.
+        Rv4 = enc16_O0(Rv4, c4, &ptr16, SB, SA, SD, SC);
+        Rv3 = enc16_O0(Rv3, c3, &ptr16, SB, SA, SD, SC);
+        Rv2 = enc16_O0(Rv2, c2, &ptr16, SB, SA, SD, SC);
+        Rv1 = enc16_O0(Rv1, c1, &ptr16, SB, SA, SD, SC);
+    }
+    ptr = (uint8_t *)ptr16;
+    STORE512(Rv, ransN);
+
+    for (z = NX-1; z >= 0; z--)
+        RansEncFlush(&ransN[z], &ptr);
+
+ empty:
+    // Finalise block size and return it
+    *out_size = (out_end - ptr) + tab_size;
+
+    memmove(out + tab_size, ptr, out_end-ptr);
+
+    return out;
+}
+
+// Order-1 step for the 16 states in Rv.  vidx is the index of
+// syms[c][last] in 32-bit words.
+static inline __m512i enc16_O1(__m512i Rv, __m512i vidx, uint16_t **ptr16,
+                               RansEncSymbol (*syms)[256]) {
+    Rv = enc16_renorm(Rv, _mm512_i32gather_epi32(vidx, &syms[0][0].x_max, 4),
+                      ptr16);
+    __m512i SDv = _mm512_i32gather_epi32(vidx, &syms[0][0].cmpl_freq, 4);
+    SDv = _mm512_sub_epi32(SDv, _mm512_set1_epi32(32<<16));
+    return enc16_update(Rv,
+                        _mm512_i32gather_epi32(vidx, &syms[0][0].rcp_freq, 4),
+                        SDv,
+                        _mm512_i32gather_epi32(vidx, &syms[0][0].bias, 4));
+}
+
+unsigned char *rans_compress_O1_64x16_avx512(unsigned char *in,
+                                             unsigned int in_size,
+                                             unsigned char *out,
+                                             unsigned int *out_size) {
+    unsigned char *cp, *out_end, *out_free = NULL;
+    unsigned int tab_size;
+    uint32_t bound = rans_compress_bound_4x16(in_size,1)-20;
+    int z;
+    RansState ransN[NX] __attribute__((aligned(64)));
+
+    if (in_size < NX) // force O0 instead
+        return NULL;
+
+    if (!out) {
+        *out_size = bound;
+        out_free = out = malloc(*out_size);
+    }
+    if (!out || bound > *out_size)
+        return NULL;
+
+    if (((size_t)out)&1)
+        bound--;
+    out_end = out + bound;
+
+    RansEncSymbol (*syms)[256] = htscodecs_tls_alloc(256 * (sizeof(*syms)));
+    if (!syms) {
+        free(out_free);
+        return NULL;
+    }
+
+    cp = out;
+    int shift = encode_freq1(in, in_size, NX, syms, &cp);
+    if (shift < 0) {
+        free(out_free);
+        htscodecs_tls_free(syms);
+        return NULL;
+    }
+    tab_size = cp - out;
+
+    for (z = 0; z < NX; z++)
+      RansEncInit(&ransN[z]);
+
+    uint8_t* ptr = out_end;
+
+    int iN[NX], isz4 = in_size/NX, i;
+    for (z = 0; z < NX; z++)
+        iN[z] = (z+1)*isz4-2;
+
+    uint32_t lN[NX] __attribute__((aligned(64)));
+    for (z = 0; z < NX; z++)
+        lN[z] = in[iN[z]+1];
+
+    // Deal with the remainder
+    z = NX-1;
+    lN[z] = in[in_size-1];
+    for (iN[z] = in_size-2; iN[z] > NX*isz4-2; iN[z]--) {
+        unsigned char c = in[iN[z]];
+        RansEncPutSymbol(&ransN[z], &ptr, &syms[c][lN[z]]);
+        lN[z] = c;
+    }
+
+    // All lanes are now in step, with lane z at in[z*isz4 + i] and the
+    // previous symbol (the context) one beyond that.
+    LOAD512(Rv, ransN);
+    LOAD512(last, lN);
+
+    uint32_t iZ[NX] __attribute__((aligned(64)));
+    for (z = 0; z < NX; z++)
+        iZ[z] = z*isz4;
+    LOAD512(iv, iZ);
+
+    uint16_t *ptr16 = (uint16_t *)ptr;
+    for (i = isz4-2; i >= 0; i--) {
+        __m512i c1, c2, c3, c4;
+        if (i+3 < isz4) {
+            // Gather loads 32-bits, so this is only safe when we're
+            // not at the end of the buffer.
+            __m512i iv = _mm512_set1_epi32(i);
+            __m512i bot8 = _mm512_set1_epi32(0xff);
+            c1 = _mm512_and_si512(bot8, _mm512_i32gather_epi32(
+                                      _mm512_add_epi32(iv1, iv), in, 1));
+            c2 = _mm512_and_si512(bot8, _mm512_i32gather_epi32(
+                                      _mm512_add_epi32(iv2, iv), in, 1));
+            c3 = _mm512_and_si512(bot8, _mm512_i32gather_epi32(
+                                      _mm512_add_epi32(iv3, iv), in, 1));
+            c4 = _mm512_and_si512(bot8, _mm512_i32gather_epi32(
+                                      _mm512_add_epi32(iv4, iv), in, 1));
+        } else {
+            uint32_t cN[NX] __attribute__((aligned(64)));
+            for (z = 0; z < NX; z++)
+                cN[z] = in[iZ[z] + i];
+            c1 = _mm512_load_si512((__m512i *)&cN[0]);
+            c2 = _mm512_load_si512((__m512i *)&cN[16]);
+            c3 = _mm512_load_si512((__m512i *)&cN[32]);
+            c4 = _mm512_load_si512((__m512i *)&cN[48]);
+        }
+
+        // index into syms[c][last], in units of 32-bit words.
+#define VIDX(c,l) _mm512_slli_epi32(_mm512_add_epi32(_mm512_slli_epi32(c,8),l),2)
+        Rv4 = enc16_O1(Rv4, VIDX(c4, last4), &ptr16, syms);
+        Rv3 = enc16_O1(Rv3, VIDX(c3, last3), &ptr16, syms);
+        Rv2 = enc16_O1(Rv2, VIDX(c2, last2), &ptr16, syms);
+        Rv1 = enc16_O1(Rv1, VIDX(c1, last1), &ptr16, syms);
+#undef VIDX
+
+        last1 = c1;
+        last2 = c2;
+        last3 = c3;
+        last4 = c4;
+    }
+
+    STORE512(Rv, ransN);
+    STORE512(last, lN);
+
+    ptr = (uint8_t *)ptr16;
+
+    for (z = NX-1; z>=0; z--)
+        RansEncPutSymbol(&ransN[z], &ptr, &syms[0][lN[z]]);
+
+    for (z = NX-1; z >= 0; z--)
+        RansEncFlush(&ransN[z], &ptr);
+
+    // Finalise block size and return it
+    *out_size = (out_end - ptr) + tab_size;
+
+    memmove(out + tab_size, ptr, out_end-ptr);
+
+    htscodecs_tls_free(syms);
+    return out;
+}
+
+//-----------------------------------------------------------------------------
+// Decoding
+
+// Renormalise 16 states, reading from *sp
+static inline __m512i dec16_renorm(__m512i Rv, uint16_t **sp) {
+    __mmask16 renorm_mask = _mm512_cmplt_epu32_mask(Rv,
+                                _mm512_set1_epi32(RANS_BYTE_L));
+    __m512i renorm_words = _mm512_cvtepu16_epi32(
+                               _mm256_loadu_si256((const __m256i *)*sp));
+    *sp += _mm_popcnt_u32(renorm_mask);
+
+    __m512i renorm_vals = _mm512_maskz_expand_epi32(renorm_mask,
+                                                    renorm_words);
+    Rv = _mm512_mask_slli_epi32(Rv, renorm_mask, Rv, 16);
+    return _mm512_add_epi32(Rv, renorm_vals);
+}
+
+// R = f * (R >> TF_SHIFT) + b, for S = s3[R & mask];
+static inline __m512i dec16_O0(__m512i Rv, __m512i Sv, uint16_t **sp) {
+    __m512i maskv = _mm512_set1_epi32((1u << TF_SHIFT)-1);
+    __m512i fv = _mm512_srli_epi32(Sv, TF_SHIFT+8);
+    __m512i bv = _mm512_and_epi32(_mm512_srli_epi32(Sv, 8), maskv);
+
+    Rv = _mm512_add_epi32(
+             _mm512_mullo_epi32(_mm512_srli_epi32(Rv, TF_SHIFT), fv), bv);
+    return dec16_renorm(Rv, sp);
+}
+
+unsigned char *rans_uncompress_O0_64x16_avx512(unsigned char *in,
+                                               unsigned int in_size,
+                                               unsigned char *out,
+                                               unsigned int out_sz) {
+    if (in_size < NX*4) // 64-states at least
+        return NULL;
+
+    if (out_sz >= INT_MAX)
+        return NULL; // protect against some overflow cases
+
+    /* Load in the static tables */
+    unsigned char *cp = in, *out_free = NULL;
+    unsigned char *cp_end = in + in_size;
+    int i;
+    uint32_t s3[TOTFREQ]  __attribute__((aligned(64))); // For TF_SHIFT <= 12
+
+    if (!out)
+        out_free = out = malloc(out_sz);
+    if (!out)
+        return NULL;
+
+    // Precompute reverse lookup of frequency.
+    uint32_t F[256] = {0}, fsum;
+    int fsz = decode_freq(cp, cp_end, F, &fsum);
+    if (!fsz)
+        goto err;
+    cp += fsz;
+
+    normalise_freq_shift(F, fsum, TOTFREQ);
+
+    // Build symbols; fixme, do as part of decode, see the _d variant
+    if (rans_F_to_s3(F, TF_SHIFT, s3))
+        goto err;
+
+    if (cp_end - cp < NX * 4)
+        goto err;
+
+    int z;
+    RansState R[NX] __attribute__((aligned(64)));
+    for (z = 0; z < NX; z++) {
+        RansDecInit(&R[z], &cp);
+        if (R[z] < RANS_BYTE_L)
+            goto err;
+    }
+
+    uint16_t *sp = (uint16_t *)cp;
+
+    int out_end = (out_sz&~(NX-1));
+    const uint32_t mask = (1u << TF_SHIFT)-1;
+    __m512i maskv = _mm512_set1_epi32(mask);
+
+    LOAD512(Rv, R);
+
+    // As per the 32-way code, we gather S for the next loop at the end of
+    // the current one to hide some of the latency.
+#define GATHER(Rv) _mm512_i32gather_epi32(_mm512_and_epi32(Rv, maskv), \
+                                          (int *)s3, sizeof(*s3))
+    __m512i S1 = GATHER(Rv1);
+    __m512i S2 = GATHER(Rv2);
+    __m512i S3 = GATHER(Rv3);
+    __m512i S4 = GATHER(Rv4);
+
+    // Each loop reads at most 64 words, and loads a further 16 beyond that.
+    uint8_t overflow[2*NX*2+32] = {0};
+    for (i=0; i < out_end; i+=NX) {
+        // Protect against running off the end of in buffer.
+        // We copy it to a worst-case local buffer when near the end.
+        if ((uint8_t *)sp+2*NX+32 > cp_end) {
+            memmove(overflow, sp, cp_end - (uint8_t *)sp);
+            sp = (uint16_t *)overflow;
+            cp_end = overflow + sizeof(overflow);
+        }
+
+        Rv1 = dec16_O0(Rv1, S1, &sp);
+        Rv2 = dec16_O0(Rv2, S2, &sp);
+        Rv3 = dec16_O0(Rv3, S3, &sp);
+        Rv4 = dec16_O0(Rv4, S4, &sp);
+
+        _mm_storeu_si128((__m128i *)(out+i),    _mm512_cvtepi32_epi8(S1));
+        _mm_storeu_si128((__m128i *)(out+i+16), _mm512_cvtepi32_epi8(S2));
+        _mm_storeu_si128((__m128i *)(out+i+32), _mm512_cvtepi32_epi8(S3));
+        _mm_storeu_si128((__m128i *)(out+i+48), _mm512_cvtepi32_epi8(S4));
+
+        S1 = GATHER(Rv1);
+        S2 = GATHER(Rv2);
+        S3 = GATHER(Rv3);
+        S4 = GATHER(Rv4);
+    }
+#undef GATHER
+
+    STORE512(Rv, R);
+
+    for (z = out_sz & (NX-1); z-- > 0; )
+      out[out_end + z] = s3[R[z] & mask];
+
+    return out;
+
+ err:
+    free(out_free);
+    return NULL;
+}
+
+// Order-1 decode step for 16 states with context Lv, returning the new
+// states.  The decoded symbols (and next contexts) are returned in *Sv.
+static inline __m512i dec16_O1(__m512i Rv, __m512i *Lv, uint16_t **sp,
+                               uint32_t *s3, const int shift) {
+    __m512i maskv = _mm512_set1_epi32((1u << shift)-1);
+
+    //  S[z] = s3[lN[z]][R[z] & mask];
+    __m512i idx = _mm512_add_epi32(_mm512_and_si512(Rv, maskv),
+                                   _mm512_slli_epi32(*Lv, shift));
+    __m512i Sv = _mm512_i32gather_epi32(idx, (int *)s3, sizeof(*s3));
+
+    //  f[z] = S[z]>>(shift+8);
+    //  b[z] = (S[z]>>8) & mask;
+    __m512i fv = _mm512_srli_epi32(Sv, shift+8);
+    __m512i bv = _mm512_and_si512(_mm512_srli_epi32(Sv, 8), maskv);
+
+    if (shift == TF_SHIFT_O1) {
+        // A maximum frequency of 4096 doesn't fit in the s3 array and
+        // wraps to zero; see the 32-way code.
+        __mmask16 cmp = _mm512_cmpeq_epi32_mask(fv, _mm512_setzero_si512());
+        fv = _mm512_mask_blend_epi32(cmp, fv, _mm512_set1_epi32(TOTFREQ_O1));
+    }
+
+    //  R[z] = f[z] * (R[z] >> shift) + b[z];
+    Rv = _mm512_add_epi32(
+             _mm512_mullo_epi32(_mm512_srli_epi32(Rv, shift), fv), bv);
+
+    *Lv = _mm512_and_si512(Sv, _mm512_set1_epi32(0xff));
+    return dec16_renorm(Rv, sp);
+}
+
+// The SIMD order-1 main loop, for a given shift.
+// It decodes up to isz4 symbols per state, stopping early if we get near
+// the end of the input buffer.  Returns the updated sp.
+static inline uint16_t *dec_O1_loop(uint8_t *out, uint32_t *s3,
+                                    const int shift,
+                                    RansState R[NX], uint32_t lN[NX],
+                                    int iN[NX], int isz4,
+                                    uint16_t *sp, uint8_t *ptr_end) {
+    int z;
+    LOAD512(Rv, R);
+    LOAD512(Lv, lN);
+
+    // Transposition buffers for states 0-31 and 32-63.
+    union {
+        unsigned char tbuf[32][32];
+        uint64_t tbuf64[32][4];
+    } u1 __attribute__((aligned(32))), u2 __attribute__((aligned(32)));
+
+    unsigned int tidx = 0;
+
+    // SIMD version ends decoding early as it reads at most 160 bytes
+    // from input via 4 vectorised loads.
+    isz4 -= 64;
+    for (; iN[0] < isz4 && (uint8_t *)sp+4*NX < ptr_end; ) {
+        Rv1 = dec16_O1(Rv1, &Lv1, &sp, s3, shift);
+        Rv2 = dec16_O1(Rv2, &Lv2, &sp, s3, shift);
+        Rv3 = dec16_O1(Rv3, &Lv3, &sp, s3, shift);
+        Rv4 = dec16_O1(Rv4, &Lv4, &sp, s3, shift);
+
+        _mm_storeu_si128((__m128i *)(&u1.tbuf64[tidx][0]),
+                         _mm512_cvtepi32_epi8(Lv1));
+        _mm_storeu_si128((__m128i *)(&u1.tbuf64[tidx][2]),
+                         _mm512_cvtepi32_epi8(Lv2));
+        _mm_storeu_si128((__m128i *)(&u2.tbuf64[tidx][0]),
+                         _mm512_cvtepi32_epi8(Lv3));
+        _mm_storeu_si128((__m128i *)(&u2.tbuf64[tidx][2]),
+                         _mm512_cvtepi32_epi8(Lv4));
+
+        iN[0]++;
+        if (++tidx == 32) {
+            iN[0]-=32;
+
+            // We have tidx[x][y] which we want to store in memory in
+            // out[y][z] instead.  This is an unrolled transposition.
+            rot32_simd(u1.tbuf, out, iN);
+            rot32_simd(u2.tbuf, out, iN+32);
+            tidx = 0;
+        }
+    }
+
+    STORE512(Rv, R);
+    STORE512(Lv, lN);
+
+    iN[0]-=tidx;
+    int T;
+    for (z = 0; z < NX; z++)
+        for (T = 0; T < tidx; T++)
+            out[iN[z]++] = z < 32 ? u1.tbuf[T][z] : u2.tbuf[T][z-32];
+
+    return sp;
+}
+
+unsigned char *rans_uncompress_O1_64x16_avx512(unsigned char *in,
+                                               unsigned int in_size,
+                                               unsigned char *out,
+                                               unsigned int out_sz) {
+    if (in_size < NX*4) // 4-states at least
+        return NULL;
+
+    if (out_sz >= INT_MAX)
+        return NULL; // protect against some overflow cases
+
+    /* Load in the static tables */
+    unsigned char *cp = in, *cp_end = in+in_size, *out_free = NULL;
+    unsigned char *c_freq = NULL;
+
+    uint32_t (*s3)[TOTFREQ_O1] = htscodecs_tls_alloc(256*TOTFREQ_O1*4);
+    if (!s3)
+        return NULL;
+    uint32_t (*s3F)[TOTFREQ_O1_FAST] = (uint32_t (*)[TOTFREQ_O1_FAST])s3;
+
+    if (!out)
+        out_free = out = malloc(out_sz);
+
+    if (!out)
+        goto err;
+
+    // compressed header? If so uncompress it
+    unsigned char *tab_end = NULL;
+    unsigned char *c_freq_end = cp_end;
+    unsigned int shift = *cp >> 4;
+    if (*cp++ & 1) {
+        uint32_t u_freq_sz, c_freq_sz;
+        cp += var_get_u32(cp, cp_end, &u_freq_sz);
+        cp += var_get_u32(cp, cp_end, &c_freq_sz);
+        if (c_freq_sz > cp_end - cp)
+            goto err;
+        tab_end = cp + c_freq_sz;
+        if (!(c_freq = rans_uncompress_O0_4x16(cp, c_freq_sz, NULL,
+                                               u_freq_sz)))
+            goto err;
+        cp = c_freq;
+        c_freq_end = c_freq + u_freq_sz;
+    }
+
+    // Decode order-0 symbol list; avoids needing in order-1 tables
+    cp += decode_freq1(cp, c_freq_end, shift, s3, s3F, NULL, NULL);
+
+    if (tab_end)
+        cp = tab_end;
+    free(c_freq);
+    c_freq = NULL;
+
+    if (cp_end - cp < NX * 4)
+        goto err;
+
+    RansState R[NX] __attribute__((aligned(64)));
+    uint8_t *ptr = cp, *ptr_end = in + in_size;
+    int z;
+    for (z = 0; z < NX; z++) {
+        RansDecInit(&R[z], &ptr);
+        if (R[z] < RANS_BYTE_L)
+            goto err;
+    }
+
+    int isz4 = out_sz/NX;
+    int iN[NX];
+    uint32_t lN[NX] __attribute__((aligned(64))) = {0};
+    for (z = 0; z < NX; z++)
+        iN[z] = z*isz4;
+
+    // Constant shifts, so the compiler can specialise both variants.
+    uint16_t *sp = (uint16_t *)ptr;
+    if (shift == TF_SHIFT_O1)
+        sp = dec_O1_loop(out, &s3[0][0], TF_SHIFT_O1, R, lN, iN, isz4,
+                         sp, ptr_end);
+    else
+        sp = dec_O1_loop(out, &s3F[0][0], TF_SHIFT_O1_FAST, R, lN, iN, isz4,
+                         sp, ptr_end);
+    ptr = (uint8_t *)sp;
+
+    // Scalar version for close to the end of in[] array so we don't
+    // do SIMD loads beyond the end of the buffer, plus the remainder.
+    const uint32_t mask = (1u << shift)-1;
+    uint32_t *S3 = &s3[0][0]; // either s3 or s3F, indexed via shift
+    for (; iN[0] < isz4;) {
+        for (z = 0; z < NX; z++) {
+            uint32_t S = S3[(lN[z]<<shift) + (R[z] & mask)];
+            unsigned char c = S & 0xff;
+            out[iN[z]++] = c;
+            uint32_t F = S>>(shift+8);
+            R[z] = (F?F:4096) * (R[z]>>shift) + ((S>>8) & mask);
+            RansDecRenormSafe(&R[z], &ptr, ptr_end);
+            lN[z] = c;
+        }
+    }
+
+    z = NX-1;
+    for (; iN[z] < out_sz; ) {
+        uint32_t S = S3[(lN[z]<<shift) + (R[z] & mask)];
+        unsigned char c = S & 0xff;
+        out[iN[z]++] = c;
+        uint32_t F = S>>(shift+8);
+        R[z] = (F?F:4096) * (R[z]>>shift) + ((S>>8) & mask);
+        RansDecRenormSafe(&R[z], &ptr, ptr_end);
+        lN[z] = c;
+    }
+
+    htscodecs_tls_free(s3);
+    return out;
+
+ err:
+    htscodecs_tls_free(s3);
+    free(out_free);
+    free(c_freq);
+
+    return NULL;
+}
+#else  // HAVE_AVX512
+// Prevent "empty translation unit" errors when building without AVX512
+const char *rANS_static64x16pr_avx512_disabled = "No AVX512";
+#endif // HAVE_AVX512
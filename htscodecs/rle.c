@@ -163,22 +163,33 @@ uint8_t *hts_rle_decode(uint8_t *lit, uint64_t lit_len,
         if (outp >= out_end)
             goto err;
 
-        uint8_t b = *lit;
-        if (saved[b]) {
-            uint32_t rlen;
+        uint8_t b = *lit++;
+        if (!saved[b]) {
+            *outp++ = b;
+            continue;
+        }
+
+        // Most runs fit in a single varint byte
+        uint32_t rlen;
+        if (run < run_end && *run < 128)
+            rlen = *run++;
+        else
             run += var_get_u32(run, run_end, &rlen);
-            if (rlen) {
-                if (outp + rlen >= out_end)
-                    goto err;
-                memset(outp, b, rlen+1);
-                outp += rlen+1;
-            } else {
-                *outp++ = b;
-            }
+
+        if (rlen >= out_end - outp)
+            goto err;
+
+        // Short runs are written as two 8-byte stores instead of a memset
+        // call.  This may overwrite bytes beyond the run, but never beyond
+        // out_end, and they will be replaced by subsequent output.
+        if (rlen < 16 && out_end - outp >= 16) {
+            uint64_t w = b * 0x0101010101010101ULL;
+            memcpy(outp,   &w, 8);
+            memcpy(outp+8, &w, 8);
         } else {
-            *outp++ = b;
+            memset(outp, b, rlen+1);
         }
-        lit++;
+        outp += rlen+1;
     }
 
     *out_len = outp-out;
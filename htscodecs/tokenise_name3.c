@@ -1247,9 +1247,10 @@ static int compress(uint8_t *in, uint64_t in_len, enum name_type type,
     uint64_t best_sz = UINT64_MAX;
     uint64_t olen = *out_len;
     int ret = -1;
+    int est = level & TOK3_LEVEL_EST;
 
     // Map levels 1-9 to 0-4, for parameter lookup in R[] below
-    level = (level-1)/2;
+    level = ((level & ~TOK3_LEVEL_EST)-1)/2;
     if (level<0) level=0;
     if (level>4) level=4;
 
@@ -1341,16 +1342,30 @@ static int compress(uint8_t *in, uint64_t in_len, enum name_type type,
 
     int *meth = R[level][type];
 
-    int last = 0, m;
-    uint8_t best_static[8192];
-    uint8_t *best_dat = best_static;
-    for (m = 1; m <= meth[0]; m++) {
-        *out_len = olen;
+    // With TOK3_LEVEL_EST, -5 and -7 only trial the best "topk[level]"
+    // methods, as ranked by their estimated compressed sizes.  Zero tries
+    // them all.
+    static const int topk[5] = {0, 0, 1, 2, 0};
+    int k = est ? topk[level] : 0, sel[7], m;
 
+    for (m = 1; m <= meth[0]; m++) {
         if (!use_arith && (meth[m] & 4))
             meth[m] &= ~4;
 
         if (in_len % 4 != 0 && (meth[m] & 8))
+            meth[m] = -1;
+    }
+
+    if (k && htscodecs_pick_methods(in, in_len, meth+1, meth[0], k, sel) < 0)
+        k = 0;
+
+    int last = 0;
+    uint8_t best_static[8192];
+    uint8_t *best_dat = best_static;
+    for (m = 1; m <= meth[0]; m++) {
+        *out_len = olen;
+
+        if (meth[m] < 0 || (k && !sel[m-1]))
             continue;
 
         last = 0;
@@ -1358,7 +1373,8 @@ static int compress(uint8_t *in, uint64_t in_len, enum name_type type,
             if (arith_encode(in, in_len, out, out_len, meth[m]) <0)
                 goto err;
         } else {
-            if (rans_encode(in, in_len, out, out_len, meth[m]) < 0)
+            int est = k ? RANS_ORDER_STRIPE_EST_K(k) : 0;
+            if (rans_encode(in, in_len, out, out_len, meth[m] | est) < 0)
                 goto err;
         }
 
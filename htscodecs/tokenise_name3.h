@@ -44,9 +44,14 @@ extern "C" {
  * Use the "last_start_p" return value to identify the partial line start
  * offset, for continuation purposes.
  *
+ * Adding TOK3_LEVEL_EST to level makes -5 and -7 trial only the most
+ * promising methods per token stream, as ranked by htscodecs_pick_methods,
+ * instead of all of them.  This is faster but may compress less well.
+ *
  * Returns a malloced buffer holding compressed data of size *out_len,
  *         or NULL on failure
  */
+#define TOK3_LEVEL_EST (1<<8)
 uint8_t *tok3_encode_names(char *blk, int len, int level, int use_arith,
                            int *out_len, int *last_start_p);
 
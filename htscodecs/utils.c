@@ -37,8 +37,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
 
 #include "utils.h"
+#include "pack.h"
+#include "varint.h"
 
 #ifndef NO_THREADS
 #include <pthread.h>
@@ -232,3 +235,580 @@ void htscodecs_tls_free(void *ptr) {
     free(ptr);
 }
 #endif
+
+#ifndef NO_THREADS
+/*
+ * A minimal work queue for htscodecs_run_jobs.  We don't keep persistent
+ * worker threads; these are only used for large blocks where the cost of
+ * thread creation is small compared to the work being done.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    int next_job, njobs;
+    void (*func)(void *arg, int job);
+    void *arg;
+} job_queue;
+
+static void *htscodecs_job_worker(void *vp) {
+    job_queue *q = (job_queue *)vp;
+
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        int job = q->next_job < q->njobs ? q->next_job++ : -1;
+        pthread_mutex_unlock(&q->lock);
+
+        if (job < 0)
+            break;
+        q->func(q->arg, job);
+    }
+
+    return NULL;
+}
+
+int htscodecs_run_jobs(int nthreads, int njobs,
+                       void (*func)(void *arg, int job), void *arg) {
+    int i;
+
+    if (nthreads > njobs)
+        nthreads = njobs;
+
+    if (nthreads <= 1) {
+        for (i = 0; i < njobs; i++)
+            func(arg, i);
+        return 0;
+    }
+
+    job_queue q;
+    if (pthread_mutex_init(&q.lock, NULL) != 0)
+        return -1;
+    q.next_job = 0;
+    q.njobs = njobs;
+    q.func = func;
+    q.arg = arg;
+
+    // The calling thread is also a worker, so we only start nthreads-1.
+    pthread_t *tid = malloc((nthreads-1) * sizeof(*tid));
+    int nstarted = 0;
+    if (tid) {
+        for (nstarted = 0; nstarted < nthreads-1; nstarted++)
+            if (pthread_create(&tid[nstarted], NULL,
+                               htscodecs_job_worker, &q) != 0)
+                break;
+    }
+
+    // Any jobs not picked up by failed thread starts are run here.
+    htscodecs_job_worker(&q);
+
+    for (i = 0; i < nstarted; i++)
+        pthread_join(tid[i], NULL);
+
+    free(tid);
+    pthread_mutex_destroy(&q.lock);
+
+    return 0;
+}
+
+#else
+int htscodecs_run_jobs(int nthreads, int njobs,
+                       void (*func)(void *arg, int job), void *arg) {
+    int i;
+    for (i = 0; i < njobs; i++)
+        func(arg, i);
+    return 0;
+}
+#endif
+
+/*-----------------------------------------------------------------------------
+ * Compressed size estimation, so we can choose between methods without
+ * trial compressing the data with each of them.
+ *
+ * These are deliberately crude, particularly the costs of storing the
+ * static frequency tables, but it is only the relative ordering of the
+ * methods that matters.
+ */
+#define EST_LN2 0.6931471805599453
+
+// Static frequency table costs in bytes, for order-0 and order-1.
+#define EST_TAB0(nsym)        (2.0*(nsym))
+#define EST_TAB1(npair, nsym) (1.5*(npair) + 2.0*(nsym))
+
+// rANS states, or arithmetic coder flush
+#define EST_STATE 16
+
+typedef struct {
+    unsigned int n;             // input size
+    int nsym;                   // alphabet size
+    uint32_t npair;             // non-zero order-1 frequencies
+    double e0, e1;              // order-0 and order-1 entropy, in bits
+
+    // RLE applied to the input
+    int nrle;                   // number of symbols with run-lengths
+    unsigned int nlit, nrun;    // number of literals and run lengths
+    uint32_t npair_rle;
+    double e0_rle, e1_rle;      // order-0 and order-1 literal entropy
+    double run_bits;            // bits to store run-lengths
+} est_stats;
+
+// Returns the entropy in bits of T samples counted in F[], visiting
+// only the nsym symbols listed in sym[].  If non-NULL, *nz is set to the
+// number of non-zero entries.
+static double est_entropy(uint32_t *F, uint32_t T, uint8_t *sym, int nsym,
+                          int *nz) {
+    double e = 0, lT = fast_log(T);
+    int i, z = 0;
+
+    for (i = 0; i < nsym; i++) {
+        uint32_t f = F[sym[i]];
+        if (!f)
+            continue;
+        e += f * (lT - fast_log(f));
+        z++;
+    }
+
+    if (nz)
+        *nz = z;
+    return e > 0 ? e / EST_LN2 : 0;
+}
+
+// Computes order-0 and RLE statistics, plus order-1 if need_o1 is set.
+static int est_stats_init(unsigned char *in, unsigned int n, est_stats *st,
+                          int need_o1) {
+    uint32_t F0[256+MAGIC] = {0}, R[256+MAGIC] = {0}, L0[256];
+    uint8_t sym[256];
+    int nsym = 0;
+    unsigned int i;
+
+    memset(st, 0, sizeof(*st));
+    st->n = n;
+    if (!n)
+        return 0;
+
+    if (hist8(in, n, F0) < 0)
+        return -1;
+    for (i = 0; i < 256; i++)
+        if (F0[i])
+            sym[nsym++] = i;
+    st->nsym = nsym;
+    st->e0 = est_entropy(F0, n, sym, nsym, NULL);
+
+    // Repeats of each symbol, for RLE.  This is the order-1 F1[c][c].
+    for (i = 1; i < n; i++)
+        R[in[i]] += in[i] == in[i-1];
+
+    // Using the same symbol selection as hts_rle_encode.
+    unsigned int nrep = 0;
+    for (i = 0; i < nsym; i++) {
+        int c = sym[i];
+        L0[c] = F0[c];
+        if (2*R[c] > F0[c]) {
+            st->nrle++;
+            L0[c] -= R[c];
+            nrep += R[c];
+            st->nrun += L0[c];
+        }
+    }
+    st->nlit = n - nrep;
+    if (st->nlit)
+        st->e0_rle = est_entropy(L0, st->nlit, sym, nsym, NULL);
+    if (st->nrun)
+        st->run_bits = st->nrun *
+            (fast_log(1 + (double)nrep / st->nrun) / EST_LN2 + 1);
+
+    if (!need_o1)
+        return 0;
+
+    // One pass for the order-1 histogram, only clearing the rows we use.
+    uint32_t (*F1)[256] = htscodecs_tls_alloc(256 * sizeof(*F1));
+    if (!F1)
+        return -1;
+    for (i = 0; i < nsym; i++)
+        memset(F1[sym[i]], 0, sizeof(*F1));
+    for (i = 1; i < n; i++)
+        F1[in[i-1]][in[i]]++;
+
+    // Order-1 entropy per context.  The RLE literals lose the repeats
+    // R[c], which we adjust for without another pass over the row.
+    for (i = 0; i < nsym; i++) {
+        int c = sym[i], nz;
+        uint32_t T = F0[c] - (in[n-1] == c);
+        if (!T)
+            continue;
+
+        double e = est_entropy(F1[c], T, sym, nsym, &nz);
+        st->e1 += e;
+        st->npair += nz;
+
+        uint32_t r = R[c];
+        if (2*r > F0[c]) {
+            if (T > r) {
+                double lT = fast_log(T), lR = fast_log(T - r);
+                e += ((T - r) * (lR - lT) - (double)r * (lT - fast_log(r)))
+                    / EST_LN2;
+                nz--;
+            } else {
+                e = nz = 0;
+            }
+        }
+        st->e1_rle += e > 0 ? e : 0;
+        st->npair_rle += nz;
+    }
+
+    htscodecs_tls_free(F1);
+    return 0;
+}
+
+// Size of entropy encoding with the given order, capped at the input
+// length as the encoders fall back to storing raw data.
+static double est_order(int order, double e0, double e1, int nsym,
+                        uint32_t npair, unsigned int n) {
+    double c = order
+        ? e1/8 + EST_TAB1(npair, nsym) + EST_STATE
+        : e0/8 + EST_TAB0(nsym) + EST_STATE;
+    return c < n ? c : n;
+}
+
+// Estimated size of the entropy encoded data plus RLE meta-data.
+static double est_rle(est_stats *st, int order, int do_rle) {
+    double c = est_order(order, st->e0, st->e1, st->nsym, st->npair, st->n);
+
+    // The encoders abandon RLE if it doesn't remove at least 1%.
+    if (!do_rle || !st->nrle || st->nlit + st->nrun >= .99*st->n)
+        return c;
+
+    double runs = st->run_bits/8 + EST_TAB0(16) + EST_STATE;
+    if (runs > st->nrun * 1.1)
+        runs = st->nrun * 1.1;
+
+    return est_order(order, st->e0_rle, st->e1_rle, st->nsym,
+                     st->npair_rle, st->nlit)
+        + runs + st->nrle + 3;
+}
+
+// Estimated size of N interleaved streams, each compressed separately.
+// Sub-streams are estimated as the better of order-0 or PACK.
+static double est_stripe(unsigned char *in, unsigned int n, int N) {
+    uint32_t (*F)[256] = calloc(N, sizeof(*F));
+    unsigned int i, j;
+    double c = 3 + 2*N;
+
+    if (!F)
+        return -1;
+
+    for (i = 0; i + N <= n; i += N)
+        for (j = 0; j < N; j++)
+            F[j][in[i+j]]++;
+    for (j = 0; i < n; i++, j++)
+        F[j][in[i]]++;
+
+    for (j = 0; j < N; j++) {
+        unsigned int nj = n / N + ((n % N) > j);
+        if (!nj)
+            continue;
+
+        uint8_t sym[256];
+        int nsym = 0, s;
+        for (s = 0; s < 256; s++)
+            if (F[j][s])
+                sym[nsym++] = s;
+        double e = est_entropy(F[j], nj, sym, nsym, NULL);
+        double cj = est_order(0, e, 0, nsym, 0, nj);
+
+        if (nsym <= 16) {
+            int k = nsym <= 1 ? 0 : nsym <= 2 ? 8 : nsym <= 4 ? 4 : 2;
+            double cp = k ? (nj + k-1) / k : 0;
+            if (cj > cp + nsym + 1)
+                cj = cp + nsym + 1;
+        }
+        c += cj + 1;
+    }
+
+    free(F);
+    return c;
+}
+
+int htscodecs_est_methods(unsigned char *in, unsigned int in_size,
+                          const int *meth, int nmeth, double *est) {
+    est_stats st, pst;
+    int i, have_pst = 0, pmeta_len = 0, o1 = 0, po1 = 0;
+
+    // Order-1 statistics are the costliest part, so only gather if needed.
+    // PACK methods also need them unpacked, in case there are >16 symbols.
+    for (i = 0; i < nmeth; i++) {
+        if ((meth[i] & 0x0f) == 0x01)
+            o1 = 1;
+        if ((meth[i] & 0x8f) == 0x81)
+            po1 = 1;
+    }
+
+    if (est_stats_init(in, in_size, &st, o1) < 0)
+        return -1;
+
+    for (i = 0; i < nmeth; i++) {
+        int m = meth[i];
+        if (in_size <= 20)
+            m &= ~0x08; // too small to STRIPE
+
+        if (m & 0x06) {
+            // X32, external codecs, etc.
+            est[i] = -1;
+            continue;
+        } else if (m & 0x20) {
+            // CAT
+            est[i] = in_size;
+        } else if (m & 0x08) {
+            int N = (m >> 8) & 0xff;
+            if ((est[i] = est_stripe(in, in_size, N ? N : 4)) < 0)
+                return -1;
+        } else if ((m & 0x80) && st.nsym <= 16) {
+            // Packing is cheap compared to modelling the packed data
+            if (!have_pst) {
+                uint8_t pmeta[17];
+                uint64_t plen;
+                uint8_t *p = hts_pack(in, in_size, pmeta, &pmeta_len, &plen);
+                if (!p || est_stats_init(p, plen, &pst, po1) < 0) {
+                    free(p);
+                    return -1;
+                }
+                free(p);
+                have_pst = 1;
+            }
+            est[i] = est_rle(&pst, m & 1, m & 0x40) + pmeta_len + 3;
+        } else {
+            est[i] = est_rle(&st, m & 1, m & 0x40);
+        }
+
+        // order byte and size
+        est[i] += 3;
+    }
+
+    return 0;
+}
+
+int htscodecs_pick_methods(unsigned char *in, unsigned int in_size,
+                           const int *meth, int nmeth, int k, int *sel) {
+    double est_s[64], *est = nmeth <= 64
+        ? est_s : malloc(nmeth * sizeof(*est));
+    int i, j, nsel = 0;
+
+    if (!est)
+        return -1;
+    if (htscodecs_est_methods(in, in_size, meth, nmeth, est) < 0) {
+        if (est != est_s)
+            free(est);
+        return -1;
+    }
+
+    if (k < 1)
+        k = 1;
+
+    // Unknowns are always picked, then the best k in order, with ties
+    // going to the earliest method.
+    for (i = 0; i < nmeth; i++) {
+        sel[i] = est[i] < 0;
+        nsel += sel[i];
+    }
+    for (j = 0; j < k; j++) {
+        int best = -1;
+        for (i = 0; i < nmeth; i++) {
+            if (sel[i] || est[i] < 0)
+                continue;
+            if (best < 0 || est[best] > est[i])
+                best = i;
+        }
+        if (best < 0)
+            break;
+        sel[best] = 1;
+        nsel++;
+    }
+
+    if (est != est_s)
+        free(est);
+    return nsel;
+}
+
+/*-----------------------------------------------------------------------------
+ * Segmented coding of large inputs; see utils.h for the format.
+ */
+#define SEG_DEFAULT (1u<<28)
+#define SEG_MAX     (1u<<30)
+
+typedef struct {
+    unsigned char *in, *out;
+    uint64_t in_size;
+    uint32_t seg_size;
+    uint64_t *off;        // offset of each compressed segment
+    unsigned int *clen;   // compressed segment sizes, or 0 on failure
+    int order;
+    htscodecs_enc_func enc;
+    htscodecs_dec_func dec;
+} seg_job;
+
+static unsigned int seg_len(seg_job *s, int job) {
+    uint64_t start = (uint64_t)job * s->seg_size;
+    return s->in_size - start < s->seg_size ? s->in_size - start : s->seg_size;
+}
+
+static void seg_enc_job(void *arg, int job) {
+    seg_job *s = (seg_job *)arg;
+    if (!s->enc(s->in + (uint64_t)job * s->seg_size, seg_len(s, job),
+                s->out + s->off[job], &s->clen[job], s->order))
+        s->clen[job] = 0;
+}
+
+static void seg_dec_job(void *arg, int job) {
+    seg_job *s = (seg_job *)arg;
+    unsigned int len = seg_len(s, job);
+    if (!s->dec(s->in + s->off[job], s->clen[job],
+                s->out + (uint64_t)job * s->seg_size, &len)
+        || len != seg_len(s, job))
+        s->clen[job] = 0;
+}
+
+uint64_t htscodecs_seg_bound(uint64_t size, uint32_t seg_size, int order,
+                             unsigned int (*bound)(unsigned int size,
+                                                   int order)) {
+    if (!seg_size)
+        seg_size = SEG_DEFAULT;
+    if (seg_size > SEG_MAX)
+        return 0;
+
+    uint64_t nseg = (size + seg_size-1) / seg_size;
+    uint64_t sz = 10 + 5 + 5*nseg;
+    if (nseg)
+        sz += (nseg-1) * bound(seg_size, order)
+            + bound(size - (nseg-1)*seg_size, order);
+    return sz;
+}
+
+unsigned char *htscodecs_seg_compress(unsigned char *in, uint64_t in_size,
+                                      unsigned char *out, uint64_t *out_size,
+                                      int order, uint32_t seg_size,
+                                      int nthreads,
+                                      unsigned int (*bound)(unsigned int size,
+                                                            int order),
+                                      htscodecs_enc_func enc) {
+    if (!seg_size)
+        seg_size = SEG_DEFAULT;
+    if (seg_size > SEG_MAX)
+        return NULL;
+
+    uint64_t nseg = (in_size + seg_size-1) / seg_size, i;
+    uint64_t bnd = htscodecs_seg_bound(in_size, seg_size, order, bound);
+    if (nseg > INT_MAX)
+        return NULL;
+
+    unsigned char *out_free = NULL;
+    if (!out) {
+        if (bnd > SIZE_MAX || !(out = out_free = malloc(bnd)))
+            return NULL;
+        *out_size = bnd;
+    } else if (*out_size < bnd) {
+        return NULL;
+    }
+
+    seg_job s = {in, out, in_size, seg_size, NULL, NULL, order, enc, NULL};
+    s.off = malloc((nseg+1) * sizeof(*s.off));
+    s.clen = malloc((nseg+1) * sizeof(*s.clen));
+    if (!s.off || !s.clen)
+        goto err;
+
+    // Compress to bound sized slots after the largest possible header,
+    // then close up the gaps.
+    s.off[0] = 10 + 5 + 5*nseg;
+    for (i = 0; i < nseg; i++) {
+        s.clen[i] = bound(seg_len(&s, i), order);
+        s.off[i+1] = s.off[i] + s.clen[i];
+    }
+
+    if (htscodecs_run_jobs(nthreads, nseg, seg_enc_job, &s) < 0)
+        goto err;
+
+    unsigned char *cp = out, *out_end = out + *out_size;
+    cp += var_put_u64(cp, out_end, in_size);
+    cp += var_put_u32(cp, out_end, seg_size);
+    for (i = 0; i < nseg; i++) {
+        if (!s.clen[i])
+            goto err;
+        cp += var_put_u32(cp, out_end, s.clen[i]);
+    }
+    for (i = 0; i < nseg; i++) {
+        memmove(cp, out + s.off[i], s.clen[i]);
+        cp += s.clen[i];
+    }
+
+    *out_size = cp - out;
+    free(s.off);
+    free(s.clen);
+    return out;
+
+ err:
+    free(s.off);
+    free(s.clen);
+    free(out_free);
+    return NULL;
+}
+
+unsigned char *htscodecs_seg_uncompress(unsigned char *in, uint64_t in_size,
+                                        unsigned char *out,
+                                        uint64_t *out_size, int nthreads,
+                                        htscodecs_dec_func dec) {
+    unsigned char *cp = in, *in_end = in + in_size, *out_free = NULL;
+    uint64_t size, nseg, i;
+    uint32_t seg_size;
+
+    cp += var_get_u64(cp, in_end, &size);
+    cp += var_get_u32(cp, in_end, &seg_size);
+    if (seg_size == 0 || seg_size > SEG_MAX)
+        return NULL;
+
+    // Every segment needs at least a one byte size
+    nseg = (size + seg_size-1) / seg_size;
+    if (nseg > (uint64_t)(in_end - cp) || nseg > INT_MAX)
+        return NULL;
+
+    if (!out) {
+        if (size >= SIZE_MAX || !(out = out_free = malloc(size ? size : 1)))
+            return NULL;
+    } else if (*out_size < size) {
+        return NULL;
+    }
+
+    seg_job s = {in, out, size, seg_size, NULL, NULL, 0, NULL, dec};
+    s.off = malloc((nseg+1) * sizeof(*s.off));
+    s.clen = malloc((nseg+1) * sizeof(*s.clen));
+    if (!s.off || !s.clen)
+        goto err;
+
+    for (i = 0; i < nseg; i++) {
+        uint32_t clen;
+        int n = var_get_u32(cp, in_end, &clen);
+        if (!n || !clen)
+            goto err;
+        cp += n;
+        s.clen[i] = clen;
+    }
+    uint64_t off = cp - in;
+    for (i = 0; i < nseg; i++) {
+        s.off[i] = off;
+        off += s.clen[i];
+    }
+    if (off > in_size)
+        goto err;
+
+    if (htscodecs_run_jobs(nthreads, nseg, seg_dec_job, &s) < 0)
+        goto err;
+    for (i = 0; i < nseg; i++)
+        if (!s.clen[i])
+            goto err;
+
+    *out_size = size;
+    free(s.off);
+    free(s.clen);
+    return out;
+
+ err:
+    free(s.off);
+    free(s.clen);
+    free(out_free);
+    return NULL;
+}
@@ -34,6 +34,7 @@
 #ifndef RANS_UTILS_H
 #define RANS_UTILS_H
 
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
@@ -64,6 +65,89 @@ void *htscodecs_tls_alloc(size_t size);
 void *htscodecs_tls_calloc(size_t nmemb, size_t size);
 void  htscodecs_tls_free(void *ptr);
 
+/*
+ * Runs func(arg, job) for every job in [0, njobs), using up to nthreads
+ * threads.  Jobs are handed out in order, but may complete in any order.
+ * The function returns once all jobs have finished, so callers that need
+ * deterministic output should write per-job results to separate buffers
+ * and merge them afterwards.
+ *
+ * With nthreads <= 1, or when built with NO_THREADS, the jobs are
+ * executed serially in the calling thread.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int htscodecs_run_jobs(int nthreads, int njobs,
+                       void (*func)(void *arg, int job), void *arg);
+
+/*
+ * Estimates the compressed size in bytes of in[] for each of the nmeth
+ * methods in meth[], without compressing the data.  Methods are order
+ * bytes as used by rANS 4x16 and the arithmetic coder, and may combine
+ * order-0/1 with the PACK (128), RLE (64) and STRIPE (8) transforms.
+ * These are derived from order-0 and order-1 histograms of the data,
+ * and of its bit-packed form for the PACK methods.
+ *
+ * Methods using any other bits (eg X32 or an external codec) cannot be
+ * estimated and are given a cost of -1.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int htscodecs_est_methods(unsigned char *in, unsigned int in_size,
+                          const int *meth, int nmeth, double *est);
+
+/*
+ * Picks which of the nmeth methods are worth trial compressing: the k
+ * with the smallest estimated sizes, plus any that cannot be estimated.
+ * On return sel[i] is 1 for selected methods and 0 otherwise.
+ *
+ * Returns the number of methods selected, or -1 on failure.
+ */
+int htscodecs_pick_methods(unsigned char *in, unsigned int in_size,
+                           const int *meth, int nmeth, int k, int *sel);
+
+/*
+ * Segmented coding of inputs too large for the 32-bit block interfaces.
+ *
+ * The input is split into seg_size byte segments (0 meaning the default
+ * of 256MB), each compressed independently with enc().  The stored
+ * format is the total size (u64 varint), seg_size (u32 varint), the
+ * compressed size of every segment (u32 varints) and then the segments
+ * themselves.  As all offsets are known up front, segments are encoded
+ * and decoded on up to nthreads threads.
+ *
+ * htscodecs_seg_bound gives the worst case compressed size, using the
+ * codec's own bound() for each segment.  seg_size may not exceed 1GB.
+ *
+ * With out == NULL the output buffer is allocated here, otherwise
+ * *out_size is its size on input.  On success *out_size is set to the
+ * used size and out returned, otherwise NULL.
+ */
+typedef unsigned char *(*htscodecs_enc_func)(unsigned char *in,
+                                             unsigned int in_size,
+                                             unsigned char *out,
+                                             unsigned int *out_size,
+                                             int order);
+typedef unsigned char *(*htscodecs_dec_func)(unsigned char *in,
+                                             unsigned int in_size,
+                                             unsigned char *out,
+                                             unsigned int *out_size);
+
+uint64_t htscodecs_seg_bound(uint64_t size, uint32_t seg_size, int order,
+                             unsigned int (*bound)(unsigned int size,
+                                                   int order));
+unsigned char *htscodecs_seg_compress(unsigned char *in, uint64_t in_size,
+                                      unsigned char *out, uint64_t *out_size,
+                                      int order, uint32_t seg_size,
+                                      int nthreads,
+                                      unsigned int (*bound)(unsigned int size,
+                                                            int order),
+                                      htscodecs_enc_func enc);
+unsigned char *htscodecs_seg_uncompress(unsigned char *in, uint64_t in_size,
+                                        unsigned char *out,
+                                        uint64_t *out_size, int nthreads,
+                                        htscodecs_dec_func dec);
+
 
 /* Fast approximate log base 2 */
 static inline double fast_log(double a) {
@@ -177,25 +261,31 @@ int hist8(unsigned char *in, unsigned int in_size, uint32_t F0[256]) {
         }
         htscodecs_tls_free(f0);
     } else {
+        // One table per byte of a 64-bit word.  Runs of a symbol otherwise
+        // serialise on the load/increment/store of a single counter.
         uint32_t F1[256+MAGIC] = {0}, F2[256+MAGIC] = {0}, F3[256+MAGIC] = {0};
+        uint32_t F4[256+MAGIC] = {0}, F5[256+MAGIC] = {0}, F6[256+MAGIC] = {0};
+        uint32_t F7[256+MAGIC] = {0};
         uint32_t i, i8 = in_size & ~7;
 
         for (i = 0; i < i8; i+=8) {
-            F0[in[i+0]]++;
-            F1[in[i+1]]++;
-            F2[in[i+2]]++;
-            F3[in[i+3]]++;
-            F0[in[i+4]]++;
-            F1[in[i+5]]++;
-            F2[in[i+6]]++;
-            F3[in[i+7]]++;
+            uint64_t w;
+            memcpy(&w, in+i, 8);
+            F0[(w >>  0) & 0xff]++;
+            F1[(w >>  8) & 0xff]++;
+            F2[(w >> 16) & 0xff]++;
+            F3[(w >> 24) & 0xff]++;
+            F4[(w >> 32) & 0xff]++;
+            F5[(w >> 40) & 0xff]++;
+            F6[(w >> 48) & 0xff]++;
+            F7[(w >> 56)       ]++;
         }
 
         while (i < in_size)
             F0[in[i++]]++;
 
         for (i = 0; i < 256; i++)
-            F0[i] += F1[i] + F2[i] + F3[i];
+            F0[i] += F1[i] + F2[i] + F3[i] + F4[i] + F5[i] + F6[i] + F7[i];
     }
 
     return 0;
@@ -216,14 +306,16 @@ double hist8e(unsigned char *in, unsigned int in_size, uint32_t F0[256]) {
 
     unsigned int i, i8 = in_size & ~7;
     for (i = 0; i < i8; i+=8) {
-        F0[in[i+0]]++;
-        F1[in[i+1]]++;
-        F2[in[i+2]]++;
-        F3[in[i+3]]++;
-        F4[in[i+4]]++;
-        F5[in[i+5]]++;
-        F6[in[i+6]]++;
-        F7[in[i+7]]++;
+        uint64_t w;
+        memcpy(&w, in+i, 8);
+        F0[(w >>  0) & 0xff]++;
+        F1[(w >>  8) & 0xff]++;
+        F2[(w >> 16) & 0xff]++;
+        F3[(w >> 24) & 0xff]++;
+        F4[(w >> 32) & 0xff]++;
+        F5[(w >> 40) & 0xff]++;
+        F6[(w >> 48) & 0xff]++;
+        F7[(w >> 56)       ]++;
     }
     while (i < in_size)
         F0[in[i++]]++;
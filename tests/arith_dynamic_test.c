@@ -81,12 +81,51 @@ static unsigned char *load(FILE *infp, uint32_t *lenp) {
     return data;
 }
 
+/*
+ * A toy run-length codec, registered with -x to exercise the external
+ * codec interface.  Output is magic then (run length, symbol) pairs.
+ */
+static int rle_compress(void *data, unsigned char *in, unsigned int in_size,
+                        unsigned char *out, unsigned int *out_size) {
+    unsigned int i = 0, j = 4;
+    if (*out_size < 4)
+        return -1;
+    memcpy(out, "xRL1", 4);
+    while (i < in_size) {
+        int run = 1;
+        while (run < 255 && i+run < in_size && in[i+run] == in[i])
+            run++;
+        if (j+2 > *out_size)
+            return -1;
+        out[j++] = run;
+        out[j++] = in[i];
+        i += run;
+    }
+    *out_size = j;
+    return 0;
+}
+
+static int rle_uncompress(void *data, unsigned char *in, unsigned int in_size,
+                          unsigned char *out, unsigned int *out_size) {
+    unsigned int i, j = 0;
+    for (i = 4; i+1 < in_size; i += 2) {
+        if (j + in[i] > *out_size)
+            return -1;
+        memset(out+j, in[i+1], in[i]);
+        j += in[i];
+    }
+    *out_size = j;
+    return 0;
+}
+
 int main(int argc, char **argv) {
     int opt, order = 0;
     int decode = 0, test = 0;
     FILE *infp = stdin, *outfp = stdout;
     struct timeval tv1, tv2, tv3, tv4;
     size_t bytes = 0, raw = 0;
+    uint32_t seg_size = 0;
+    int nthreads = 1;
 
     in_buf = malloc(BLK_SIZE2+257*257*3);
 
@@ -98,7 +137,7 @@ int main(int argc, char **argv) {
     extern char *optarg;
     extern int optind;
 
-    while ((opt = getopt(argc, argv, "o:dtr")) != -1) {
+    while ((opt = getopt(argc, argv, "o:dtrS:@:x")) != -1) {
         switch (opt) {
         case 'o': {
             char *optend;
@@ -119,6 +158,26 @@ int main(int argc, char **argv) {
         case 'r':
             raw = 1;
             break;
+
+        case 'S':
+            // Use the segmented 64-bit interface; implies -r
+            seg_size = atoi(optarg);
+            raw = 1;
+            break;
+
+        case '@':
+            nthreads = atoi(optarg);
+            break;
+
+        case 'x': {
+            arith_ext_codec rle = {"rle", "xRL1", 4, NULL,
+                                   rle_compress, rle_uncompress};
+            if (arith_register_ext(&rle) < 0) {
+                fprintf(stderr, "Failed to register external codec\n");
+                exit(1);
+            }
+            break;
+        }
         }
     }
 
@@ -181,7 +240,8 @@ int main(int argc, char **argv) {
             out_sz = 0;
             for (i = 0; i < nb; i++) {
                 unsigned int csz = bc[i].sz;
-                bc[i].blk = arith_compress_to(b[i].blk, b[i].sz, bc[i].blk, &csz, order);
+                bc[i].blk = arith_compress_to_mt(b[i].blk, b[i].sz, bc[i].blk,
+                                                 &csz, order, nthreads);
                 assert(csz <= bc[i].sz);
                 out_sz += 5 + csz;
             }
@@ -194,7 +254,9 @@ int main(int argc, char **argv) {
             gettimeofday(&tv3, NULL);
 
             for (i = 0; i < nb; i++)
-                bu[i].blk = arith_uncompress_to(bc[i].blk, bc[i].sz, bu[i].blk, &bu[i].sz);
+                bu[i].blk = arith_uncompress_to_mt(bc[i].blk, bc[i].sz,
+                                                   bu[i].blk, &bu[i].sz,
+                                                   nthreads);
 
             gettimeofday(&tv4, NULL);
 
@@ -223,14 +285,28 @@ int main(int argc, char **argv) {
         unsigned char *in = load(infp, &in_size), *out;
         if (!in) exit(1);
 
-        if (decode) {
-            if (!(out = arith_uncompress(in, in_size, &out_size)))
+        if (seg_size) {
+            uint64_t out_size64;
+            out = decode
+                ? arith_uncompress_to_64(in, in_size, NULL, &out_size64,
+                                         nthreads)
+                : arith_compress_to_64(in, in_size, NULL, &out_size64, order,
+                                       seg_size, nthreads);
+            if (!out)
+                exit(1);
+
+            fwrite(out, 1, out_size64, outfp);
+            bytes = decode ? out_size64 : in_size;
+        } else if (decode) {
+            if (!(out = arith_uncompress_to_mt(in, in_size, NULL, &out_size,
+                                               nthreads)))
                 exit(1);
 
             fwrite(out, 1, out_size, outfp);
             bytes = out_size;
         } else {
-            if (!(out = arith_compress(in, in_size, &out_size, order)))
+            if (!(out = arith_compress_to_mt(in, in_size, NULL, &out_size,
+                                             order, nthreads)))
                 exit(1);
 
             fwrite(out, 1, out_size, outfp);
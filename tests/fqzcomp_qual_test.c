@@ -320,7 +320,7 @@ int main(int argc, char **argv) {
     unsigned char *in, *out;
     size_t in_len, out_len;
     int decomp = 0, vers = 4;  // CRAM version 4.0 (4) or 3.1 (3)
-    int strat = 0, raw = 0;
+    int strat = 0, raw = 0, nthreads = 1, session_recs = 0, nblocks = 1;
     fqz_gparams *gp = NULL, gp_local;
     uint32_t blk_size = BLK_SIZE; // MAX
 
@@ -333,7 +333,7 @@ int main(int argc, char **argv) {
     extern int optind;
     int opt;
 
-    while ((opt = getopt(argc, argv, "ds:s:b:rx:")) != -1) {
+    while ((opt = getopt(argc, argv, "ds:s:b:rx:@:S:B:")) != -1) {
         switch (opt) {
         case 'd':
             decomp = 1;
@@ -369,6 +369,20 @@ int main(int argc, char **argv) {
         case 'r':
             raw = 1;
             break;
+
+        case '@':
+            nthreads = atoi(optarg);
+            break;
+
+        case 'B':
+            // Independently coded groups of records
+            nblocks = atoi(optarg);
+            break;
+
+        case 'S':
+            // Slices of this many records, compressed in one session
+            session_recs = atoi(optarg);
+            break;
         }
     }
 
@@ -398,7 +412,7 @@ int main(int argc, char **argv) {
             fprintf(stderr, "out_len %ld, in_len %ld\n", (long)out_len, (long)in2_len);
 
             int *lengths = malloc(MAX_REC * sizeof(int));
-            out = (unsigned char *)fqz_decompress((char *)in2, in_len-(raw?0:8), &out_len, lengths, MAX_REC);
+            out = (unsigned char *)fqz_decompress_mt((char *)in2, in2_len, &out_len, lengths, MAX_REC, nthreads);
             if (!out) {
                 fprintf(stderr, "Failed to decompress\n");
                 return 1;
@@ -420,9 +434,51 @@ int main(int argc, char **argv) {
             in_len -= in2_len+(raw?0:8);
 
             free(lengths);
+        }
+    } else if (session_recs > 0) {
+        // Blocks of session_recs records, sharing parameters via a session
+        int nlines = count_lines(in, in_len);
+        fprintf(stderr, "nlines=%d\n", nlines);
+        int *rec_len = calloc(nlines, sizeof(*rec_len));
+        int *rec_r2  = calloc(nlines, sizeof(*rec_r2));
+        int *rec_sel = calloc(nlines, sizeof(*rec_sel));
+        parse_lines(in, in_len, rec_len, rec_r2, rec_sel, &in_len);
 
-            break; // One cycle only until we fix blocking to be \n based
+        fqz_session *z = fqz_session_create(vers, strat, nthreads,
+                                            FQZ_SESSION_DRIFT);
+        if (!z)
+            return 1;
+
+        unsigned char *in2 = in;
+        long t_out = 0;
+        int r, i;
+        for (r = 0; r < nlines; r += session_recs) {
+            int n = MIN(session_recs, nlines - r);
+            size_t in2_len = 0;
+            for (i = 0; i < n; i++)
+                in2_len += rec_len[r+i];
+
+            fqz_slice *s = fake_slice(in2_len, rec_len+r, rec_r2+r,
+                                      rec_sel+r, n);
+            out = (unsigned char *)fqz_session_compress(z, s, (char *)in2,
+                                                        in2_len, &out_len);
+            if (!out)
+                return 1;
+
+            uint32_t u32;
+            u32 = in2_len; if (write(1, &u32, 4) != 4) return 1;
+            u32 = out_len; if (write(1, &u32, 4) != 4) return 1;
+            if (write(1, out, out_len) < 0) return 1;
+            free(out);
+            in2 += in2_len;
+            t_out += out_len + 8;
         }
+
+        fqz_session_destroy(z);
+        free(rec_len);
+        free(rec_r2);
+        free(rec_sel);
+        fprintf(stderr, "Total output = %ld\n", t_out);
     } else {
         // Convert from ASCII newline separated file to binary block.
         // We return an array of line lengths and optionally param selectors.
@@ -443,7 +499,7 @@ int main(int argc, char **argv) {
             if (gp == &gp_local)
                 if (fqz_manual_parameters(gp, s, in2, in2_len) < 0)
                     return 1;
-            out = (unsigned char *)fqz_compress(vers, s, (char *)in2, in2_len, &out_len, strat, gp);
+            out = (unsigned char *)fqz_compress_blocks(vers | (nblocks > 1 ? FQZ_MULTI_BLOCK : 0), s, (char *)in2, in2_len, &out_len, strat, gp, nblocks, nthreads);
 
             // Write out 32-bit sizes.
             if (!raw) {
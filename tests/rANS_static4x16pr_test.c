@@ -43,6 +43,7 @@
 #include <sys/time.h>
 
 #include "htscodecs/rANS_static4x16.h"
+#include "htscodecs/utils.h"
 
 #ifndef BLK_SIZE
 // Divisible by 4 for X4.
@@ -78,13 +79,74 @@ static unsigned char *load(FILE *infp, uint32_t *lenp) {
     return data;
 }
 
+// Registers a shared model built from the contents of fn as model 0.
+static int add_model(rans_ctx *ctx, char *fn, int order) {
+    FILE *fp = fopen(fn, "rb");
+    if (!fp) {
+        perror(fn);
+        return -1;
+    }
+
+    uint32_t len, i;
+    unsigned char *data = load(fp, &len);
+    fclose(fp);
+
+    uint32_t *F = calloc(256*256, sizeof(*F));
+    if (!data || !F)
+        return -1;
+
+    if (order & 1) {
+        // All pairs, plus every symbol in context 0 for stream starts
+        for (i = 1; i < len; i++)
+            F[data[i-1]*256 + data[i]]++;
+        for (i = 0; i < len; i++)
+            F[data[i]] |= 1;
+    } else {
+        for (i = 0; i < len; i++)
+            F[data[i]]++;
+    }
+
+    int ret = rans_ctx_add_model(ctx, 0, order & 1, F) < 0 ||
+        rans_ctx_use_model(ctx, 0) < 0 ? -1 : 0;
+    free(F);
+    free(data);
+    return ret;
+}
+
+// Decodes one block via the incremental interface, chunk bytes at a time.
+static unsigned char *stream_decode(unsigned char *in, uint32_t in_size,
+                                    uint32_t *out_size, int chunk) {
+    rans_dec_stream *s = rans_dec_stream_init(in, in_size, 0);
+    if (!s)
+        return NULL;
+
+    uint32_t len = rans_dec_stream_size(s), pos = 0;
+    unsigned char *out = malloc(len ? len : 1);
+    int n;
+    while (out && (n = rans_dec_stream_read(s, out+pos, chunk)) > 0)
+        pos += n;
+    rans_dec_stream_destroy(s);
+
+    if (!out || n < 0 || pos != len) {
+        free(out);
+        return NULL;
+    }
+    *out_size = len;
+    return out;
+}
+
 int main(int argc, char **argv) {
-    int opt, order = 0;
+    int opt, order = 0, est_k = 0;
     int decode = 0, test = 0;
     FILE *infp = stdin, *outfp = stdout;
     struct timeval tv1, tv2, tv3, tv4;
     size_t bytes = 0, raw = 0;
     uint32_t blk_size = BLK_SIZE;
+    int nthreads = 1, chunk = 0, kernel = 0, estimate = 0;
+    uint32_t seg_size = 0;
+    int batch = 0;
+    rans_ctx *ctx = NULL;
+    char *model_fn = NULL;
 
 #ifdef _WIN32
         _setmode(_fileno(stdin),  _O_BINARY);
@@ -97,7 +159,7 @@ int main(int argc, char **argv) {
     extern void rans_disable_avx512(void);
     extern void rans_disable_avx2(void);
 
-    while ((opt = getopt(argc, argv, "o:dtrc:b:")) != -1) {
+    while ((opt = getopt(argc, argv, "o:dtrc:C:kEab:@:xm:e:s:S:B:")) != -1) {
         switch (opt) {
         case 'o': {
             char *optend;
@@ -108,10 +170,39 @@ int main(int argc, char **argv) {
             break;
         }
 
+        case 'e':
+            est_k = atoi(optarg);
+            break;
+
         case 'c':
             rans_set_cpu(strtol(optarg, NULL, 0));
             break;
 
+        case 'C':
+            // CPU mask for this context only; implies -x
+            if (!ctx && !(ctx = rans_ctx_create()))
+                return 1;
+            rans_ctx_set_cpu(ctx, strtol(optarg, NULL, 0));
+            break;
+
+        case 'k':
+            // Report the kernel selected for -o and -d
+            kernel = 1;
+            break;
+
+        case 'E':
+            // Report the estimated size of the whole input with -o
+            estimate = 1;
+            break;
+
+        case 'a':
+            // Benchmark the kernels first
+            if (rans_autotune() < 0) {
+                fprintf(stderr, "Autotuning failed\n");
+                return 1;
+            }
+            break;
+
         case 'd':
             decode = 1;
             break;
@@ -127,9 +218,56 @@ int main(int argc, char **argv) {
         case 'b':
             blk_size = atoi(optarg);
             break;
+
+        case '@':
+            nthreads = atoi(optarg);
+            break;
+
+        case 'x':
+            // Reuse a context between blocks
+            if (!ctx && !(ctx = rans_ctx_create()))
+                return 1;
+            break;
+
+        case 's':
+            // Incremental decoding, in chunks of this size
+            chunk = atoi(optarg);
+            break;
+
+        case 'S':
+            // Use the segmented 64-bit interface; implies -r
+            seg_size = atoi(optarg);
+            raw = 1;
+            break;
+
+        case 'B':
+            // Compress this many blocks at a time with the batch API
+            batch = atoi(optarg);
+            break;
+
+        case 'm':
+            // Shared model trained on a file; implies -x
+            model_fn = optarg;
+            if (!ctx && !(ctx = rans_ctx_create()))
+                return 1;
+            break;
         }
     }
 
+    if (est_k)
+        order |= RANS_ORDER_STRIPE_EST_K(est_k);
+
+    if (kernel) {
+        printf("0x%x\n", rans_cpu_kernel(ctx, order, decode));
+        rans_ctx_destroy(ctx);
+        return 0;
+    }
+
+    if (model_fn && add_model(ctx, model_fn, order) < 0) {
+        fprintf(stderr, "Failed to add model from %s\n", model_fn);
+        return 1;
+    }
+
     // Room to allow for expanded BLK_SIZE on worst case compression.
     uint32_t blk_size2 = (105LL*blk_size)/100;
     in_buf = malloc(blk_size2+257*257*3);
@@ -150,6 +288,17 @@ int main(int argc, char **argv) {
         optind++;
     }
 
+    if (estimate) {
+        uint32_t in_size;
+        unsigned char *in = load(infp, &in_size);
+        double est;
+        if (!in || htscodecs_est_methods(in, in_size, &order, 1, &est) < 0)
+            return 1;
+        fprintf(outfp, "%.0f\n", est);
+        free(in);
+        return 0;
+    }
+
     gettimeofday(&tv1, NULL);
 
     if (test) {
@@ -211,7 +360,13 @@ int main(int argc, char **argv) {
             out_sz = 0;
             for (i = 0; i < nb; i++) {
                 unsigned int csz = bc[i].sz;
-                bc[i].blk = rans_compress_to_4x16(b[i].blk, b[i].sz, bc[i].blk, &csz, order);
+                bc[i].blk = ctx
+                    ? rans_compress_to_4x16_ctx_mt(ctx, b[i].blk, b[i].sz,
+                                                   bc[i].blk, &csz, order,
+                                                   nthreads)
+                    : rans_compress_to_4x16_mt(b[i].blk, b[i].sz,
+                                               bc[i].blk, &csz, order,
+                                               nthreads);
                 assert(csz <= bc[i].sz);
                 bc[i].csz = csz;
                 out_sz += 5 + csz;
@@ -225,7 +380,13 @@ int main(int argc, char **argv) {
             gettimeofday(&tv3, NULL);
 
             for (i = 0; i < nb; i++)
-                bu[i].blk = rans_uncompress_to_4x16(bc[i].blk, bc[i].csz, bu[i].blk, &bu[i].sz);
+                bu[i].blk = ctx
+                    ? rans_uncompress_to_4x16_ctx_mt(ctx, bc[i].blk, bc[i].csz,
+                                                     bu[i].blk, &bu[i].sz,
+                                                     nthreads)
+                    : rans_uncompress_to_4x16_mt(bc[i].blk, bc[i].csz,
+                                                 bu[i].blk, &bu[i].sz,
+                                                 nthreads);
 
             gettimeofday(&tv4, NULL);
 
@@ -263,14 +424,32 @@ int main(int argc, char **argv) {
         // sanitizer to check for input buffer overruns.
         in = realloc(in, in_size);
 
-        if (decode) {
-            if (!(out = rans_uncompress_4x16(in, in_size, &out_size)))
+        if (seg_size) {
+            uint64_t out_size64;
+            out = decode
+                ? rans_uncompress_to_4x16_64(in, in_size, NULL, &out_size64,
+                                             nthreads)
+                : rans_compress_to_4x16_64(in, in_size, NULL, &out_size64,
+                                           order, seg_size, nthreads);
+            if (!out)
+                exit(1);
+
+            fwrite(out, 1, out_size64, outfp);
+            bytes = decode ? out_size64 : in_size;
+        } else if (decode) {
+            if (chunk)
+                out = stream_decode(in, in_size, &out_size, chunk);
+            else
+                out = rans_uncompress_to_4x16_mt(in, in_size, NULL,
+                                                 &out_size, nthreads);
+            if (!out)
                 exit(1);
 
             fwrite(out, 1, out_size, outfp);
             bytes = out_size;
         } else {
-            if (!(out = rans_compress_4x16(in, in_size, &out_size, order)))
+            if (!(out = rans_compress_to_4x16_mt(in, in_size, NULL, &out_size,
+                                                 order, nthreads)))
                 exit(1);
 
             fwrite(out, 1, out_size, outfp);
@@ -298,7 +477,13 @@ int main(int argc, char **argv) {
                     fprintf(stderr, "Truncated input\n");
                     exit(1);
                 }
-                out = rans_uncompress_4x16(in_buf, in_size, &out_size);
+                out = chunk
+                    ? stream_decode(in_buf, in_size, &out_size, chunk)
+                    : ctx
+                    ? rans_uncompress_to_4x16_ctx_mt(ctx, in_buf, in_size, NULL,
+                                                     &out_size, nthreads)
+                    : rans_uncompress_to_4x16_mt(in_buf, in_size, NULL,
+                                                 &out_size, nthreads);
                 if (!out)
                     exit(1);
 
@@ -308,6 +493,44 @@ int main(int argc, char **argv) {
 
                 bytes += out_size;
             }
+        } else if (batch > 0) {
+            rans_batch_job *jobs = calloc(batch, sizeof(*jobs));
+            int nj, i;
+            if (!jobs)
+                exit(1);
+
+            do {
+                for (nj = 0; nj < batch; nj++) {
+                    unsigned char *blk = malloc(blk_size);
+                    if (!blk)
+                        exit(1);
+                    jobs[nj].in = blk;
+                    jobs[nj].in_size = fread(blk, 1, blk_size, infp);
+                    jobs[nj].order = jobs[nj].in_size < 4 ? order & ~1 : order;
+                    if (jobs[nj].in_size == 0) {
+                        free(blk);
+                        break;
+                    }
+                }
+                if (nj == 0)
+                    break;
+
+                size_t arena_size = rans_compress_batch_bound_4x16(jobs, nj);
+                unsigned char *arena = malloc(arena_size);
+                if (!arena ||
+                    rans_compress_batch_4x16(jobs, nj, arena, &arena_size,
+                                             nthreads) < 0)
+                    exit(1);
+
+                for (i = 0; i < nj; i++) {
+                    fwrite(&jobs[i].out_size, 1, 4, outfp);
+                    fwrite(jobs[i].out, 1, jobs[i].out_size, outfp);
+                    bytes += jobs[i].in_size;
+                    free(jobs[i].in);
+                }
+                free(arena);
+            } while (nj == batch);
+            free(jobs);
         } else {
             for (;;) {
                 uint32_t in_size, out_size;
@@ -320,7 +543,11 @@ int main(int argc, char **argv) {
                 if (in_size < 4)
                     order &= ~1;
 
-                out = rans_compress_4x16(in_buf, in_size, &out_size, order);
+                out = ctx
+                    ? rans_compress_to_4x16_ctx_mt(ctx, in_buf, in_size, NULL,
+                                                   &out_size, order, nthreads)
+                    : rans_compress_to_4x16_mt(in_buf, in_size, NULL,
+                                               &out_size, order, nthreads);
 
                 fwrite(&out_size, 1, 4, outfp);
                 fwrite(out, 1, out_size, outfp);
@@ -339,6 +566,7 @@ int main(int argc, char **argv) {
             (double)bytes / ((long)(tv2.tv_sec - tv1.tv_sec)*1000000 +
                              tv2.tv_usec - tv1.tv_usec));
 
+    rans_ctx_destroy(ctx);
     free(in_buf);
     return 0;
 }
@@ -88,7 +88,7 @@ static int encode(int argc, char **argv) {
     FILE *fp;
     int len, level = 9;
     int use_arith = 0;
-    int raw = 0;
+    int raw = 0, est = 0;
 
     while (argc > 1 && argv[1][0] == '-') {
         if (strcmp(argv[1], "-r") == 0) {
@@ -97,6 +97,12 @@ static int encode(int argc, char **argv) {
             argv++;
         }
 
+        else if (strcmp(argv[1], "-e") == 0) {
+            est = TOK3_LEVEL_EST;
+            argc--;
+            argv++;
+        }
+
         else if (argv[1][1] >= '0' && argv[1][1] <= '9') {
             level = atoi(argv[1]+1);
             if (level > 10) {
@@ -110,6 +116,7 @@ static int encode(int argc, char **argv) {
         else
             exit(1);
     }
+    level |= est;
 
     if (argc > 1) {
         fp = fopen(argv[1], "r");